@@ -0,0 +1,475 @@
+#include "Broker/broker.h"
+#include "Utils/proto.h"
+#include "Utils/utils.h"
+
+#include <inttypes.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+#define OUT "msgq-bench"
+
+#define MIN_MSG_LEN   16 // room for the send time
+#define SUB_BUCKETS   16 // latency buckets per power of two
+#define LAT_BUCKETS   (64 * SUB_BUCKETS)
+#define RECV_TIMEOUT  200 // ms, how often a subscriber checks if the run is over
+#define DRAIN_SECONDS 2   // time given to subscribers to catch up once publishing stops
+#define FOLLOW_MAX    1   // redirects followed when looking for the owner of a topic
+
+// settings of a run
+typedef struct Config {
+    int      pubs;     // publisher connections
+    int      subs;     // subscriber connections
+    int      ntopics;  // topics the connections are spread over
+    uint32_t size;     // message size
+    double   rate;     // messages per second per publisher, 0 for as fast as possible
+    uint32_t batch;    // messages per publish frame
+    uint32_t window;   // publish frames in flight
+    int      duration; // seconds
+    pid_t    broker;   // pid of the broker for CPU accounting, 0 if unknown
+    bool     shm;      // ask for shared memory (FEAT_SHM)
+    Owner    addr;       // broker given, topics may be owned by others
+    char     prefix[32]; // topic names are <prefix>.<i>, unique per run
+} Config;
+
+// one connection, run by its own thread
+typedef struct Worker {
+    pthread_t        tid;
+    int              id;
+    _Atomic uint64_t msgs; // read by main while subscribers run
+    uint64_t         bytes;
+    uint64_t         errors;
+    uint64_t         lat[LAT_BUCKETS]; // subscribers only
+} Worker;
+
+static Config      cfg;
+static atomic_bool publishing = true;
+static atomic_bool running    = true;
+static atomic_bool unshared; // a connection asked for shared memory and did not get it
+
+static void     usage();
+static int      connBroker(const Owner *o, const bool sub);
+static int      connTopic(const char *topic, const bool sub, Buffer *out, Buffer *in);
+static void    *runPublisher(void *arg);
+static void    *runSubscriber(void *arg);
+static uint64_t nowNs();
+static void     sleepUntil(const uint64_t ns);
+static uint     latBucket(const uint64_t ns);
+static uint64_t latValue(const uint b);
+static uint64_t percentile(const uint64_t *lat, const uint64_t total, const double p);
+static double   brokerCpu();
+static double   selfCpu();
+
+int main(int argc, char **argv) {
+
+    cfg = (Config){.pubs = 1, .subs = 1, .ntopics = 1, .size = 128, .batch = 1, .window = 64, .duration = 10};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:s:n:m:r:b:w:d:P:S")) != -1) {
+        switch (opt) {
+        case 'p':
+            cfg.pubs = atoi(optarg);
+            break;
+        case 's':
+            cfg.subs = atoi(optarg);
+            break;
+        case 'n':
+            cfg.ntopics = atoi(optarg);
+            break;
+        case 'm':
+            cfg.size = atoi(optarg);
+            break;
+        case 'r':
+            cfg.rate = atof(optarg);
+            break;
+        case 'b':
+            cfg.batch = atoi(optarg);
+            break;
+        case 'w':
+            cfg.window = atoi(optarg);
+            break;
+        case 'd':
+            cfg.duration = atoi(optarg);
+            break;
+        case 'P':
+            cfg.broker = atoi(optarg);
+            break;
+        case 'S':
+            cfg.shm = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 1 || cfg.pubs < 1 || cfg.subs < 0 || cfg.ntopics < 1 || cfg.size < MIN_MSG_LEN ||
+        cfg.size > MSG_MAXLEN || cfg.rate < 0 || cfg.batch < 1 || cfg.window < 1 || cfg.duration < 1 ||
+        (uint64_t)cfg.batch * (cfg.size + sizeof(uint32_t)) > MSG_MAXLEN)
+        usage();
+
+    if (!proto_parseAddr(argv[optind], &cfg.addr))
+        usage();
+    snprintf(cfg.prefix, sizeof cfg.prefix, "bench.%d", (int)getpid());
+
+    signal(SIGPIPE, SIG_IGN);
+
+    Worker *pubs = calloc(cfg.pubs, sizeof *pubs);
+    Worker *subs = calloc(cfg.subs, sizeof *subs);
+
+    // subscribers are streaming before the first message goes out
+    for (int i = 0; i < cfg.subs; i++) {
+        subs[i].id = i;
+        if ((errno = pthread_create(&subs[i].tid, NULL, runSubscriber, &subs[i])) != 0)
+            perror_and_exit("could not start subscriber");
+    }
+    usleep(200 * 1000);
+
+    printf("%d publishers, %d subscribers, %d topics, %u byte messages, %u per frame, ", cfg.pubs, cfg.subs,
+           cfg.ntopics, cfg.size, cfg.batch);
+    if (cfg.rate > 0)
+        printf("%.0f msg/s per publisher\n", cfg.rate);
+    else
+        printf("unthrottled\n");
+    if (cfg.shm)
+        printf("over shared memory where the broker offers it\n");
+
+    double   cpu0 = brokerCpu(), self0 = selfCpu();
+    uint64_t t0   = nowNs();
+    for (int i = 0; i < cfg.pubs; i++) {
+        pubs[i].id = i;
+        if ((errno = pthread_create(&pubs[i].tid, NULL, runPublisher, &pubs[i])) != 0)
+            perror_and_exit("could not start publisher");
+    }
+
+    sleep(cfg.duration);
+    atomic_store(&publishing, false);
+    for (int i = 0; i < cfg.pubs; i++)
+        pthread_join(pubs[i].tid, NULL);
+    uint64_t t1 = nowNs();
+
+    // every message stored has to reach every subscriber of its topic
+    uint64_t expect = 0;
+    for (int i = 0; i < cfg.pubs; i++) {
+        int readers = cfg.subs / cfg.ntopics + ((i % cfg.ntopics) < cfg.subs % cfg.ntopics);
+        expect += pubs[i].msgs * readers;
+    }
+    for (uint64_t deadline = nowNs() + DRAIN_SECONDS * 1000000000ULL; nowNs() < deadline;) {
+        uint64_t got = 0;
+        for (int i = 0; i < cfg.subs; i++)
+            got += atomic_load_explicit(&subs[i].msgs, memory_order_relaxed);
+        if (got >= expect)
+            break;
+        usleep(10 * 1000);
+    }
+    atomic_store(&running, false);
+    for (int i = 0; i < cfg.subs; i++)
+        pthread_join(subs[i].tid, NULL);
+    uint64_t t2   = nowNs();
+    double   cpu1 = brokerCpu(), self1 = selfCpu();
+
+    uint64_t pmsgs = 0, pbytes = 0, perrs = 0, smsgs = 0, sbytes = 0;
+    uint64_t lat[LAT_BUCKETS] = {0};
+    for (int i = 0; i < cfg.pubs; i++) {
+        pmsgs += pubs[i].msgs;
+        pbytes += pubs[i].bytes;
+        perrs += pubs[i].errors;
+    }
+    for (int i = 0; i < cfg.subs; i++) {
+        smsgs += subs[i].msgs;
+        sbytes += subs[i].bytes;
+        for (uint b = 0; b < LAT_BUCKETS; b++)
+            lat[b] += subs[i].lat[b];
+    }
+
+    double pubsecs = (t1 - t0) / 1e9, subsecs = (t2 - t0) / 1e9;
+    if (atomic_load(&unshared))
+        printf(RED "\nsome connections stayed on their socket" RST);
+    printf("\npublished  %10" PRIu64 " msgs  %12.0f msg/s  %9.2f MB/s", pmsgs, pmsgs / pubsecs, pbytes / pubsecs / 1e6);
+    if (perrs > 0)
+        printf("  (" RED "%" PRIu64 " refused" RST ")", perrs);
+    printf("\ndelivered  %10" PRIu64 " msgs  %12.0f msg/s  %9.2f MB/s", smsgs, smsgs / subsecs, sbytes / subsecs / 1e6);
+    if (smsgs < expect)
+        printf("  (" RED "%" PRIu64 " missing" RST ")", expect - smsgs);
+    printf("\n");
+
+    if (smsgs > 0)
+        printf("latency    p50 %.1f us  p99 %.1f us  p999 %.1f us  max %.1f us\n", percentile(lat, smsgs, 0.50) / 1e3,
+               percentile(lat, smsgs, 0.99) / 1e3, percentile(lat, smsgs, 0.999) / 1e3,
+               percentile(lat, smsgs, 1.0) / 1e3);
+
+    // messages handled by the broker: each one stored, then sent to every reader
+    uint64_t handled = pmsgs + smsgs;
+    if (cfg.broker > 0 && cpu0 >= 0 && cpu1 >= 0 && handled > 0)
+        printf("broker CPU %.2f s  %.2f us/msg\n", cpu1 - cpu0, (cpu1 - cpu0) / handled * 1e6);
+    if (handled > 0)
+        printf("bench CPU  %.2f s  %.2f us/msg\n", self1 - self0, (self1 - self0) / handled * 1e6);
+
+    free(pubs);
+    free(subs);
+
+    return EXIT_SUCCESS;
+}
+
+static void usage() {
+    printf("Usage: " OUT " [-p <publishers>] [-s <subscribers>] [-n <topics>] [-m <message size>]\n"
+           "       [-r <msg/s per publisher, 0 for max>] [-b <messages per frame>] [-w <frames in flight>]\n"
+           "       [-d <seconds>] [-P <broker pid, for CPU per message>] [-S (shared memory)]\n"
+           "       <broker address>[:<publisher port>] | unix:<socket path>\n");
+    exit(EXIT_FAILURE);
+}
+
+static int connBroker(const Owner *o, const bool sub) {
+
+    int fd = proto_connect(o, sub);
+    if (fd == -1 && errno == EINVAL)
+        usage();
+    if (fd == -1)
+        perror_and_exit("Connect error");
+
+    const int on = 1;
+    if (!proto_isUnix(o))
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+
+    return fd;
+}
+
+// connection to the broker that owns a topic, starting from the one given
+static int connTopic(const char *topic, const bool sub, Buffer *out, Buffer *in) {
+
+    Owner at = cfg.addr;
+    for (int i = 0;; i++) {
+        int   fd = connBroker(&at, sub);
+        Owner o;
+        if (cfg.shm) {
+            int64_t got = proto_hello(fd, out, in, FEAT_SHM);
+            if (got == -1)
+                perror_and_exit("lost connection to broker");
+            if (!(got & FEAT_SHM))
+                atomic_store(&unshared, true);
+        }
+        if (!proto_locate(fd, out, in, topic, &o))
+            perror_and_exit("lost connection to broker");
+
+        if (i == FOLLOW_MAX || o.host[0] == '\0' || (strcmp(o.host, at.host) == 0 && o.pubport == at.pubport))
+            return fd;
+
+        proto_close(fd);
+        at = o;
+    }
+}
+
+// publishes to topic id % ntopics at the configured rate, with up to window frames unacknowledged
+static void *runPublisher(void *arg) {
+
+    Worker *w   = arg;
+    Buffer *out = buf_init(BUF_START_SIZE), *in = buf_init(BUF_START_SIZE);
+
+    char topic[TOPIC_MAXLEN + 1];
+    snprintf(topic, sizeof topic, "%s.%d", cfg.prefix, w->id % cfg.ntopics);
+    int fd = connTopic(topic, false, out, in);
+
+    char *msg = malloc(cfg.size);
+    memset(msg, 'x', cfg.size);
+
+    uint64_t start  = nowNs();
+    uint64_t sent   = 0; // frames
+    uint64_t acked  = 0;
+    double   period = (cfg.rate > 0) ? 1e9 * cfg.batch / cfg.rate : 0;
+
+    while (atomic_load_explicit(&publishing, memory_order_relaxed)) {
+        if (period > 0)
+            sleepUntil(start + (uint64_t)(sent * period));
+
+        size_t pos = proto_begin(out, (cfg.batch == 1) ? OP_PUBLISH : OP_PUBLISH_BATCH, 0);
+        proto_putStr(out, topic);
+        if (cfg.batch > 1) {
+            proto_putU64(out, sent);
+            proto_putU32(out, cfg.batch);
+        }
+        for (uint32_t i = 0; i < cfg.batch; i++) {
+            uint64_t now = nowNs();
+            memcpy(msg, &now, sizeof now);
+            if (cfg.batch > 1)
+                proto_putU32(out, cfg.size);
+            proto_putBytes(out, msg, cfg.size);
+        }
+        proto_end(out, pos);
+
+        if (!proto_send(fd, out))
+            perror_and_exit("error sending messages");
+        sent++;
+
+        // replies come back in order, one per frame
+        while (sent - acked >= cfg.window || (acked < sent && buf_len(in) >= FRAME_HDR_LEN)) {
+            Frame f;
+            if (!proto_recv(fd, in, &f))
+                perror_and_exit("lost connection to broker");
+            if (f.opcode == OP_ACK || f.opcode == OP_BATCH_ACK) {
+                w->msgs += cfg.batch;
+                w->bytes += (uint64_t)cfg.batch * cfg.size;
+            } else {
+                w->errors += cfg.batch;
+            }
+            proto_consume(in, &f);
+            acked++;
+        }
+    }
+
+    while (acked < sent) {
+        Frame f;
+        if (!proto_recv(fd, in, &f))
+            perror_and_exit("lost connection to broker");
+        if (f.opcode == OP_ACK || f.opcode == OP_BATCH_ACK) {
+            w->msgs += cfg.batch;
+            w->bytes += (uint64_t)cfg.batch * cfg.size;
+        } else {
+            w->errors += cfg.batch;
+        }
+        proto_consume(in, &f);
+        acked++;
+    }
+
+    free(msg);
+    buf_free(out);
+    buf_free(in);
+    proto_close(fd);
+
+    return NULL;
+}
+
+// streams topic id % ntopics and records how long each message took to arrive
+static void *runSubscriber(void *arg) {
+
+    Worker *w   = arg;
+    Buffer *out = buf_init(BUF_START_SIZE), *in = buf_init(BUF_START_SIZE);
+
+    char topic[TOPIC_MAXLEN + 1];
+    snprintf(topic, sizeof topic, "%s.%d", cfg.prefix, w->id % cfg.ntopics);
+    int fd = connTopic(topic, true, out, in);
+
+    struct timeval tv = {.tv_sec = 0, .tv_usec = RECV_TIMEOUT * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+    size_t pos = proto_begin(out, OP_SUBSCRIBE, 0);
+    proto_putStr(out, topic);
+    proto_putU64(out, 0);
+    proto_end(out, pos);
+    if (!proto_send(fd, out))
+        perror_and_exit("error subscribing");
+
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        Frame f;
+        errno = 0;
+        if (!proto_recv(fd, in, &f)) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                continue; // timed out, partial frames stay in the buffer
+            perror_and_exit("lost connection to broker");
+        }
+
+        if (f.opcode == OP_PUSH) {
+            char     name[TOPIC_MAXLEN + 1];
+            Reader   r = proto_reader(&f);
+            uint64_t sent;
+            proto_getStr(&r, name, sizeof name);
+            proto_getU64(&r);
+            if (!r.err && r.left >= sizeof sent) {
+                memcpy(&sent, r.p, sizeof sent);
+                uint64_t now = nowNs();
+                w->lat[latBucket(now > sent ? now - sent : 0)]++;
+                w->bytes += r.left;
+                atomic_fetch_add_explicit(&w->msgs, 1, memory_order_relaxed);
+            }
+        }
+        proto_consume(in, &f);
+    }
+
+    buf_free(out);
+    buf_free(in);
+    proto_close(fd);
+
+    return NULL;
+}
+
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleepUntil(const uint64_t ns) {
+    struct timespec ts = {.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+// log-linear buckets: SUB_BUCKETS per power of two, exact below SUB_BUCKETS ns
+static uint latBucket(const uint64_t ns) {
+
+    if (ns < SUB_BUCKETS)
+        return ns;
+
+    int      e    = 63 - __builtin_clzll(ns); // highest set bit, at least log2(SUB_BUCKETS)
+    int      sh   = e - __builtin_ctz(SUB_BUCKETS);
+    uint64_t frac = (ns >> sh) - SUB_BUCKETS; // next bits below the top one
+    uint     b    = (sh + 1) * SUB_BUCKETS + frac;
+
+    return (b < LAT_BUCKETS) ? b : LAT_BUCKETS - 1;
+}
+
+// upper edge of a bucket
+static uint64_t latValue(const uint b) {
+
+    if (b < SUB_BUCKETS)
+        return b;
+
+    int sh = b / SUB_BUCKETS - 1;
+    return ((uint64_t)(SUB_BUCKETS + b % SUB_BUCKETS + 1) << sh) - 1;
+}
+
+static uint64_t percentile(const uint64_t *lat, const uint64_t total, const double p) {
+
+    uint64_t rank = (uint64_t)(p * total);
+    if (rank >= total)
+        rank = total - 1;
+
+    uint64_t seen = 0;
+    for (uint b = 0; b < LAT_BUCKETS; b++) {
+        seen += lat[b];
+        if (seen > rank)
+            return latValue(b);
+    }
+
+    return latValue(LAT_BUCKETS - 1);
+}
+
+// user + system time of the broker in seconds, -1 if it cannot be read
+static double brokerCpu() {
+
+    if (cfg.broker <= 0)
+        return -1;
+
+    char path[64];
+    snprintf(path, sizeof path, "/proc/%d/stat", (int)cfg.broker);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+
+    // the command name may hold spaces, fields are counted from the closing parenthesis
+    char line[TMP_BUFLEN * 2];
+    bool ok = fgets(line, sizeof line, fp) != NULL;
+    fclose(fp);
+    char *p = ok ? strrchr(line, ')') : NULL;
+
+    unsigned long utime, stime;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double selfCpu() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
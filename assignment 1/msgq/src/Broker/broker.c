@@ -1,359 +1,1620 @@
 #include "broker.h"
 
-#define LISTENQ            10
-#define MESSAGE_TIME_LIMIT 60
-
-static pid_t parent_pid;
-static int   pubfd;
-static int   subfd;
-static int   connfd;
-static int   gotalarm;
-static char *msg_dir;
-
-static void setupPublisher();
-static void setupSubscriber();
-static void handlePublisher(const int connfd);
-static void handleSubscriber(const int connfd);
-static void cleanOldMsg();
+#include <endian.h>
+#include <ftw.h>
+
+#define OUT            "broker"
+#define PUSH_BATCH     64                      // messages pushed to a subscriber per loop iteration
+#define FEATURES       (FEAT_LZ | FEAT_CREDIT | FEAT_IDS | FEAT_CHUNKS | FEAT_SHM) // what OP_HELLO may ask for
+#define SYNC_BUDGET_MS 2                                                           // ms a publish may wait for a sync
+#define LIST_MAX_BYTES (64 << 10)                                                  // topics listed per OP_TOPICS
+
+// how far pushRange() got with a stream
+enum push_state {
+    PUSH_GONE,    // the connection has gone away
+    PUSH_DONE,    // pushed as far as the batch and the credit go
+    PUSH_WAITING, // stopped until the connection has room (see shard_canPush()), or until the next tick
+};
+
+static char    *msg_dir;
+static char    *unix_path;   // -U, NULL unless clients may connect over unix sockets
+static bool     durable;     // msg_dir outlives the broker, acks wait for the disk
+static uint64_t sync_budget; // ns
+
+static __thread time_t   last_retain; // per shard
+static __thread Buffer  *scratch;     // replies are built here, per shard
+static __thread Vector  *lagging;     // Vector<Topic *> with subscribers to catch up, per shard
+static __thread Vector  *stalled;     // Vector<Topic *> with streams waiting for room, per shard
+static __thread uint64_t fed_seen;    // ring generation the topics were last checked against, per shard
+static __thread Vector  *unsynced;    // Vector<Job *>, acks waiting for the next sync, per shard
+static __thread uint64_t unsynced_ns; // when the oldest of them was stored
+static __thread Vector  *released;    // Vector<Job *>, held acks whose topic has caught up, per shard
+
+static void    usage();
+static void    routeFrame(Shard *sh, Conn *c, const Frame *f);
+static void    routeRequest(Shard *sh, Conn *c, Job *from, const Frame *f);
+static void    routeCredit(Shard *sh, Conn *c, const Frame *f);
+static void    spoolPiece(Conn *c, const Frame *f);
+static bool    takeSpool(Conn *c, const Frame *f, Job *from);
+static void    routePattern(Shard *sh, Conn *c, const Job *from, const Frame *f, const char *pattern);
+static void    handleFrame(Shard *sh, const Job *from, const Frame *f);
+static void    handleHello(Shard *sh, Conn *c, const Job *from, const Frame *f);
+static void    handleList(Shard *sh, const Job *from, const Frame *f);
+static void    handleLookup(Shard *sh, const Job *from, const char *topic);
+static void    handleCreate(Shard *sh, const Job *from, const Frame *f);
+static bool    readTopic(Reader *r, const Frame *f, char *topic, uint32_t *id);
+static Topic  *openTopic(const char *topic, const uint32_t id, const bool create);
+static void    handlePublish(Shard *sh, const Job *from, const Frame *f);
+static void    handlePublishBatch(Shard *sh, const Job *from, const Frame *f);
+static void    handlePublishPacked(Shard *sh, const Job *from, const Frame *f);
+static void    handleFetch(Shard *sh, const Job *from, const Frame *f);
+static void    handleFetchBatch(Shard *sh, const Job *from, const Frame *f);
+static bool    sendMessage(Shard *sh, const Job *from, Topic *t, const uint64_t seq, uint64_t skip);
+static bool    fetchRecent(Shard *sh, const Job *from, const Frame *f);
+static size_t  entriesToWire(char *p, size_t n);
+static void    countFetch(TopicIndex *ix, const uint64_t n, const uint64_t bytes);
+static bool    locateLarge(Topic *t, const uint64_t seq, int *fd, off_t *off, uint32_t *len);
+static void    handleSubscribe(Shard *sh, const Job *from, const Frame *f);
+static void    handleJoin(Shard *sh, const Job *from, const Frame *f);
+static void    handleCommit(Shard *sh, const Job *from, const Frame *f);
+static void    handleCredit(Shard *sh, const Job *from, const Frame *f);
+static void    dealPartitions(Shard *sh, Topic *t, Group *g);
+static void    pushTopic(Shard *sh, Topic *t);
+static void    pushStalled(Shard *sh);
+static int     pushRange(Shard *sh, Topic *t, const ConnRef *conn, uint64_t *next, const uint64_t end, const uint64_t step,
+                         int64_t *credit, const uint64_t now);
+static void    spend(int64_t *credit, const uint64_t len);
+static void    countPush(Shard *sh, Topic *t, const uint64_t seq, const uint64_t len, const uint64_t now);
+static void    dropSubs(Shard *sh, const ConnRef *conn);
+static void    handOver(Shard *sh);
+static void    putOwner(Buffer *b, const Node *n);
+static void    sendAck(Shard *sh, Topic *t, const Job *from, Buffer *b);
+static void    awaitSync(Job *ack);
+static void    sendReleased(Shard *sh);
+static int     commitStored(Shard *sh);
+static Buffer *replyBuf();
+static void    sendReply(Shard *sh, const Job *from, Buffer *b);
+static void    replyError(Shard *sh, const Job *from, const uint16_t code, const char *reason);
+
+static int removeEntry(const char *path, const struct stat *st, int flag, struct FTW *ftw) { return remove(path); }
 
 static void term_handler(int sig) {
 
-    // remove msg_dir, (use system calls instead of rm -rf)
-    char rem_call[TMP_BUFLEN];
-    snprintf(rem_call, TMP_BUFLEN, "rm -rf %s", msg_dir);
-    system(rem_call);
+    // a temporary msg_dir goes with the broker
+    if (!durable)
+        nftw(msg_dir, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+
+    struct sockaddr_un addr;
+    for (int sub = 0; unix_path != NULL && sub < 2; sub++) {
+        if (proto_unixAddr(unix_path, sub, &addr))
+            unlink(addr.sun_path);
+    }
 
     exit(EXIT_SUCCESS);
 }
 
-static void term_handler_publisher(int sig) {
-    close(pubfd);
-    term_handler(sig);
+int main(int argc, char **argv) {
+
+    // number of worker threads, 0 means one per core
+    int       nthreads  = 1;
+    bool      uring     = false;
+    Retention retain    = {.age = RETAIN_AGE, .bytes = RETAIN_BYTES, .highwater = RETAIN_BEHIND};
+    Vector   *overrides = vec_init_ptr(); // per topic limits, parsed once the defaults are known
+    int       nparts    = GROUP_PARTITIONS;
+    bool      federated = false;
+    long      budget    = SYNC_BUDGET_MS;
+    int       opt;
+    while ((opt = getopt(argc, argv, "t:ua:b:w:r:p:l:f:d:s:U:vq")) != -1) {
+        switch (opt) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'u':
+            uring = true;
+            break;
+        case 'a':
+            retain.age = atol(optarg);
+            break;
+        case 'b':
+            retain.bytes = atoll(optarg);
+            break;
+        case 'w':
+            retain.highwater = atoll(optarg);
+            break;
+        case 'r':
+            vec_pushBack(overrides, &optarg);
+            break;
+        case 'p':
+            nparts = atoi(optarg);
+            break;
+        case 'l':
+            if (!fed_setSelf(optarg))
+                usage();
+            break;
+        case 'f':
+            if (!fed_addPeer(optarg))
+                usage();
+            federated = true;
+            break;
+        case 'd':
+            msg_dir = optarg;
+            durable = true;
+            break;
+        case 's':
+            budget = atol(optarg);
+            break;
+        case 'U':
+            unix_path = optarg;
+            break;
+        case 'v':
+            log_level = LOG_DEBUG;
+            break;
+        case 'q':
+            log_level = LOG_ERROR;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (retain.age < 0 || retain.bytes < 0 || retain.highwater < 0 || nparts <= 0 || budget < 0 ||
+        (federated && fed_self()->host[0] == '\0'))
+        usage();
+    struct sockaddr_un addr;
+    if (unix_path != NULL && (unix_path[0] == '\0' || !proto_unixAddr(unix_path, false, &addr) ||
+                              !proto_unixAddr(unix_path, true, &addr)))
+        usage();
+    sync_budget = budget * 1000000;
+    group_setPartitions(nparts);
+    retention_setDefault(&retain);
+    for (uint i = 0; i < overrides->size; i++) {
+        if (!retention_parse(vec_getValAt(overrides, i)))
+            usage();
+    }
+    vec_free(overrides);
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0 || nthreads > MAX_SHARDS)
+        usage();
+
+    // setup the directory for storing messages, a temporary one unless given
+    char template[] = "/tmp/msgdir.XXXXXX";
+    if (!durable && (msg_dir = mkdtemp(template)) == NULL)
+        perror_and_exit("could not create tmp directory");
+    store_init(msg_dir, durable);
+    registry_init(msg_dir, durable);
+    index_init();
+
+    // handler for termination
+    struct sigaction sa;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler    = term_handler;
+    sa.sa_flags      = 0;
+    const int sigs[] = {SIGINT, SIGTERM};
+    uint      m      = NUM_ELEM(sigs);
+    for (uint i = 0; i < m; i++) {
+        if (sigaction(sigs[i], &sa, NULL) == -1)
+            perror_and_exit("failed to setup interrupt handler");
+    }
+
+    // a closed client must not kill the broker
+    signal(SIGPIPE, SIG_IGN);
+
+    fed_start();
+
+    // each shard serves publishers and subscribers from its own event loop
+    shard_runAll(nthreads, uring, unix_path);
 }
 
-static void term_handler_subscriber(int sig) {
-    close(subfd);
-    term_handler(sig);
+static void usage() {
+    printf("Usage: " OUT " [-t <threads, 0 for one per core>] [-u] [-v | -q] [-a <max age (s)>] [-b <max bytes per topic>]\n"
+           "       [-w <high water>] [-r <topic>:<max age>[:<max bytes>[:<high water>]]]...\n"
+           "       [-p <partitions per topic>] [-l <host>[:<publisher port>] [-f <host>[:<publisher port>]]...]\n"
+           "       [-d <data directory> [-s <ms>]] [-U <socket path>]\n"
+           "-u uses io_uring instead of epoll, if available.\n"
+           "Consumer groups split each topic into %d partitions unless -p is given.\n"
+           "-v logs every message, -q only errors.\n"
+           "Counters are served on 127.0.0.1:%d.\n"
+           "-l names this broker, its other ports move along with the publisher port.\n"
+           "-f adds another broker of the federation, topics are shared between those that are up.\n"
+           "-d keeps messages across restarts; publishes are acknowledged once on disk, after waiting\n"
+           "   up to -s ms (default %d) to share the sync with others.\n"
+           "-U also listens on unix sockets <socket path>" UNIX_PUB_SUFFIX " and " UNIX_SUB_SUFFIX
+           ", clients reach them as unix:<socket path>.\n"
+           "-w holds publish acks while the slowest reader of a topic is more than this many bytes behind.\n"
+           "Retention limits of 0 mean no limit.\n",
+           GROUP_PARTITIONS, BROKER_STATS_PORT, SYNC_BUDGET_MS);
+    exit(EXIT_FAILURE);
 }
 
-static void alarm_handler(int sig) {
-    gotalarm = 1;
-    alarm(MESSAGE_TIME_LIMIT);
+bool broker_read(Shard *sh, Conn *c) {
+
+    Frame f;
+    int   r;
+    while ((r = proto_parse(c->in, &f)) == 1) {
+        routeFrame(sh, c, &f);
+        proto_consume(c->in, &f);
+    }
+
+    // a bad header means we can no longer find frame boundaries
+    return r == 0;
 }
 
-int main() {
+void broker_job(Shard *sh, Job *job) {
 
-    parent_pid = getpid();
-    gotalarm   = 0;
+    Frame f;
+    if (job->type == JOB_CLOSED)
+        dropSubs(sh, &job->conn);
+    else if (job->type == JOB_ROOM)
+        pushStalled(sh);
+    else if (proto_decode(job->data, job->len, &f) == 1)
+        handleFrame(sh, job, &f);
 
-    // setup the directory for storing messages
-    char template[] = "/tmp/msgdir.XXXXXX";
-    if ((msg_dir = mkdtemp(template)) == NULL)
-        perror_and_exit("could not create tmp directory");
+    job_free(job);
+}
+
+int broker_work(Shard *sh) {
+
+    // topics still behind after this round queue themselves up again
+    if (lagging != NULL && !vec_isEmpty(lagging)) {
+        Vector *todo = lagging;
+        lagging      = vec_init_ptr();
+        for (uint i = 0; i < todo->size; i++) {
+            Topic *t   = vec_getValAt(todo, i);
+            t->lagging = false;
+            pushTopic(sh, t);
+        }
+        vec_free(todo);
+    }
+
+    sendReleased(sh);
+    int wait = commitStored(sh);
+
+    return (lagging == NULL || vec_isEmpty(lagging)) ? wait : 0;
+}
+
+void broker_tick(Shard *sh) {
+
+    // drop whole segments of this shard's topics that have gone past their limits
+    time_t now = time(NULL);
+    if (now - last_retain >= RETAIN_PERIOD) {
+        last_retain = now;
+        topic_retain(now);
+    }
+
+    // in case some room went by unnoticed
+    pushStalled(sh);
+
+    // streams of topics that now belong to another broker are sent there
+    if (fed_generation() != fed_seen) {
+        fed_seen = fed_generation();
+        handOver(sh);
+    }
+}
+
+// frames are handled by the shard that owns their topic
+static void routeFrame(Shard *sh, Conn *c, const Frame *f) {
+
+    if (f->opcode == OP_CREDIT) {
+        routeCredit(sh, c, f);
+        return;
+    }
+
+    // the pieces of a message are gathered here, its last piece is answered for them all
+    if (f->opcode == OP_PUBLISH && (f->flags & FLAG_MORE)) {
+        spoolPiece(c, f);
+        return;
+    }
+
+    // every other request is answered
+    Job from = {
+        .conn  = {.shard = sh->id, .fd = c->fd, .id = c->id, .flow = c->flow},
+        .reqno = c->nextreq++,
+        .ns    = stats_now(),
+        .fd    = -1,
+    };
+    if (f->opcode == OP_PUBLISH && c->spool != NULL && !takeSpool(c, f, &from)) {
+        replyError(sh, &from, ERR_STORE, "could not gather message");
+        return;
+    }
+
+    routeRequest(sh, c, &from, f);
+
+    // a gathered message goes with the request, unless the owner of the topic took it
+    if (from.fd != -1)
+        close(from.fd);
+}
+
+static void routeRequest(Shard *sh, Conn *c, Job *from, const Frame *f) {
+
+    // features belong to the connection and the registry to the broker, there is no topic to route by
+    if (f->opcode == OP_HELLO) {
+        handleHello(sh, c, from, f);
+        return;
+    }
+    if (f->opcode == OP_LIST) {
+        handleList(sh, from, f);
+        return;
+    }
+
+    if (f->opcode != OP_PUBLISH && f->opcode != OP_PUBLISH_BATCH && f->opcode != OP_FETCH &&
+        f->opcode != OP_FETCH_BATCH && f->opcode != OP_SUBSCRIBE && f->opcode != OP_JOIN && f->opcode != OP_COMMIT &&
+        f->opcode != OP_LOCATE && f->opcode != OP_CREATE && f->opcode != OP_LOOKUP) {
+        replyError(sh, from, ERR_MALFORMED, "unknown opcode");
+        return;
+    }
+
+    if ((f->flags & FLAG_LZ) && !(c->features & FEAT_LZ)) {
+        replyError(sh, from, ERR_MALFORMED, "compression was not agreed on");
+        return;
+    }
+    if ((f->flags & FLAG_ID) && !(c->features & FEAT_IDS)) {
+        replyError(sh, from, ERR_MALFORMED, "topic ids were not agreed on");
+        return;
+    }
+
+    char     topic[TOPIC_MAXLEN + 1];
+    uint32_t id;
+    Reader   r = proto_reader(f);
+    if (!readTopic(&r, f, topic, &id)) {
+        if (r.err)
+            replyError(sh, from, ERR_MALFORMED, "bad topic");
+        else
+            replyError(sh, from, ERR_TOPIC, "unknown topic id");
+        return;
+    }
+
+    if (trie_isPattern(topic)) {
+        routePattern(sh, c, from, f, topic);
+        return;
+    }
+
+    // topics of other brokers in the federation are sent there
+    const Node *node = fed_owner(topic);
+    if (node != NULL || f->opcode == OP_LOCATE) {
+        Buffer *b = replyBuf();
+        putOwner(b, (node != NULL) ? node : fed_self());
+        sendReply(sh, from, b);
+        return;
+    }
+
+    // the registry is shared, any shard can look a topic up
+    if (f->opcode == OP_LOOKUP) {
+        handleLookup(sh, from, topic);
+        return;
+    }
+
+    // the owner has to be told when the connection closes
+    if (f->opcode == OP_SUBSCRIBE || f->opcode == OP_JOIN)
+        c->streaming = true;
+
+    // recent messages can be read by any shard
+    if ((f->opcode == OP_FETCH || f->opcode == OP_FETCH_BATCH) && fetchRecent(sh, from, f))
+        return;
+
+    int owner = shard_owner(topic);
+    if (owner == sh->id) {
+        handleFrame(sh, from, f);
+        return;
+    }
+
+    Job *job   = job_new(JOB_REQUEST, sh, c, f->raw, FRAME_HDR_LEN + f->len);
+    job->reqno = from->reqno;
+    job->ns    = from->ns;
+    job->fd    = from->fd;
+    job->flen  = from->flen;
+    from->fd   = -1;
+    shard_send(sh, owner, job);
+}
+
+// credit takes no turn among the replies, whatever cannot be used is dropped
+static void routeCredit(Shard *sh, Conn *c, const Frame *f) {
+
+    char     topic[TOPIC_MAXLEN + 1];
+    uint32_t id;
+    Reader   r = proto_reader(f);
+    if (((f->flags & FLAG_ID) && !(c->features & FEAT_IDS)) || !readTopic(&r, f, topic, &id) ||
+        fed_owner(topic) != NULL)
+        return;
+
+    int owner = shard_owner(topic);
+    if (owner == sh->id) {
+        Job from = {.conn = {.shard = sh->id, .fd = c->fd, .id = c->id, .flow = c->flow}, .fd = -1};
+        handleFrame(sh, &from, f);
+        return;
+    }
+
+    shard_send(sh, owner, job_new(JOB_REQUEST, sh, c, f->raw, FRAME_HDR_LEN + f->len));
+}
+
+// writes a piece of a message to the connection's spool, once one cannot be kept the whole message fails
+static void spoolPiece(Conn *c, const Frame *f) {
 
-    // separate out broker-publisher and broker-subscriber
-    switch (fork()) {
-    case -1:
-        perror_and_exit("fork failed");
-    case 0:
-        setupPublisher();
+    char     topic[TOPIC_MAXLEN + 1];
+    uint32_t id;
+    Reader   r  = proto_reader(f);
+    bool     ok = (c->features & FEAT_CHUNKS) && (!(f->flags & FLAG_ID) || (c->features & FEAT_IDS)) &&
+              readTopic(&r, f, topic, &id);
+
+    if (c->spool == NULL) {
+        c->spool  = malloc(sizeof *c->spool);
+        *c->spool = (Spool){.fd = ok ? store_spool() : -1};
+    }
+
+    Spool *sp = c->spool;
+    if (sp->fd == -1)
+        return;
+    if (ok && sp->len + r.left <= CHUNK_MAXLEN && pwrite(sp->fd, r.p, r.left, sp->len) == (ssize_t)r.left) {
+        sp->len += r.left;
+        return;
+    }
+
+    close(sp->fd);
+    sp->fd = -1;
+}
+
+// ends the message being gathered with its last piece and hands it to the request, false if a piece was lost
+static bool takeSpool(Conn *c, const Frame *f, Job *from) {
+
+    spoolPiece(c, f);
+    from->fd   = c->spool->fd;
+    from->flen = c->spool->len;
+    free(c->spool);
+    c->spool = NULL;
+
+    return from->fd != -1;
+}
+
+// a pattern covers the topics of every shard of this broker, so each is sent the subscription
+static void routePattern(Shard *sh, Conn *c, const Job *from, const Frame *f, const char *pattern) {
+
+    if (f->opcode == OP_LOCATE) {
+        Buffer *b = replyBuf();
+        putOwner(b, fed_self());
+        sendReply(sh, from, b);
+        return;
+    }
+
+    if (f->opcode != OP_SUBSCRIBE || !trie_validName(pattern, true)) {
+        replyError(sh, from, ERR_TOPIC, "invalid topic");
+        return;
+    }
+
+    c->streaming = true;
+    for (int i = 0; i < shard_count(); i++) {
+        if (i != sh->id)
+            shard_send(sh, i, job_new(JOB_REQUEST, sh, c, f->raw, FRAME_HDR_LEN + f->len));
+    }
+    handleFrame(sh, from, f);
+}
+
+static void handleFrame(Shard *sh, const Job *from, const Frame *f) {
+
+    switch (f->opcode) {
+    case OP_PUBLISH:
+        handlePublish(sh, from, f);
+        break;
+    case OP_PUBLISH_BATCH:
+        if (f->flags & FLAG_LZ)
+            handlePublishPacked(sh, from, f);
+        else
+            handlePublishBatch(sh, from, f);
+        break;
+    case OP_FETCH:
+        handleFetch(sh, from, f);
+        break;
+    case OP_FETCH_BATCH:
+        handleFetchBatch(sh, from, f);
         break;
-    default:
-        setupSubscriber();
+    case OP_SUBSCRIBE:
+        handleSubscribe(sh, from, f);
+        break;
+    case OP_JOIN:
+        handleJoin(sh, from, f);
+        break;
+    case OP_COMMIT:
+        handleCommit(sh, from, f);
+        break;
+    case OP_CREDIT:
+        handleCredit(sh, from, f);
+        break;
+    case OP_CREATE:
+        handleCreate(sh, from, f);
         break;
     }
 }
 
-static void setupPublisher() {
+static void handleHello(Shard *sh, Conn *c, const Job *from, const Frame *f) {
 
-    // setup SIGALRM handler
-    struct sigaction sa;
-    sa.sa_handler = alarm_handler;
-    sa.sa_flags   = 0;
-    if (sigaction(SIGALRM, &sa, NULL) == -1)
-        perror_and_exit("failed to setup interrupt handler");
+    Reader   r    = proto_reader(f);
+    uint32_t want = proto_getU32(&r);
+    if (r.err) {
+        replyError(sh, from, ERR_MALFORMED, "bad hello");
+        return;
+    }
 
-    // handler for termination
-    struct sigaction sa2;
-    sa2.sa_handler   = term_handler_publisher;
-    const int sigs[] = {SIGINT, SIGTERM};
-    uint      m      = NUM_ELEM(sigs);
-    for (uint i = 0; i < m; i++) {
-        if (sigaction(sigs[i], &sa2, NULL) == -1)
-            perror_and_exit("failed to setup interrupt handler");
+    c->features = want & FEATURES;
+
+    // the answer itself still goes over the socket
+    const char *shm = (c->features & FEAT_SHM) ? shard_offerShm(sh, c) : NULL;
+    if (shm == NULL)
+        c->features &= ~FEAT_SHM;
+
+    Buffer *b   = replyBuf();
+    size_t  pos = proto_begin(b, OP_HELLO, 0);
+    proto_putU32(b, c->features);
+    if (shm != NULL)
+        proto_putStr(b, shm);
+    proto_end(b, pos);
+    sendReply(sh, from, b);
+}
+
+// lists the registry from the id asked for, as far as one frame goes
+static void handleList(Shard *sh, const Job *from, const Frame *f) {
+
+    Reader   r     = proto_reader(f);
+    uint32_t first = proto_getU32(&r);
+    if (r.err) {
+        replyError(sh, from, ERR_MALFORMED, "bad list request");
+        return;
     }
 
-    // setup socket
-    if ((pubfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-        perror_and_exit("could not create socket");
+    Buffer *b        = replyBuf();
+    size_t  pos      = proto_begin(b, OP_TOPICS, 0);
+    size_t  countpos = buf_len(b);
+    proto_putU32(b, 0);
 
-    // setup address structure
-    struct sockaddr_in servaddr = {
-        .sin_family      = AF_INET,
-        .sin_addr.s_addr = htons(INADDR_ANY),
-        .sin_port        = htons(BROKER_PUB_PORT),
-    };
+    uint32_t n     = 0;
+    uint32_t count = registry_count();
+    for (uint32_t id = first; id < count && buf_len(b) - pos < LIST_MAX_BYTES; id++, n++) {
+        proto_putU32(b, id);
+        proto_putStr(b, registry_name(id));
+    }
+    proto_setU32(b, countpos, n);
+    proto_end(b, pos);
+    sendReply(sh, from, b);
+}
 
-    // bind and listen
-    if (bind(pubfd, (struct sockaddr *)&servaddr, sizeof servaddr) == -1)
-        perror_and_exit("bind error");
-    if (listen(pubfd, LISTENQ) == -1)
-        perror_and_exit("listen error");
+static void handleLookup(Shard *sh, const Job *from, const char *topic) {
 
-    // start the cleanup alarm
-    alarm(MESSAGE_TIME_LIMIT);
+    uint32_t id = registry_find(topic);
+    if (id == TOPIC_NOID) {
+        replyError(sh, from, ERR_TOPIC, "unknown topic");
+        return;
+    }
 
-    // server loop
-    for (;;) {
+    Buffer *b   = replyBuf();
+    size_t  pos = proto_begin(b, OP_ACK, 0);
+    proto_putU64(b, id);
+    proto_end(b, pos);
+    sendReply(sh, from, b);
+}
 
-        if (gotalarm)
-            cleanOldMsg();
+// a topic is registered when its owner opens it, creating it if need be
+static void handleCreate(Shard *sh, const Job *from, const Frame *f) {
 
-        struct sockaddr_in cliaddr;
-        socklen_t          clilen = sizeof cliaddr;
-        if ((connfd = accept(pubfd, (struct sockaddr *)&cliaddr, &clilen)) == -1) {
-            if (errno == EINTR)
-                continue;
-            else
-                perror_and_exit("listen error");
+    char     topic[TOPIC_MAXLEN + 1];
+    uint32_t id;
+    Reader   r = proto_reader(f);
+    readTopic(&r, f, topic, &id);
+
+    Topic *t = openTopic(topic, id, true);
+    if (t == NULL) {
+        replyError(sh, from, ERR_TOPIC, "invalid topic");
+        return;
+    }
+    if (t->id == TOPIC_NOID) {
+        replyError(sh, from, ERR_STORE, "topic registry is full");
+        return;
+    }
+
+    Buffer *b   = replyBuf();
+    size_t  pos = proto_begin(b, OP_ACK, 0);
+    proto_putU64(b, t->id);
+    proto_end(b, pos);
+    sendReply(sh, from, b);
+
+    LOG(LOG_INFO, "Topic %s registered with ID %u\n", topic, t->id);
+}
+
+// reads the topic a request starts with, false if it is malformed (r->err is set) or an unknown id
+static bool readTopic(Reader *r, const Frame *f, char *topic, uint32_t *id) {
+
+    topic[0] = '\0';
+    *id      = TOPIC_NOID;
+    if (!(f->flags & FLAG_ID))
+        return proto_getStr(r, topic, TOPIC_MAXLEN + 1) != NULL;
+
+    uint32_t    got  = proto_getU32(r);
+    const char *name = r->err ? NULL : registry_name(got);
+    if (name == NULL)
+        return false;
+
+    strcpy(topic, name);
+    *id = got;
+
+    return true;
+}
+
+// a topic given by id is found in the array of the shard, without hashing its name
+static Topic *openTopic(const char *topic, const uint32_t id, const bool create) {
+    return (id != TOPIC_NOID) ? topic_byId(id, create) : topic_get(topic, create);
+}
+
+static void handlePublish(Shard *sh, const Job *from, const Frame *f) {
+
+    char     topic[TOPIC_MAXLEN + 1];
+    uint32_t id;
+    Reader   r = proto_reader(f);
+    readTopic(&r, f, topic, &id);
+
+    // a message published in pieces comes as a file, its last piece included
+    bool   spooled = from->fd != -1;
+    size_t len     = spooled ? from->flen : r.left;
+    if (len > (spooled ? CHUNK_MAXLEN : MSG_MAXLEN)) {
+        replyError(sh, from, ERR_MALFORMED, "message too long");
+        return;
+    }
+
+    Topic *t = openTopic(topic, id, true);
+    if (t == NULL) {
+        replyError(sh, from, ERR_TOPIC, "invalid topic");
+        return;
+    }
+
+    // otherwise the rest of the frame is the message, save it to the topic log
+    int64_t seq = spooled ? topic_appendFile(t, from->fd, len, time(NULL)) : topic_append(t, r.p, len, time(NULL));
+    if (seq == -1) {
+        replyError(sh, from, ERR_STORE, "could not store message");
+        return;
+    }
+    stats_latency(sh->id, LAT_STORE, t->stored_ns - from->ns);
+
+    // acknowledge with the id the message was stored under
+    Buffer *b   = replyBuf();
+    size_t  pos = proto_begin(b, OP_ACK, 0);
+    proto_putU64(b, seq);
+    proto_end(b, pos);
+    sendAck(sh, t, from, b);
+
+    LOG(LOG_DEBUG, "Received message from publisher. Topic: %s\n", topic);
+
+    pushTopic(sh, t);
+}
+
+static void handlePublishBatch(Shard *sh, const Job *from, const Frame *f) {
+
+    char     topic[TOPIC_MAXLEN + 1];
+    uint32_t id;
+    Reader   r = proto_reader(f);
+    readTopic(&r, f, topic, &id);
+    uint64_t batch = proto_getU64(&r);
+    uint32_t count = proto_getU32(&r);
+
+    // every entry takes at least its length field, which bounds count
+    if (r.err || count == 0 || count > r.left / sizeof(uint32_t)) {
+        replyError(sh, from, ERR_MALFORMED, "bad publish batch");
+        return;
+    }
+
+    // the messages are written out straight from the frame
+    struct iovec *msgs = malloc(count * sizeof *msgs);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t len = proto_getU32(&r);
+        msgs[i]      = (struct iovec){.iov_base = (void *)proto_getBytes(&r, len), .iov_len = len};
+    }
+    if (r.err || r.left > 0) {
+        free(msgs);
+        replyError(sh, from, ERR_MALFORMED, "bad publish batch");
+        return;
+    }
+
+    Topic *t = openTopic(topic, id, true);
+    if (t == NULL) {
+        free(msgs);
+        replyError(sh, from, ERR_TOPIC, "invalid topic");
+        return;
+    }
+
+    int64_t seq = topic_appendBatch(t, msgs, count, time(NULL));
+    free(msgs);
+    if (seq == -1) {
+        replyError(sh, from, ERR_STORE, "could not store messages");
+        return;
+    }
+    stats_latency(sh->id, LAT_STORE, t->stored_ns - from->ns);
+
+    Buffer *b   = replyBuf();
+    size_t  pos = proto_begin(b, OP_BATCH_ACK, 0);
+    proto_putU64(b, batch);
+    proto_putU64(b, seq);
+    proto_putU32(b, count);
+    proto_end(b, pos);
+    sendAck(sh, t, from, b);
+
+    LOG(LOG_DEBUG, "Received %u messages from publisher. Topic: %s\n", count, topic);
+
+    pushTopic(sh, t);
+}
+
+// a compressed batch is checked as far as can be without decompressing it and stored as it is
+static void handlePublishPacked(Shard *sh, const Job *from, const Frame *f) {
+
+    char     topic[TOPIC_MAXLEN + 1];
+    uint32_t id;
+    Reader   r = proto_reader(f);
+    readTopic(&r, f, topic, &id);
+    uint64_t    batch  = proto_getU64(&r);
+    uint32_t    count  = proto_getU32(&r);
+    const char *packed = r.p;
+    uint32_t    raw    = proto_getU32(&r);
+
+    // decompressed once here, so a block that does not hold count messages is never stored for readers to trip on
+    if (r.err || count == 0 || count > LZ_BATCH_MAX || raw / sizeof(uint32_t) < count || raw > MSG_MAXLEN ||
+        r.left == 0 || !proto_unpack(packed, sizeof raw + r.left, count, replyBuf())) {
+        replyError(sh, from, ERR_MALFORMED, "bad publish batch");
+        return;
+    }
+
+    Topic *t = openTopic(topic, id, true);
+    if (t == NULL) {
+        replyError(sh, from, ERR_TOPIC, "invalid topic");
+        return;
+    }
+
+    int64_t seq = topic_appendPacked(t, packed, sizeof raw + r.left, count, raw, time(NULL));
+    if (seq == -1) {
+        replyError(sh, from, ERR_STORE, "could not store messages");
+        return;
+    }
+    stats_latency(sh->id, LAT_STORE, t->stored_ns - from->ns);
+
+    Buffer *b   = replyBuf();
+    size_t  pos = proto_begin(b, OP_BATCH_ACK, 0);
+    proto_putU64(b, batch);
+    proto_putU64(b, seq);
+    proto_putU32(b, count);
+    proto_end(b, pos);
+    sendAck(sh, t, from, b);
+
+    LOG(LOG_DEBUG, "Received %u compressed messages from publisher. Topic: %s\n", count, topic);
+
+    pushTopic(sh, t);
+}
+
+static void handleFetch(Shard *sh, const Job *from, const Frame *f) {
+
+    char     topic[TOPIC_MAXLEN + 1];
+    uint32_t id;
+    Reader   r = proto_reader(f);
+    readTopic(&r, f, topic, &id);
+    uint64_t seq  = proto_getU64(&r);
+    uint64_t skip = (r.left > 0) ? proto_getU64(&r) : 0;
+    if (r.err) {
+        replyError(sh, from, ERR_MALFORMED, "bad fetch request");
+        return;
+    }
+
+    // skip ahead if the message asked for has expired, to the start of the next one
+    Topic *t = openTopic(topic, id, false);
+    if (t != NULL && seq < log_start(t->log)) {
+        seq  = log_start(t->log);
+        skip = 0;
+    }
+
+    if (t == NULL || !sendMessage(sh, from, t, seq, skip)) {
+        Buffer *b = replyBuf();
+        proto_end(b, proto_begin(b, OP_NOMSG, 0));
+        sendReply(sh, from, b);
+    }
+}
+
+static void handleFetchBatch(Shard *sh, const Job *from, const Frame *f) {
+
+    char     topic[TOPIC_MAXLEN + 1];
+    uint32_t id;
+    Reader   r = proto_reader(f);
+    readTopic(&r, f, topic, &id);
+    uint64_t seq      = proto_getU64(&r);
+    uint32_t max      = proto_getU32(&r);
+    uint32_t maxbytes = proto_getU32(&r);
+    if (r.err || max == 0) {
+        replyError(sh, from, ERR_MALFORMED, "bad fetch request");
+        return;
+    }
+
+    // the batch has to fit in one frame
+    if (maxbytes > MSG_MAXLEN)
+        maxbytes = MSG_MAXLEN;
+
+    Topic *t = openTopic(topic, id, false);
+    if (t != NULL && seq < log_start(t->log))
+        seq = log_start(t->log);
+
+    Buffer *b   = replyBuf();
+    size_t  pos = proto_begin(b, OP_BATCH, f->flags & FLAG_LZ);
+    proto_putU64(b, seq);
+    proto_putU32(b, 0); // count, filled in once known
+
+    // the records are read from the log in bulk and used as they are, compressed ones too if the client takes them
+    size_t  entries = buf_len(b);
+    ssize_t n       = (t == NULL) ? 0 : log_readBatch(t->log, seq, max, maxbytes, f->flags & FLAG_LZ, b);
+    if (n == -1) {
+        replyError(sh, from, ERR_STORE, "could not read messages");
+        return;
+    }
+
+    // a batch takes at least one message, so nothing read short of the end is one too large for any batch:
+    // its first piece goes instead
+    if (n == 0 && t != NULL && seq < log_end(t->log)) {
+        if (!sendMessage(sh, from, t, seq, 0))
+            replyError(sh, from, ERR_STORE, "could not read messages");
+        return;
+    }
+    size_t bytes = entriesToWire(buf_peek(b) + entries, buf_len(b) - entries);
+    if (t != NULL)
+        countFetch(t->index, n, bytes);
+
+    proto_setU32(b, entries - sizeof(uint32_t), n);
+    proto_end(b, pos);
+    sendReply(sh, from, b);
+
+    if (n > 0)
+        LOG(LOG_DEBUG, "Sent %zd messages to subscriber. Topic: %s\n", n, topic);
+}
+
+/**
+ * Answers a fetch with the message at seq. One too large for a
+ * frame is sent a piece at a time, the one from skip on; only
+ * that piece is ever read in.
+ *
+ * Returns false, with nothing sent, if there is no message.
+ */
+static bool sendMessage(Shard *sh, const Job *from, Topic *t, const uint64_t seq, uint64_t skip) {
+
+    int      fd;
+    off_t    off;
+    uint32_t len;
+    bool     large  = locateLarge(t, seq, &fd, &off, &len);
+    bool     pieced = large && len > MSG_MAXLEN;
+    uint16_t flags  = 0;
+    if (pieced) {
+        skip = (skip < len) ? skip : len;
+        off += skip;
+        len -= skip;
+        if (len > CHUNK_LEN) {
+            len   = CHUNK_LEN;
+            flags = FLAG_MORE;
         }
+    }
 
-        printf("Connected to Publisher\n");
+    Buffer *b   = replyBuf();
+    size_t  pos = proto_begin(b, OP_MSG, flags);
+    proto_putU64(b, seq);
+
+    // large messages go from the page cache to the socket
+    if (large) {
+        proto_endWith(b, pos, len);
+        if (shard_replyFile(sh, from, buf_peek(b), buf_len(b), fd, off, len)) {
+            buf_consume(b, buf_len(b));
+            countFetch(t->index, 1, len);
+            LOG(LOG_DEBUG, "Sent message to subscriber. Topic: %s\n", t->name);
+            return true;
+        }
+    }
 
-        // handle publisher in a new process
-        switch (fork()) {
-        case -1:
-            perror("fork error");
-            break;
-        case 0:
-            close(subfd);
-            handlePublisher(connfd);
-            close(connfd);
-            exit(EXIT_SUCCESS);
-        default:
-            break;
+    ssize_t n = -1;
+    if (!pieced) {
+        n = topic_read(t, seq, b, NULL);
+    } else if (buf_reserve(b, len)) {
+        n = pread(fd, b->data + b->end, len, off);
+        if (n != len) {
+            perror("could not read message");
+            n = -1;
+        } else {
+            b->end += n;
         }
+    }
+    if (n == -1) {
+        buf_consume(b, buf_len(b));
+        return false;
+    }
+
+    proto_end(b, pos);
+    sendReply(sh, from, b);
+    countFetch(t->index, 1, n);
+    LOG(LOG_DEBUG, "Sent message to subscriber. Topic: %s\n", t->name);
+
+    return true;
+}
+
+// serves a fetch from the index without going to the owner, false on a miss
+static bool fetchRecent(Shard *sh, const Job *from, const Frame *f) {
+
+    char     topic[TOPIC_MAXLEN + 1];
+    uint32_t id;
+    Reader   r = proto_reader(f);
+    readTopic(&r, f, topic, &id);
+    uint64_t seq      = proto_getU64(&r);
+    uint32_t max      = (f->opcode == OP_FETCH_BATCH) ? proto_getU32(&r) : 1;
+    uint32_t maxbytes = (f->opcode == OP_FETCH_BATCH) ? proto_getU32(&r) : 0;
+
+    // a malformed request is left to the owner to answer
+    TopicIndex *ix = index_find(topic);
+    if (r.err || max == 0 || ix == NULL)
+        return false;
+
+    // past the end is answered right away, anything older than the ring by the owner
+    bool    end = seq >= index_end(ix);
+    Buffer *b   = replyBuf();
+    size_t  pos;
+    if (f->opcode == OP_FETCH) {
+        if (end) {
+            proto_end(b, proto_begin(b, OP_NOMSG, 0));
+        } else {
+            pos = proto_begin(b, OP_MSG, 0);
+            proto_putU64(b, seq);
+            ssize_t n = index_read(ix, seq, b, NULL);
+            if (n == -1)
+                return false;
+            proto_end(b, pos);
+            countFetch(ix, 1, n);
+        }
+    } else {
+        pos = proto_begin(b, OP_BATCH, f->flags & FLAG_LZ);
+        proto_putU64(b, seq);
+        proto_putU32(b, 0);
+
+        if (maxbytes > MSG_MAXLEN)
+            maxbytes = MSG_MAXLEN;
+
+        size_t   entries = buf_len(b);
+        uint32_t n       = end ? 0 : index_readBatch(ix, seq, max, maxbytes, b);
+        if (n == 0 && !end)
+            return false;
+        countFetch(ix, n, entriesToWire(buf_peek(b) + entries, buf_len(b) - entries));
+        proto_setU32(b, entries - sizeof(uint32_t), n);
+        proto_end(b, pos);
+    }
+
+    sendReply(sh, from, b);
+
+    return true;
+}
 
-        close(connfd);
+static void countFetch(TopicIndex *ix, const uint64_t n, const uint64_t bytes) {
+    if (ix != NULL) {
+        stats_add(&ix->stats.fetched, n);
+        stats_add(&ix->stats.fetchbytes, bytes);
     }
 }
 
-static void setupSubscriber() {
+// log records carry the same fields as batch entries, in host byte order
+_Static_assert(sizeof(struct rec_hdr) == ENTRY_HDR_LEN, "record header must match a batch entry header");
 
-    // handler for termination
-    struct sigaction sa;
-    sa.sa_handler    = term_handler_subscriber;
-    const int sigs[] = {SIGINT, SIGTERM};
-    uint      m      = NUM_ELEM(sigs);
-    for (uint i = 0; i < m; i++) {
-        if (sigaction(sigs[i], &sa, NULL) == -1)
-            perror_and_exit("failed to setup interrupt handler");
+// returns the bytes of the entries past their headers
+static size_t entriesToWire(char *p, size_t n) {
+
+    size_t bytes = 0;
+    while (n >= sizeof(struct rec_hdr)) {
+        struct rec_hdr hdr;
+        memcpy(&hdr, p, sizeof hdr);
+
+        size_t   len   = hdr.len;
+        uint32_t be[2] = {htobe32(hdr.len), htobe32(hdr.count)};
+        uint64_t ts    = htobe64(hdr.ts);
+        memcpy(p, be, sizeof be);
+        memcpy(p + sizeof be, &ts, sizeof ts);
+
+        bytes += len;
+        p += sizeof hdr + len;
+        n -= (sizeof hdr + len < n) ? sizeof hdr + len : n;
     }
 
-    // setup socket
-    if ((subfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-        perror_and_exit("could not create socket");
+    return bytes;
+}
 
-    // setup address structure
-    struct sockaddr_in servaddr = {
-        .sin_family      = AF_INET,
-        .sin_addr.s_addr = htons(INADDR_ANY),
-        .sin_port        = htons(BROKER_SUB_PORT),
-    };
+// where a message too large for the index is kept in the log, false for other messages
+static bool locateLarge(Topic *t, const uint64_t seq, int *fd, off_t *off, uint32_t *len) {
 
-    // bind and listen
-    if (bind(subfd, (struct sockaddr *)&servaddr, sizeof servaddr) == -1)
-        perror_and_exit("bind error");
-    if (listen(subfd, LISTENQ) == -1)
-        perror_and_exit("listen error");
-
-    // server loop
-    for (;;) {
-        struct sockaddr_in cliaddr;
-        socklen_t          clilen = sizeof cliaddr;
-        if ((connfd = accept(subfd, (struct sockaddr *)&cliaddr, &clilen)) == -1) {
-            if (errno == EINTR)
-                continue;
-            else
-                perror_and_exit("listen error");
-        }
+    // anything still in the index is small
+    if (t->index != NULL && seq >= atomic_load(&t->index->tail) && seq < index_end(t->index))
+        return false;
 
-        printf("Connected to Subscriber\n");
+    return log_locate(t->log, seq, fd, off, len, NULL) && *len >= SENDFILE_MIN_LEN;
+}
 
-        // handle subscriber in a new process
-        switch (fork()) {
-        case -1:
-            perror("fork error");
-            break;
-        case 0:
-            close(subfd);
-            handleSubscriber(connfd);
-            close(connfd);
-            exit(EXIT_SUCCESS);
-        default:
-            break;
+static void handleSubscribe(Shard *sh, const Job *from, const Frame *f) {
+
+    char     topic[TOPIC_MAXLEN + 1];
+    uint32_t id;
+    Reader   r = proto_reader(f);
+    readTopic(&r, f, topic, &id);
+    uint64_t seq    = proto_getU64(&r);
+    int64_t  credit = (r.left > 0) ? proto_getU32(&r) : CREDIT_UNMETERED;
+    if (r.err) {
+        replyError(sh, from, ERR_MALFORMED, "bad subscribe request");
+        return;
+    }
+
+    // every shard watches a pattern, the client's own answers for them all
+    if (trie_isPattern(topic)) {
+        topic_watch(topic, &from->conn, credit);
+        if (from->conn.shard == sh->id) {
+            Buffer *b   = replyBuf();
+            size_t  pos = proto_begin(b, OP_ACK, 0);
+            proto_putU64(b, 0);
+            proto_end(b, pos);
+            sendReply(sh, from, b);
+            LOG(LOG_INFO, "Subscriber streaming from topics matching %s\n", topic);
         }
+        return;
+    }
 
-        close(connfd);
+    // streams may start before anything has been published
+    Topic *t = openTopic(topic, id, true);
+    if (t == NULL) {
+        replyError(sh, from, ERR_TOPIC, "invalid topic");
+        return;
     }
+
+    if (seq < log_start(t->log))
+        seq = log_start(t->log);
+
+    Buffer *b   = replyBuf();
+    size_t  pos = proto_begin(b, OP_ACK, 0);
+    proto_putU64(b, seq);
+    proto_end(b, pos);
+    sendReply(sh, from, b);
+
+    topic_subscribe(t, &from->conn, seq, credit);
+    LOG(LOG_INFO, "Subscriber streaming from topic %s at ID %lu\n", topic, seq);
+
+    // catch up on what is already stored
+    pushTopic(sh, t);
 }
 
-static void handlePublisher(const int connfd) {
+static void handleJoin(Shard *sh, const Job *from, const Frame *f) {
+
+    char     topic[TOPIC_MAXLEN + 1];
+    char     group[TOPIC_MAXLEN + 1];
+    uint32_t id;
+    Reader   r = proto_reader(f);
+    readTopic(&r, f, topic, &id);
+    proto_getStr(&r, group, sizeof group);
+    int64_t credit = (r.left > 0) ? proto_getU32(&r) : CREDIT_UNMETERED;
+    if (r.err || group[0] == '\0') {
+        replyError(sh, from, ERR_MALFORMED, "bad join request");
+        return;
+    }
 
-    ssize_t    n;
-    struct msg msg;
+    Topic *t = openTopic(topic, id, true);
+    if (t == NULL) {
+        replyError(sh, from, ERR_TOPIC, "invalid topic");
+        return;
+    }
 
-    DIR *dp = opendir(msg_dir);
-    if (dp == NULL)
-        perror_and_exit("could not open message directory");
-    int dfd = dirfd(dp);
-    if (dfd == -1)
-        perror_and_exit("directory fd error");
+    // the new member takes its share of the partitions
+    Group *g = topic_group(t, group, true);
+    if (group_findMember(g, &from->conn) == NULL) {
+        group_join(g, &from->conn)->credit = credit;
+        dealPartitions(sh, t, g);
+    }
 
-    for (;;) {
-        n = read(connfd, &msg, sizeof msg);
+    Buffer *b   = replyBuf();
+    size_t  pos = proto_begin(b, OP_ACK, 0);
+    proto_putU64(b, g->generation);
+    proto_end(b, pos);
+    sendReply(sh, from, b);
 
-        if (n == -1) {
-            if (errno == EINTR)
-                continue;
-            else
-                perror_and_exit("read error");
+    pushTopic(sh, t);
+}
+
+static void handleCommit(Shard *sh, const Job *from, const Frame *f) {
+
+    char     topic[TOPIC_MAXLEN + 1];
+    char     group[TOPIC_MAXLEN + 1];
+    uint32_t id;
+    Reader   r = proto_reader(f);
+    readTopic(&r, f, topic, &id);
+    proto_getStr(&r, group, sizeof group);
+    uint32_t count = proto_getU32(&r);
+    if (r.err || r.left != count * sizeof(uint64_t)) {
+        replyError(sh, from, ERR_MALFORMED, "bad commit request");
+        return;
+    }
+
+    Topic *t = openTopic(topic, id, false);
+    Group *g = (t == NULL) ? NULL : topic_group(t, group, false);
+    if (g == NULL) {
+        replyError(sh, from, ERR_GROUP, "unknown group");
+        return;
+    }
+
+    // ids that were never handed out cannot have been processed
+    uint64_t end   = log_end(t->log);
+    uint64_t moved = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t id = proto_getU64(&r);
+        if (id < end && group_commit(g, id))
+            moved++;
+    }
+
+    Buffer *b   = replyBuf();
+    size_t  pos = proto_begin(b, OP_ACK, 0);
+    proto_putU64(b, moved);
+    proto_end(b, pos);
+    sendReply(sh, from, b);
+}
+
+static void handleCredit(Shard *sh, const Job *from, const Frame *f) {
+
+    char     topic[TOPIC_MAXLEN + 1];
+    uint32_t id;
+    Reader   r = proto_reader(f);
+    readTopic(&r, f, topic, &id);
+    uint32_t bytes = proto_getU32(&r);
+
+    Topic *t = r.err ? NULL : openTopic(topic, id, false);
+    if (t == NULL)
+        return;
+
+    // streams that were started without credit stay unmetered, their window is all that holds them back
+    for (uint i = 0; i < t->subs->size; i++) {
+        Sub *s = vec_getValAt(t->subs, i);
+        if (shard_sameConn(&s->conn, &from->conn) && s->credit != CREDIT_UNMETERED)
+            s->credit += bytes;
+    }
+    for (uint i = 0; i < t->groups->size; i++) {
+        Member *m = group_findMember(vec_getValAt(t->groups, i), &from->conn);
+        if (m != NULL && m->credit != CREDIT_UNMETERED)
+            m->credit += bytes;
+    }
+
+    pushTopic(sh, t);
+}
+
+// deals the partitions of a group again and tells every member what it now owns
+static void dealPartitions(Shard *sh, Topic *t, Group *g) {
+
+    group_rebalance(g, log_start(t->log));
+
+    uint64_t members = 0;
+    for (uint i = 0; i < t->groups->size; i++)
+        members += ((Group *)vec_getValAt(t->groups, i))->members->size;
+    if (t->index != NULL)
+        atomic_store_explicit(&t->index->stats.members, members, memory_order_relaxed);
+
+    for (uint i = 0; i < g->members->size; i++) {
+        Member *m   = vec_getValAt(g->members, i);
+        Buffer *b   = replyBuf();
+        size_t  pos = proto_begin(b, OP_ASSIGN, 0);
+        proto_putStr(b, t->name);
+        proto_putStr(b, g->name);
+        proto_putU64(b, g->generation);
+        proto_putU32(b, g->nparts);
+        size_t countpos = buf_len(b);
+        proto_putU32(b, 0);
+
+        uint32_t n = 0;
+        for (uint32_t p = 0; p < g->nparts; p++) {
+            if (g->owner[p] == m) {
+                proto_putU32(b, p);
+                n++;
+            }
         }
+        proto_setU32(b, countpos, n);
+        proto_end(b, pos);
+
+        // a member that has gone away is dropped once its close comes through
+        shard_push(sh, &m->conn, buf_peek(b), buf_len(b));
+    }
 
-        else if (n == 0) {
+    LOG(LOG_INFO, "Group %s of topic %s now has %u members (generation %lu)\n", g->name, t->name, g->members->size,
+        (unsigned long)g->generation);
+}
+
+/**
+ * Sends every subscriber and group member the messages it has
+ * not seen yet, a batch at a time and as far as its credit
+ * goes. A stream out of credit waits for more rather than
+ * keeping the topic lagging, and one whose connection has a
+ * full window waits for it to make room.
+ *
+ * Publish acks are held while the slowest reader is further
+ * behind than the topic's high-water mark.
+ */
+static void pushTopic(Shard *sh, Topic *t) {
+
+    uint64_t start   = log_start(t->log);
+    uint64_t end     = log_end(t->log);
+    uint64_t now     = stats_now();
+    uint64_t backlog = 0;
+    uint64_t slowest = end; // first message some reader has yet to get
+    bool     behind  = false;
+    bool     waiting = false;
+
+    for (uint i = 0; i < t->subs->size;) {
+        Sub *s = vec_getValAt(t->subs, i);
+        if (s->next < start)
+            s->next = start;
+
+        // a local connection that has gone away is dropped here
+        int state = pushRange(sh, t, &s->conn, &s->next, end, 1, &s->credit, now);
+        if (state == PUSH_GONE) {
+            topic_unsubscribe(t, i);
             continue;
         }
 
-        char topic_dir[TMP_BUFLEN];
-        snprintf(topic_dir, TMP_BUFLEN, "%s/%s", msg_dir, msg.topic);
+        behind |= state == PUSH_DONE && s->next < end && s->credit > 0;
+        waiting |= state == PUSH_WAITING;
+        backlog += end - s->next;
+        slowest = (s->next < slowest) ? s->next : slowest;
+        i++;
+    }
 
-        // open the topic directory
-        DIR *td = opendir(topic_dir);
-        if (td == NULL) {
-            if (errno != ENOENT)
-                perror_and_exit("could not open directory");
-            if (mkdirat(dfd, msg.topic, S_IRWXU) == -1)
-                perror_and_exit("could not create directory");
-        }
+    // a partition is pushed to the member of each group that owns it
+    for (uint i = 0; i < t->groups->size; i++) {
+        Group *g = vec_getValAt(t->groups, i);
+        for (uint32_t p = 0; p < g->nparts; p++) {
+            Member *m = g->owner[p];
+            if (m == NULL)
+                continue;
+            if (m->next[p] < start)
+                m->next[p] = group_align(g, p, start);
+
+            int state = pushRange(sh, t, &m->conn, &m->next[p], end, g->nparts, &m->credit, now);
+            if (state == PUSH_GONE) {
+                ConnRef conn = m->conn;
+                group_leave(g, &conn);
+                dealPartitions(sh, t, g);
+                behind = true;
+                continue;
+            }
 
-        // prepare file name
-        char epochtime[TMP_BUFLEN];
-        char filename[TMP_BUFLEN];
-        snprintf(epochtime, TMP_BUFLEN, "%lu", (unsigned long)time(NULL));
-        snprintf(filename, TMP_BUFLEN, "%s/%s", topic_dir, epochtime);
-
-        // save msg to file
-        FILE *fp = fopen(filename, "a");
-        if (fp == NULL)
-            perror_and_exit("could not open file for writing");
-        fprintf(fp, "%s", msg.msg);
-        fclose(fp);
-
-        printf("Received message from publisher. Topic: %s\n", msg.topic);
-    }
-
-    closedir(dp);
-}
-
-static void handleSubscriber(const int connfd) {
-
-    ssize_t       n;
-    char          topic[TMP_BUFLEN];
-    unsigned long last_seen;
-
-    for (;;) {
-        // read topic
-        if ((n = read(connfd, &topic, sizeof topic)) == -1)
-            perror_and_exit("read error");
-
-        // read last seen
-        if ((n = read(connfd, &last_seen, sizeof last_seen)) == -1)
-            perror_and_exit("read error");
-
-        // open topic directory
-        char dirname[TMP_BUFLEN];
-        snprintf(dirname, TMP_BUFLEN, "%s/%s", msg_dir, topic);
-        DIR *dp = opendir(dirname);
-        if (dp == NULL)
-            perror_and_exit("could not open topic directory");
-
-        // check for new message
-        struct msg msg;
-        msg.topic[0]          = '\0';
-        bool           newmsg = false;
-        struct dirent *ent;
-        while ((ent = readdir(dp)) != NULL) {
-            if (ent->d_type == DT_REG) {
-                unsigned long timestamp = strtoul(ent->d_name, NULL, 10);
-                if (timestamp <= last_seen)
-                    continue;
-
-                newmsg = true;
-                strncpy(msg.topic, ent->d_name, TMP_BUFLEN);
-                char filename[TMP_BUFLEN];
-                snprintf(filename, TMP_BUFLEN, "%s/%s", dirname, ent->d_name);
-
-                // read message from file
-                FILE *fp = fopen(filename, "r");
-                if (fp == NULL)
-                    perror_and_exit("could not open file");
-                if (readLine(fp, msg.msg, TMP_BUFLEN) == NULL)
-                    perror_and_exit("could not read from file");
-
-                fclose(fp);
+            waiting |= state == PUSH_WAITING;
+            if (m->next[p] < end) {
+                behind |= state == PUSH_DONE && m->credit > 0;
+                backlog += (end - m->next[p] + g->nparts - 1) / g->nparts;
+                slowest = (m->next[p] < slowest) ? m->next[p] : slowest;
             }
         }
+    }
+
+    if (t->index != NULL)
+        atomic_store_explicit(&t->index->stats.backlog, backlog, memory_order_relaxed);
 
-        // send message
-        if (write(connfd, &msg, sizeof msg) == -1)
-            perror_and_exit("error while sending message");
+    if (behind && !t->lagging) {
+        if (lagging == NULL)
+            lagging = vec_init_ptr();
+        vec_pushBack(lagging, &t);
+        t->lagging = true;
+    }
 
-        if (newmsg)
-            printf("Sent message to subscriber. Topic: %s\n", topic);
+    if (waiting && !t->stalled) {
+        if (stalled == NULL)
+            stalled = vec_init_ptr();
+        vec_pushBack(stalled, &t);
+        t->stalled = true;
+    }
 
-        closedir(dp);
+    off_t highwater = t->retain->highwater;
+    t->flooded      = highwater > 0 && slowest < end && log_bytesFrom(t->log, slowest) > highwater;
+
+    // the acks go out at the end of the loop iteration, the connections may be in use now
+    if (!t->flooded && !vec_isEmpty(t->held)) {
+        if (released == NULL)
+            released = vec_init_ptr();
+        for (uint i = 0; i < t->held->size; i++)
+            vec_pushBack(released, vec_getAt(t->held, i));
+        vec_free(t->held);
+        t->held = vec_init_ptr();
     }
 }
 
-static void cleanOldMsg() {
+// topics with streams waiting for room are pushed again, those still waiting queue themselves up again
+static void pushStalled(Shard *sh) {
 
-    gotalarm = 0;
+    if (stalled == NULL || vec_isEmpty(stalled))
+        return;
 
-    DIR *dp = opendir(msg_dir);
-    if (dp == NULL)
-        perror_and_exit("could not open message directory");
+    Vector *todo = stalled;
+    stalled      = vec_init_ptr();
+    for (uint i = 0; i < todo->size; i++) {
+        Topic *t   = vec_getValAt(todo, i);
+        t->stalled = false;
+        pushTopic(sh, t);
+    }
+    vec_free(todo);
+}
 
-    // recursively traverse the message directory
-    unsigned long  curtime = (unsigned long)time(NULL);
-    struct dirent *ent;
-    while ((ent = readdir(dp)) != NULL) {
-        if (ent->d_type == DT_DIR && strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
-            char path[TMP_BUFLEN];
-            snprintf(path, TMP_BUFLEN, "%s/%s", msg_dir, ent->d_name);
+// pushes messages next, next + step, ... before end to a connection while credit and its window last (push_state);
+// next is left on a message that could not be queued
+static int pushRange(Shard *sh, Topic *t, const ConnRef *conn, uint64_t *next, const uint64_t end, const uint64_t step,
+                     int64_t *credit, const uint64_t now) {
 
-            // open subdirectory
-            DIR *dpt = opendir(path);
-            if (dpt == NULL) {
-                perror("could not open topic directory");
+    Buffer *b     = replyBuf();
+    int     state = PUSH_DONE;
+    for (int n = 0; n < PUSH_BATCH && *next < end && *credit > 0; n++, *next += step) {
+        if (!shard_canPush(sh, conn)) {
+            state = PUSH_WAITING;
+            break;
+        }
+
+        size_t pos = proto_begin(b, OP_PUSH, 0);
+        proto_putStr(b, t->name);
+        proto_putU64(b, *next);
+
+        // a large message is sent from the log, after the pushes gathered so far
+        int      fd;
+        off_t    off;
+        uint32_t len;
+        if (locateLarge(t, *next, &fd, &off, &len)) {
+            if (pos > 0 && !shard_push(sh, conn, buf_peek(b), pos))
+                return PUSH_GONE;
+            buf_consume(b, pos);
+            pos = 0;
+
+            // one too large for a frame goes in pieces, each with a header of its own
+            if (len > MSG_MAXLEN) {
+                buf_consume(b, buf_len(b));
+                for (uint32_t left = len; left > 0;) {
+                    uint32_t piece = (left > CHUNK_LEN) ? CHUNK_LEN : left;
+                    size_t   at    = proto_begin(b, OP_PUSH, (piece < left) ? FLAG_MORE : 0);
+                    proto_putStr(b, t->name);
+                    proto_putU64(b, *next);
+                    proto_endWith(b, at, piece);
+                    left -= piece;
+                }
+                bool ok = shard_pushFile(sh, conn, buf_peek(b), buf_len(b), fd, off, len, CHUNK_LEN);
+                buf_consume(b, buf_len(b));
+                if (!ok && shard_conn(sh, conn) == NULL && conn->shard == sh->id)
+                    return PUSH_GONE;
+
+                // no duplicate of the log to send it with, it is tried again on the tick
+                if (!ok)
+                    return PUSH_WAITING;
+                countPush(sh, t, *next, len, now);
+                spend(credit, len);
                 continue;
             }
 
-            // delete all old messages in subdirectory
-            struct dirent *entt;
-            while ((entt = readdir(dpt)) != NULL) {
-                if (entt->d_type == DT_REG) {
-                    unsigned long timestamp = strtoul(entt->d_name, NULL, 10);
-                    if (curtime - timestamp > MESSAGE_TIME_LIMIT) {
-                        char filename[TMP_BUFLEN];
-                        snprintf(filename, TMP_BUFLEN, "%s/%s", path, entt->d_name);
-                        if (remove(filename) == -1)
-                            perror_and_exit("could not delete file");
-                        printf("removed old message %s\n", filename);
-                    }
-                }
+            proto_endWith(b, pos, len);
+            if (shard_pushFile(sh, conn, buf_peek(b), buf_len(b), fd, off, len, len)) {
+                buf_consume(b, buf_len(b));
+                countPush(sh, t, *next, len, now);
+                spend(credit, len);
+                continue;
+            }
+        }
+
+        ssize_t size = topic_read(t, *next, b, NULL);
+        if (size == -1) {
+            buf_truncate(b, pos); // unreadable, skip it
+            continue;
+        }
+        proto_end(b, pos);
+        countPush(sh, t, *next, size, now);
+        spend(credit, size);
+    }
+
+    return (buf_len(b) == 0 || shard_push(sh, conn, buf_peek(b), buf_len(b))) ? state : PUSH_GONE;
+}
+
+static void spend(int64_t *credit, const uint64_t len) {
+    if (*credit != CREDIT_UNMETERED)
+        *credit -= len;
+}
+
+// only messages from the latest append have a known store time
+static void countPush(Shard *sh, Topic *t, const uint64_t seq, const uint64_t len, const uint64_t now) {
+
+    if (seq >= t->stored_from)
+        stats_latency(sh->id, LAT_DELIVER, now - t->stored_ns);
+
+    if (t->index != NULL) {
+        stats_add(&t->index->stats.pushed, 1);
+        stats_add(&t->index->stats.pushbytes, len);
+    }
+}
+
+// removes the subscriptions, patterns and group memberships of a closed connection from this shard's topics
+static void dropSubs(Shard *sh, const ConnRef *conn) {
+
+    topic_unwatch(conn);
+
+    Vector *all = topic_all();
+    for (uint i = 0; i < all->size; i++) {
+        Topic *t    = vec_getValAt(all, i);
+        bool   left = false;
+        for (uint j = 0; j < t->subs->size;) {
+            Sub *s = vec_getValAt(t->subs, j);
+            if (shard_sameConn(&s->conn, conn)) {
+                topic_unsubscribe(t, j);
+                left = true;
+            } else {
+                j++;
             }
         }
+
+        // the partitions of a member that left go to the others, a slow reader leaving may free held acks
+        for (uint j = 0; j < t->groups->size; j++) {
+            Group *g = vec_getValAt(t->groups, j);
+            if (group_leave(g, conn)) {
+                dealPartitions(sh, t, g);
+                left = true;
+            }
+        }
+        if (left)
+            pushTopic(sh, t);
     }
+}
+
+// drops the streams of this shard's topics that another broker owns, telling the clients where to go
+static void handOver(Shard *sh) {
+
+    Vector *all = topic_all();
+    for (uint i = 0; i < all->size; i++) {
+        Topic      *t    = vec_getValAt(all, i);
+        const Node *node = fed_owner(t->name);
+        if (node == NULL)
+            continue;
+
+        Buffer *b = replyBuf();
+        putOwner(b, node);
+
+        uint dropped = 0;
+        // a pattern stays with this broker, the other brokers have their own topics to match it against
+        for (; !vec_isEmpty(t->subs); dropped++) {
+            Sub *s = vec_getValAt(t->subs, 0);
+            if (!s->matched)
+                shard_push(sh, &s->conn, buf_peek(b), buf_len(b));
+            topic_unsubscribe(t, 0);
+        }
+
+        for (uint j = 0; j < t->groups->size; j++) {
+            Group *g = vec_getValAt(t->groups, j);
+            for (; !vec_isEmpty(g->members); dropped++) {
+                Member *m    = vec_getValAt(g->members, 0);
+                ConnRef conn = m->conn;
+                shard_push(sh, &conn, buf_peek(b), buf_len(b));
+                group_leave(g, &conn);
+            }
+        }
+        if (t->index != NULL)
+            atomic_store_explicit(&t->index->stats.members, 0, memory_order_relaxed);
+
+        if (dropped > 0)
+            LOG(LOG_INFO, "Topic %s moved to %s:%u, %u streams sent there\n", t->name, node->host, node->pubport,
+                dropped);
+    }
+}
+
+// acks a publish once the topic's readers are not too far behind and, if the store is durable, the messages are on disk
+static void sendAck(Shard *sh, Topic *t, const Job *from, Buffer *b) {
+
+    if (!durable && !t->flooded) {
+        sendReply(sh, from, b);
+        return;
+    }
+
+    Job *ack   = job_new(JOB_REPLY, sh, NULL, buf_peek(b), buf_len(b));
+    ack->conn  = from->conn;
+    ack->reqno = from->reqno;
+    ack->ns    = stats_now();
+    buf_consume(b, buf_len(b));
+
+    if (t->flooded)
+        vec_pushBack(t->held, &ack);
+    else
+        awaitSync(ack);
+}
+
+static void awaitSync(Job *ack) {
+
+    if (unsynced == NULL)
+        unsynced = vec_init_ptr();
+    if (vec_isEmpty(unsynced))
+        unsynced_ns = ack->ns;
+    vec_pushBack(unsynced, &ack);
+}
+
+// sends the acks of topics that have caught up, by way of the next sync if the store is durable
+static void sendReleased(Shard *sh) {
+
+    if (released == NULL || vec_isEmpty(released))
+        return;
+
+    Vector  *acks = released;
+    uint64_t now  = stats_now();
+    released      = vec_init_ptr();
+    for (uint i = 0; i < acks->size; i++) {
+        Job *ack = vec_getValAt(acks, i);
+        if (durable) {
+            ack->ns = now;
+            awaitSync(ack);
+            continue;
+        }
+
+        shard_reply(sh, ack, ack->data, ack->len);
+        Conn *c = (ack->conn.shard == sh->id) ? shard_conn(sh, &ack->conn) : NULL;
+        if (c != NULL)
+            shard_flush(sh, c);
+        free(ack);
+    }
+    vec_free(acks);
+}
+
+/**
+ * Group commit: once the oldest ack has waited sync_budget,
+ * everything this shard stored meanwhile is synced at once and
+ * all the acks go out. Replies after them on a connection are
+ * held back until then, as replies keep their order.
+ *
+ * Returns the ms until the next sync is due, -1 if none is.
+ */
+static int commitStored(Shard *sh) {
+
+    if (unsynced == NULL || vec_isEmpty(unsynced))
+        return -1;
+
+    uint64_t now = stats_now();
+    if (now - unsynced_ns < sync_budget)
+        return (sync_budget - (now - unsynced_ns) + 999999) / 1000000;
+
+    bool     ok   = store_sync();
+    uint64_t done = stats_now();
+
+    Vector *acks = unsynced;
+    unsynced     = vec_init_ptr();
+    for (uint i = 0; i < acks->size; i++) {
+        Job *ack = vec_getValAt(acks, i);
+        stats_latency(sh->id, LAT_SYNC, done - ack->ns);
+
+        if (ok) {
+            shard_reply(sh, ack, ack->data, ack->len);
+        } else {
+            Buffer *b = replyBuf();
+            proto_error(b, ERR_STORE, "could not sync messages");
+            sendReply(sh, ack, b);
+        }
+
+        Conn *c = (ack->conn.shard == sh->id) ? shard_conn(sh, &ack->conn) : NULL;
+        if (c != NULL)
+            shard_flush(sh, c);
+        free(ack);
+    }
+    vec_free(acks);
+
+    return -1;
+}
+
+static void putOwner(Buffer *b, const Node *n) {
+    size_t pos = proto_begin(b, OP_OWNER, 0);
+    proto_putStr(b, n->host);
+    proto_putU16(b, n->pubport);
+    proto_putU16(b, n->subport);
+    proto_end(b, pos);
+}
+
+static Buffer *replyBuf() {
+
+    if (scratch == NULL)
+        scratch = buf_init(BUF_START_SIZE);
+
+    buf_consume(scratch, buf_len(scratch));
+
+    return scratch;
+}
+
+static void sendReply(Shard *sh, const Job *from, Buffer *b) {
+    shard_reply(sh, from, buf_peek(b), buf_len(b));
+    buf_consume(b, buf_len(b));
+}
 
-    closedir(dp);
+static void replyError(Shard *sh, const Job *from, const uint16_t code, const char *reason) {
+    Buffer *b = replyBuf();
+    proto_error(b, code, reason);
+    sendReply(sh, from, b);
 }
@@ -1,9 +1,18 @@
 #ifndef BROKER_H
 #define BROKER_H
 
+#include "Broker/federation.h"
+#include "Broker/group.h"
+#include "Broker/index.h"
+#include "Broker/registry.h"
+#include "Broker/retention.h"
+#include "Broker/shard.h"
+#include "Broker/stats.h"
+#include "Broker/store.h"
+#include "Broker/topic.h"
+#include "Utils/buffer.h"
+#include "Utils/proto.h"
+#include "Utils/trie.h"
 #include "Utils/utils.h"
 
-#define BROKER_PUB_PORT 14342
-#define BROKER_SUB_PORT 11312
-
 #endif // BROKER_H
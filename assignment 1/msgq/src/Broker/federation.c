@@ -0,0 +1,253 @@
+#include "federation.h"
+
+#include "Broker/broker.h"
+
+#include <poll.h>
+#include <pthread.h>
+
+// a peer and the connection its heartbeats go over
+typedef struct Peer {
+    Node    node;
+    bool    up;
+    int     fd; // -1 while not connected
+    Buffer *in;
+    Buffer *out;
+} Peer;
+
+struct point {
+    uint64_t    hash;
+    const Node *node;
+};
+
+typedef struct HashRing {
+    uint64_t     generation;
+    uint         n;
+    struct point points[]; // sorted by hash
+} HashRing;
+
+static Node self = {
+    .pubport   = BROKER_PUB_PORT,
+    .subport   = BROKER_SUB_PORT,
+    .statsport = BROKER_STATS_PORT,
+};
+static Vector            *peers; // Vector<Peer *>
+static _Atomic(HashRing *) ring; // NULL if not federated
+
+static bool      parseNode(const char *spec, Node *n);
+static uint64_t  hash(const char *s);
+static HashRing *buildRing(const uint64_t generation);
+static int       cmpPoint(const void *a, const void *b);
+static void     *heartbeat(void *arg);
+static bool      probe(Peer *p);
+static int       connectTo(const Node *n);
+
+bool fed_setSelf(const char *spec) { return parseNode(spec, &self); }
+
+bool fed_addPeer(const char *spec) {
+
+    Peer *p = malloc(sizeof *p);
+    *p      = (Peer){.fd = -1, .in = buf_init(BUF_START_SIZE), .out = buf_init(BUF_START_SIZE)};
+    if (!parseNode(spec, &p->node)) {
+        free(p);
+        return false;
+    }
+
+    if (peers == NULL)
+        peers = vec_init_ptr();
+    vec_pushBack(peers, &p);
+
+    return true;
+}
+
+void fed_start() {
+
+    if (peers == NULL)
+        return;
+
+    // brokers started together may not see each other until the next round
+    for (uint i = 0; i < peers->size; i++) {
+        Peer *p = vec_getValAt(peers, i);
+        p->up   = probe(p);
+    }
+    atomic_store(&ring, buildRing(1));
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, heartbeat, NULL) != 0)
+        perror_and_exit("could not start heartbeats");
+}
+
+const Node *fed_self() { return &self; }
+
+const Node *fed_owner(const char *topic) {
+
+    HashRing *r = atomic_load_explicit(&ring, memory_order_acquire);
+    if (r == NULL)
+        return NULL;
+
+    // first point at or after the hash, wrapping around
+    uint64_t h  = hash(topic);
+    uint     lo = 0, hi = r->n;
+    while (lo < hi) {
+        uint mid = lo + (hi - lo) / 2;
+        if (r->points[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    const Node *n = r->points[(lo == r->n) ? 0 : lo].node;
+    return (n == &self) ? NULL : n;
+}
+
+uint64_t fed_generation() {
+    HashRing *r = atomic_load_explicit(&ring, memory_order_acquire);
+    return (r == NULL) ? 0 : r->generation;
+}
+
+// the stats port moves along with the others
+static bool parseNode(const char *spec, Node *n) {
+
+    Owner o;
+    // brokers reach each other over TCP, a unix socket would only name this host
+    if (!proto_parseAddr(spec, &o) || proto_isUnix(&o))
+        return false;
+
+    long statsport = BROKER_STATS_PORT + o.pubport - BROKER_PUB_PORT;
+    if (statsport <= 0 || statsport > UINT16_MAX)
+        return false;
+
+    snprintf(n->host, sizeof n->host, "%s", o.host);
+    n->pubport   = o.pubport;
+    n->subport   = o.subport;
+    n->statsport = statsport;
+
+    return true;
+}
+
+// FNV-1a, mixed so that similar names land far apart
+static uint64_t hash(const char *s) {
+
+    uint64_t h = 14695981039346656037ULL;
+    for (; *s != '\0'; s++)
+        h = (h ^ (uint8_t)*s) * 1099511628211ULL;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+// this broker and the peers that are up
+static HashRing *buildRing(const uint64_t generation) {
+
+    uint nodes = 1;
+    for (uint i = 0; i < peers->size; i++)
+        nodes += ((Peer *)vec_getValAt(peers, i))->up;
+
+    HashRing *r = malloc(sizeof *r + nodes * FED_VNODES * sizeof(struct point));
+    r->generation = generation;
+    r->n          = 0;
+
+    for (uint i = 0; i <= peers->size; i++) {
+        const Node *n = &self;
+        if (i < peers->size) {
+            Peer *p = vec_getValAt(peers, i);
+            if (!p->up)
+                continue;
+            n = &p->node;
+        }
+
+        for (uint v = 0; v < FED_VNODES; v++) {
+            char name[HOST_MAXLEN + 32];
+            snprintf(name, sizeof name, "%s:%u#%u", n->host, n->pubport, v);
+            r->points[r->n++] = (struct point){.hash = hash(name), .node = n};
+        }
+    }
+
+    qsort(r->points, r->n, sizeof(struct point), cmpPoint);
+
+    return r;
+}
+
+static int cmpPoint(const void *a, const void *b) {
+    uint64_t x = ((const struct point *)a)->hash;
+    uint64_t y = ((const struct point *)b)->hash;
+    return (x > y) - (x < y);
+}
+
+static void *heartbeat(void *arg) {
+
+    HashRing *retired = NULL; // swapped out a round ago
+    for (;;) {
+        struct timespec ts = {.tv_sec = FED_PERIOD_MS / 1000, .tv_nsec = (FED_PERIOD_MS % 1000) * 1000000L};
+        nanosleep(&ts, NULL);
+
+        bool changed = false;
+        for (uint i = 0; i < peers->size; i++) {
+            Peer *p  = vec_getValAt(peers, i);
+            bool  up = probe(p);
+            if (up != p->up) {
+                LOG(LOG_INFO, "Broker %s:%u %s the federation\n", p->node.host, p->node.pubport,
+                    up ? "joined" : "left");
+                p->up   = up;
+                changed = true;
+            }
+        }
+
+        // shards may still be reading the ring swapped out, it is freed once they have had a whole round to let go
+        if (changed) {
+            free(retired);
+            retired = atomic_exchange_explicit(&ring, buildRing(fed_generation() + 1), memory_order_acq_rel);
+        }
+    }
+
+    return NULL;
+}
+
+// one heartbeat, connecting first if needed; false if the peer is down
+static bool probe(Peer *p) {
+
+    if (p->fd == -1 && (p->fd = connectTo(&p->node)) == -1)
+        return false;
+
+    Owner o;
+    if (proto_locate(p->fd, p->out, p->in, "", &o))
+        return true;
+
+    close(p->fd);
+    p->fd = -1;
+    buf_consume(p->in, buf_len(p->in));
+    buf_consume(p->out, buf_len(p->out));
+
+    return false;
+}
+
+// blocking connection to a publisher port, with FED_TIMEOUT_MS on connect and every read and write
+static int connectTo(const Node *n) {
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(n->pubport)};
+    if (inet_pton(AF_INET, n->host, &addr.sin_addr) != 1)
+        return -1;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1)
+        return -1;
+
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    int           err = 0;
+    socklen_t     len = sizeof err;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr) == -1 &&
+        (errno != EINPROGRESS || poll(&pfd, 1, FED_TIMEOUT_MS) != 1 ||
+         getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0)) {
+        close(fd);
+        return -1;
+    }
+
+    struct timeval tv = {.tv_sec = FED_TIMEOUT_MS / 1000, .tv_usec = (FED_TIMEOUT_MS % 1000) * 1000};
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+    return fd;
+}
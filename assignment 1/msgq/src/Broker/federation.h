@@ -0,0 +1,81 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+/**
+ * Several brokers sharing the topics between them.
+ *
+ * A broker is named by the address clients reach it on, as
+ * "<host>[:<publisher port>]" (see proto_parseAddr()). Its stats
+ * port is shifted along with the subscriber port, so brokers
+ * can run side by side on one machine. Every broker
+ * of a federation is given its own name and those of the
+ * others, spelled the same way everywhere.
+ *
+ * Topics are owned by the broker that follows their hash on a
+ * consistent hash ring, where each broker is FED_VNODES points.
+ * A broker sends every peer a heartbeat (an OP_LOCATE) each
+ * FED_PERIOD_MS and keeps only the peers that answer on its
+ * ring, so when a broker joins or leaves, only the topics
+ * next to its points change hands.
+ *
+ * Rings are built by the heartbeat thread and swapped in
+ * whole, the shards only read them. A lookup is over long
+ * before the next heartbeat, so the ring swapped out is freed
+ * when the one after it comes in.
+ *
+ * Only ownership moves, stored messages do not: what was
+ * published to a broker standing in for one that was down
+ * stays there, out of reach of redirects once the owner is
+ * back. Brokers also judge their peers on their own, and may
+ * disagree for a round about who owns a topic; clients follow
+ * a single redirect, so they are never sent back and forth.
+ */
+
+#include "Utils/proto.h"
+#include "Utils/utils.h"
+
+#define FED_VNODES     64   // points per broker on the ring
+#define FED_PERIOD_MS  1000 // between heartbeats
+#define FED_TIMEOUT_MS 500  // a peer that takes longer to answer is down
+
+typedef struct Node {
+    char     host[HOST_MAXLEN + 1]; // empty if not federated
+    uint16_t pubport;
+    uint16_t subport;
+    uint16_t statsport;
+} Node;
+
+/**
+ * Sets the name of this broker from "<host>[:<publisher port>]".
+ * Returns false if spec is malformed.
+ */
+bool fed_setSelf(const char *spec);
+
+/**
+ * Adds another broker of the federation, named the same way.
+ * Returns false if spec is malformed.
+ */
+bool fed_addPeer(const char *spec);
+
+/**
+ * Checks which peers are up and starts the heartbeats.
+ * Called in main once the peers are known.
+ */
+void fed_start();
+
+/**
+ * This broker.
+ */
+const Node *fed_self();
+
+/**
+ * Broker that owns a topic, NULL if it is this one.
+ */
+const Node *fed_owner(const char *topic);
+
+/**
+ * Bumped whenever topics may have changed hands.
+ */
+uint64_t fed_generation();
+
+#endif // FEDERATION_H
@@ -0,0 +1,106 @@
+#include "group.h"
+
+static uint32_t nparts = GROUP_PARTITIONS;
+
+void group_setPartitions(const uint32_t n) { nparts = n; }
+
+Group *group_new(const char *name) {
+
+    Group *g = malloc(sizeof *g);
+    *g       = (Group){
+        .name      = strdup(name),
+        .nparts    = nparts,
+        .committed = calloc(nparts, sizeof *g->committed),
+        .owner     = calloc(nparts, sizeof *g->owner),
+        .members   = vec_init_ptr(),
+    };
+
+    return g;
+}
+
+Group *group_find(const Vector *groups, const char *name) {
+
+    for (uint i = 0; i < groups->size; i++) {
+        Group *g = vec_getValAt(groups, i);
+        if (strcmp(g->name, name) == 0)
+            return g;
+    }
+
+    return NULL;
+}
+
+Member *group_findMember(const Group *g, const ConnRef *conn) {
+
+    for (uint i = 0; i < g->members->size; i++) {
+        Member *m = vec_getValAt(g->members, i);
+        if (shard_sameConn(&m->conn, conn))
+            return m;
+    }
+
+    return NULL;
+}
+
+Member *group_join(Group *g, const ConnRef *conn) {
+
+    Member *m = group_findMember(g, conn);
+    if (m != NULL)
+        return m;
+
+    m  = malloc(sizeof *m);
+    *m = (Member){.conn = *conn, .next = calloc(g->nparts, sizeof *m->next), .credit = CREDIT_UNMETERED};
+    vec_pushBack(g->members, &m);
+
+    return m;
+}
+
+bool group_leave(Group *g, const ConnRef *conn) {
+
+    for (uint i = 0; i < g->members->size; i++) {
+        Member *m = vec_getValAt(g->members, i);
+        if (!shard_sameConn(&m->conn, conn))
+            continue;
+
+        for (uint32_t p = 0; p < g->nparts; p++) {
+            if (g->owner[p] == m)
+                g->owner[p] = NULL;
+        }
+
+        free(m->next);
+        free(m);
+        vec_removeAt(g->members, i);
+        return true;
+    }
+
+    return false;
+}
+
+void group_rebalance(Group *g, const uint64_t start) {
+
+    g->generation++;
+
+    uint n = g->members->size;
+    for (uint32_t p = 0; p < g->nparts; p++) {
+        Member *m = (n == 0) ? NULL : vec_getValAt(g->members, p % n);
+        if (m == g->owner[p])
+            continue;
+
+        // the new owner picks up where the group last committed
+        g->owner[p] = m;
+        if (m != NULL)
+            m->next[p] = group_align(g, p, (g->committed[p] > start) ? g->committed[p] : start);
+    }
+}
+
+bool group_commit(Group *g, const uint64_t id) {
+
+    uint32_t p = id % g->nparts;
+    if (id < g->committed[p])
+        return false;
+
+    g->committed[p] = id + 1;
+    return true;
+}
+
+uint64_t group_align(const Group *g, const uint32_t p, const uint64_t from) {
+    return from + (p + g->nparts - from % g->nparts) % g->nparts;
+}
@@ -0,0 +1,101 @@
+#ifndef GROUP_H
+#define GROUP_H
+
+/**
+ * Consumer groups.
+ *
+ * A topic is split into a fixed number of partitions, message
+ * id i being in partition i % partitions. The members of a
+ * group share the partitions between them, so each message is
+ * pushed to a single member of the group. Partitions are dealt
+ * out round robin in join order, and dealt again whenever a
+ * member joins or leaves.
+ *
+ * Per partition the group keeps a committed offset, the id of
+ * the first message its members have not yet processed. A
+ * partition handed to another member is pushed again from its
+ * committed offset, so every message is delivered at least
+ * once.
+ *
+ * Groups live with their topic, on the shard that owns it, and
+ * are kept (with their offsets) after the last member leaves.
+ */
+
+#include "Broker/shard.h"
+#include "Utils/utils.h"
+#include "Utils/vector.h"
+
+#define GROUP_PARTITIONS 16 // default partitions per topic
+
+typedef struct Member {
+    ConnRef   conn;
+    uint64_t *next;   // per partition, id of the next message to push (owned partitions only)
+    int64_t   credit; // bytes that may still be pushed, over all partitions
+} Member;
+
+typedef struct Group {
+    char     *name;
+    uint32_t  nparts;     // partitions of the topic
+    uint64_t  generation; // bumped on every rebalance
+    uint64_t *committed;  // per partition, id of the first message not yet processed
+    Member  **owner;      // per partition, NULL while the group has no members
+    Vector   *members;    // Vector<Member *>, in join order
+} Group;
+
+/**
+ * Sets the number of partitions of every topic. Called in main
+ * before the shards start.
+ */
+void group_setPartitions(const uint32_t n);
+
+/**
+ * Creates a group without members, all offsets at 0.
+ */
+Group *group_new(const char *name);
+
+/**
+ * Group called name in groups (Vector<Group *>), NULL if none.
+ */
+Group *group_find(const Vector *groups, const char *name);
+
+/**
+ * Membership of a connection, NULL if it is not a member.
+ */
+Member *group_findMember(const Group *g, const ConnRef *conn);
+
+/**
+ * Adds a member, or returns the existing one. It owns nothing
+ * until group_rebalance() is called, and its pushes are only
+ * held to the window of its connection until given some credit.
+ */
+Member *group_join(Group *g, const ConnRef *conn);
+
+/**
+ * Removes a member. Its partitions are left without an owner
+ * until group_rebalance() is called.
+ *
+ * Returns false if conn was not a member.
+ */
+bool group_leave(Group *g, const ConnRef *conn);
+
+/**
+ * Deals the partitions out to the members. A member given a
+ * partition it did not have starts at the committed offset,
+ * or at the first message at or after start if that is later.
+ */
+void group_rebalance(Group *g, const uint64_t start);
+
+/**
+ * Records that message id and everything before it in the same
+ * partition has been processed.
+ *
+ * Returns true if the committed offset moved forward.
+ */
+bool group_commit(Group *g, const uint64_t id);
+
+/**
+ * First message id of partition p at or after from.
+ */
+uint64_t group_align(const Group *g, const uint32_t p, const uint64_t from);
+
+#endif // GROUP_H
@@ -0,0 +1,188 @@
+#include "index.h"
+
+#include <sys/mman.h>
+
+enum slot_state {
+    SLOT_FREE,
+    SLOT_CLAIMED,
+    SLOT_READY,
+};
+
+static TopicIndex *slots; // INDEX_SLOTS entries in one shared mapping
+
+static bool copyMsg(TopicIndex *ix, const uint64_t seq, Buffer *b, const bool record, time_t *ts);
+
+void index_init() {
+
+    // untouched slots cost nothing
+    slots = mmap(NULL, INDEX_SLOTS * sizeof *slots, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE,
+                 -1, 0);
+    if (slots == MAP_FAILED)
+        perror_and_exit("could not map topic index");
+}
+
+TopicIndex *index_add(const char *topic, const uint64_t end) {
+
+    u_long h = ht_polyRollingHash(&topic);
+    for (uint i = 0; i < INDEX_SLOTS; i++) {
+        TopicIndex *ix    = &slots[(h + i) % INDEX_SLOTS];
+        uint32_t    state = SLOT_FREE;
+
+        // topics are never removed, so the owner may find its own entry again
+        if (atomic_load_explicit(&ix->state, memory_order_acquire) == SLOT_READY && strcmp(ix->name, topic) == 0) {
+            index_trim(ix, end);
+            return ix;
+        }
+
+        if (!atomic_compare_exchange_strong(&ix->state, &state, SLOT_CLAIMED))
+            continue;
+
+        strcpy(ix->name, topic);
+        atomic_store_explicit(&ix->head, end, memory_order_relaxed);
+        atomic_store_explicit(&ix->tail, end, memory_order_relaxed);
+        ix->wpos = 0;
+        atomic_store_explicit(&ix->state, SLOT_READY, memory_order_release);
+
+        return ix;
+    }
+
+    return NULL;
+}
+
+TopicIndex *index_find(const char *topic) {
+
+    u_long h = ht_polyRollingHash(&topic);
+    for (uint i = 0; i < INDEX_SLOTS; i++) {
+        TopicIndex *ix    = &slots[(h + i) % INDEX_SLOTS];
+        uint32_t    state = atomic_load_explicit(&ix->state, memory_order_acquire);
+        if (state == SLOT_FREE)
+            return NULL;
+        if (state == SLOT_READY && strcmp(ix->name, topic) == 0)
+            return ix;
+    }
+
+    return NULL;
+}
+
+TopicIndex *index_slot(const uint i) {
+    TopicIndex *ix = &slots[i];
+    return (atomic_load_explicit(&ix->state, memory_order_acquire) == SLOT_READY) ? ix : NULL;
+}
+
+void index_append(TopicIndex *ix, const uint64_t seq, const void *data, const uint32_t len, const time_t ts) {
+
+    // start over if the ring and the log went out of step
+    if (atomic_load_explicit(&ix->head, memory_order_relaxed) != seq)
+        index_trim(ix, seq);
+
+    if (len >= SENDFILE_MIN_LEN) {
+        index_trim(ix, seq + 1);
+        return;
+    }
+
+    // bytes are laid out in order, wrapping to the start when the end is reached,
+    // every message takes at least one byte so the oldest is always next in line
+    uint32_t n    = (len > 0) ? len : 1;
+    uint32_t a    = ix->wpos;
+    bool     wrap = a + n > INDEX_BYTES;
+
+    // give up the oldest messages whose descriptor or bytes are about to be reused
+    uint64_t tail = atomic_load_explicit(&ix->tail, memory_order_relaxed);
+    while (tail < seq) {
+        const struct msg_desc *d  = &ix->desc[tail % INDEX_MSGS];
+        uint32_t               dn = (d->len > 0) ? d->len : 1;
+        bool                   hit;
+        if (seq - tail >= INDEX_MSGS)
+            hit = true;
+        else if (wrap)
+            hit = d->off + dn > a || d->off < n;
+        else
+            hit = d->off < a + n && d->off + dn > a;
+        if (!hit)
+            break;
+        tail++;
+    }
+    atomic_store_explicit(&ix->tail, tail, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    uint32_t off = wrap ? 0 : a;
+    memcpy(ix->data + off, data, len);
+    ix->desc[seq % INDEX_MSGS] = (struct msg_desc){.seq = seq, .ts = ts, .off = off, .len = len};
+    ix->wpos                   = off + n;
+
+    atomic_store_explicit(&ix->head, seq + 1, memory_order_release);
+}
+
+void index_trim(TopicIndex *ix, const uint64_t start) {
+
+    uint64_t head = atomic_load_explicit(&ix->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ix->tail, memory_order_relaxed);
+
+    if (start > head) {
+        atomic_store_explicit(&ix->tail, start, memory_order_release);
+        atomic_store_explicit(&ix->head, start, memory_order_release);
+    } else if (start > tail) {
+        atomic_store_explicit(&ix->tail, start, memory_order_release);
+    }
+}
+
+uint64_t index_end(TopicIndex *ix) { return atomic_load_explicit(&ix->head, memory_order_acquire); }
+
+ssize_t index_read(TopicIndex *ix, const uint64_t seq, Buffer *b, time_t *ts) {
+
+    size_t mark = buf_len(b);
+    if (!copyMsg(ix, seq, b, false, ts))
+        return -1;
+
+    return buf_len(b) - mark;
+}
+
+uint32_t index_readBatch(TopicIndex *ix, uint64_t seq, const uint32_t max, const size_t maxbytes, Buffer *b) {
+
+    uint32_t n     = 0;
+    size_t   bytes = 0;
+
+    for (; n < max; n++, seq++) {
+        size_t mark = buf_len(b);
+        if (!copyMsg(ix, seq, b, true, NULL))
+            break;
+
+        // at least one record per batch
+        bytes += buf_len(b) - mark;
+        if (n > 0 && bytes > maxbytes) {
+            buf_truncate(b, mark);
+            break;
+        }
+    }
+
+    return n;
+}
+
+// appends a message (as a log record if record is set), false if it is no longer in the ring
+static bool copyMsg(TopicIndex *ix, const uint64_t seq, Buffer *b, const bool record, time_t *ts) {
+
+    if (seq >= atomic_load_explicit(&ix->head, memory_order_acquire) ||
+        seq < atomic_load_explicit(&ix->tail, memory_order_acquire))
+        return false;
+
+    struct msg_desc d = ix->desc[seq % INDEX_MSGS];
+    if (d.seq != seq || d.off + d.len > INDEX_BYTES)
+        return false;
+
+    size_t         mark = buf_len(b);
+    struct rec_hdr hdr  = {.len = d.len, .ts = d.ts};
+    if ((record && !buf_append(b, &hdr, sizeof hdr)) || !buf_append(b, ix->data + d.off, d.len))
+        perror_and_exit("could not grow buffer");
+
+    // the writer may have reused the slot while we were copying
+    atomic_thread_fence(memory_order_acquire);
+    if (seq < atomic_load_explicit(&ix->tail, memory_order_relaxed)) {
+        buf_truncate(b, mark);
+        return false;
+    }
+
+    if (ts)
+        *ts = d.ts;
+
+    return true;
+}
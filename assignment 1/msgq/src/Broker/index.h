@@ -0,0 +1,108 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+/**
+ * In-memory index of recent messages, shared by all shards.
+ *
+ * The index lives in one shared mapping set up before any
+ * shard starts. It is a fixed hash table of topics, and every
+ * topic holds a ring of descriptors for its newest messages
+ * along with their bytes.
+ *
+ * Only the shard that owns a topic writes to its ring; any
+ * shard may read from it. head and tail bound the messages
+ * that can be read. The writer moves tail past the messages it
+ * is about to overwrite before touching them, and a reader
+ * checks tail again after copying, so a torn copy is detected
+ * and treated as a miss. Misses are served from the log by
+ * the owner.
+ */
+
+#include "Broker/stats.h"
+#include "Broker/store.h"
+#include "Utils/buffer.h"
+#include "Utils/hashtable.h"
+#include "Utils/proto.h"
+#include "Utils/utils.h"
+
+#include <stdatomic.h>
+
+#define INDEX_SLOTS 1024        // topics that can be indexed
+#define INDEX_MSGS  512         // newest messages kept per topic
+#define INDEX_BYTES (128 << 10) // bytes of messages kept per topic
+
+// where a message is kept in its topic ring
+struct msg_desc {
+    uint64_t seq;
+    int64_t  ts;
+    uint32_t off; // position in data
+    uint32_t len;
+};
+
+typedef struct TopicIndex {
+    _Atomic uint32_t state; // slot is free, being set up or in use
+    char             name[TOPIC_MAXLEN + 1];
+    _Atomic uint64_t head;  // one past the newest message
+    _Atomic uint64_t tail;  // oldest message that can be read
+    uint32_t         wpos;  // where the bytes of the next message go (writer only)
+    TopicStats       stats;
+    struct msg_desc  desc[INDEX_MSGS];
+    char             data[INDEX_BYTES];
+} TopicIndex;
+
+/**
+ * Maps the index, must be called before the shards start.
+ */
+void index_init();
+
+/**
+ * Adds a topic whose next message will be end (owner only).
+ *
+ * Returns NULL if the table is full, the topic then has to be
+ * served from its log.
+ */
+TopicIndex *index_add(const char *topic, const uint64_t end);
+
+/**
+ * Looks up a topic from any shard, NULL if it is not indexed.
+ */
+TopicIndex *index_find(const char *topic);
+
+/**
+ * Slot i of the table, if it holds a topic.
+ */
+TopicIndex *index_slot(const uint i);
+
+/**
+ * Records a message that was just appended to the log (owner
+ * only). Messages of SENDFILE_MIN_LEN or more are not kept,
+ * they are sent from the log.
+ */
+void index_append(TopicIndex *ix, const uint64_t seq, const void *data, const uint32_t len, const time_t ts);
+
+/**
+ * Forgets messages before start, once they leave the log
+ * (owner only).
+ */
+void index_trim(TopicIndex *ix, const uint64_t start);
+
+/**
+ * One past the newest message, as currently visible.
+ */
+uint64_t index_end(TopicIndex *ix);
+
+/**
+ * Same as log_read(), but from memory.
+ * Returns -1 if the message is not in the ring.
+ */
+ssize_t index_read(TopicIndex *ix, const uint64_t seq, Buffer *b, time_t *ts);
+
+/**
+ * Same as log_readBatch(), but from memory. Stops at the first
+ * message that is not in the ring.
+ *
+ * Returns the number of records appended.
+ */
+uint32_t index_readBatch(TopicIndex *ix, uint64_t seq, const uint32_t max, const size_t maxbytes, Buffer *b);
+
+#endif // INDEX_H
@@ -0,0 +1,126 @@
+#include "registry.h"
+
+#include "Utils/hashtable.h"
+#include "Utils/trie.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define TABLE_SLOTS (2 * REGISTRY_MAX) // never more than half full
+
+static char            *names[REGISTRY_MAX]; // id -> name
+static _Atomic uint32_t count;               // ids below this are in use
+static _Atomic uint32_t table[TABLE_SLOTS];  // id + 1 by hash of the name, 0 if free
+static int              regfd;               // REGISTRY_FILE, appended to
+static bool             sync_on;             // see registry_init()
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // held while registering
+
+static uint32_t publish(const char *topic);
+static int      isTopicDir(const struct dirent *e);
+
+void registry_init(const char *dir, const bool sync) {
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/%s", dir, REGISTRY_FILE);
+    if ((regfd = open(path, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR)) == -1)
+        perror_and_exit("could not open topic registry");
+    sync_on = sync;
+
+    // a line without its newline was torn by a crash, its topic is registered again below
+    FILE *fp = fdopen(dup(regfd), "r");
+    if (fp == NULL)
+        perror_and_exit("could not read topic registry");
+    char   *line = NULL;
+    size_t  cap  = 0;
+    ssize_t n;
+    off_t   good = 0;
+    while ((n = getline(&line, &cap, fp)) > 0 && line[n - 1] == '\n') {
+        good += n;
+        line[n - 1] = '\0';
+        if (n - 1 <= TOPIC_MAXLEN && trie_validName(line, false) && registry_find(line) == TOPIC_NOID &&
+            registry_count() < REGISTRY_MAX)
+            publish(line);
+    }
+    free(line);
+    fclose(fp);
+    if (ftruncate(regfd, good) == -1)
+        perror_and_exit("could not repair topic registry");
+
+    // topics stored before the registry existed
+    struct dirent **found;
+    int             nfound = scandir(dir, &found, isTopicDir, alphasort);
+    if (nfound == -1)
+        perror_and_exit("could not scan message directory");
+    for (int i = 0; i < nfound; i++) {
+        registry_add(found[i]->d_name);
+        free(found[i]);
+    }
+    free(found);
+
+    if (sync && fsync(regfd) == -1)
+        perror_and_exit("could not sync topic registry");
+}
+
+uint32_t registry_add(const char *topic) {
+
+    uint32_t id = registry_find(topic);
+    if (id != TOPIC_NOID)
+        return id;
+
+    // another shard may have registered it while we waited
+    pthread_mutex_lock(&lock);
+    id = registry_find(topic);
+    if (id == TOPIC_NOID && registry_count() < REGISTRY_MAX && strchr(topic, '\n') == NULL) {
+        char   line[TOPIC_MAXLEN + 2];
+        size_t len = snprintf(line, sizeof line, "%s\n", topic);
+        if (len >= sizeof line || write(regfd, line, len) != (ssize_t)len || (sync_on && fdatasync(regfd) == -1))
+            perror("could not register topic");
+        else
+            id = publish(topic);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return id;
+}
+
+uint32_t registry_find(const char *topic) {
+
+    u_long h = ht_polyRollingHash(&topic);
+    for (uint i = 0; i < TABLE_SLOTS; i++) {
+        uint32_t slot = atomic_load_explicit(&table[(h + i) % TABLE_SLOTS], memory_order_acquire);
+        if (slot == 0)
+            break;
+        if (strcmp(names[slot - 1], topic) == 0)
+            return slot - 1;
+    }
+
+    return TOPIC_NOID;
+}
+
+const char *registry_name(const uint32_t id) { return (id < registry_count()) ? names[id] : NULL; }
+
+uint32_t registry_count() { return atomic_load_explicit(&count, memory_order_acquire); }
+
+// gives a topic the next id, with the lock held or before the shards start
+static uint32_t publish(const char *topic) {
+
+    uint32_t id = atomic_load_explicit(&count, memory_order_relaxed);
+    names[id]   = strdup(topic);
+
+    u_long h = ht_polyRollingHash(&topic);
+    for (uint i = 0;; i++) {
+        _Atomic uint32_t *slot = &table[(h + i) % TABLE_SLOTS];
+        if (atomic_load_explicit(slot, memory_order_relaxed) == 0) {
+            atomic_store_explicit(slot, id + 1, memory_order_release);
+            break;
+        }
+    }
+    atomic_store_explicit(&count, id + 1, memory_order_release);
+
+    return id;
+}
+
+static int isTopicDir(const struct dirent *e) {
+    return (e->d_type == DT_DIR || e->d_type == DT_UNKNOWN) && trie_validName(e->d_name, false);
+}
@@ -0,0 +1,60 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+/**
+ * Topic registry, shared by all shards: gives every topic of
+ * the broker a compact id that requests may use in place of
+ * its name (see FLAG_ID in proto.h).
+ *
+ * Ids are handed out densely from 0, in the order topics are
+ * registered, and are never taken back or reused. Every name
+ * registered is appended to REGISTRY_FILE in the message
+ * directory, so a broker restarted on the same directory hands
+ * out the same ids again; topics found in the directory but
+ * missing from the file are registered after the others.
+ *
+ * Names are kept in an array indexed by id and found by name
+ * through an open addressing table of ids. Both are only ever
+ * added to, and an entry is filled in before the count or the
+ * table slot that makes it visible, so lookups take no lock.
+ * Registering a topic takes one, as it writes to the file.
+ */
+
+#include "Utils/proto.h"
+#include "Utils/utils.h"
+
+#define REGISTRY_MAX  (1 << 16)   // topics that can be registered
+#define REGISTRY_FILE ".registry" // in the message directory, never a valid topic name
+
+/**
+ * Loads the registry of the message directory dir, registering
+ * the topics it holds that are not in it yet. With sync set,
+ * every name is on disk before its id is handed out.
+ */
+void registry_init(const char *dir, const bool sync);
+
+/**
+ * Id of a topic, registering it if it is not yet.
+ *
+ * Returns TOPIC_NOID if the registry is full or could not be
+ * written; the topic then only goes by its name.
+ */
+uint32_t registry_add(const char *topic);
+
+/**
+ * Id of a topic, TOPIC_NOID if it is not registered.
+ */
+uint32_t registry_find(const char *topic);
+
+/**
+ * Name of the topic with an id, NULL if there is none. The
+ * name stays valid for the life of the broker.
+ */
+const char *registry_name(const uint32_t id);
+
+/**
+ * Number of topics registered, one past the highest id.
+ */
+uint32_t registry_count();
+
+#endif // REGISTRY_H
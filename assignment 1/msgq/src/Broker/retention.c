@@ -0,0 +1,62 @@
+#include "retention.h"
+
+static Retention  defaults = {.age = RETAIN_AGE, .bytes = RETAIN_BYTES, .highwater = RETAIN_BEHIND};
+static Hashtable *overrides; // topic name -> Retention *
+
+static bool parseField(const char *s, const char *end, long long *val);
+
+void retention_setDefault(const Retention *r) { defaults = *r; }
+
+bool retention_parse(const char *spec) {
+
+    const char *sep1 = strchr(spec, ':');
+    if (sep1 == NULL || sep1 == spec || sep1 - spec > NAME_MAX)
+        return false;
+    const char *sep2 = strchr(sep1 + 1, ':');
+    const char *sep3 = sep2 ? strchr(sep2 + 1, ':') : NULL;
+    const char *end  = spec + strlen(spec);
+
+    long long age       = defaults.age;
+    long long bytes     = defaults.bytes;
+    long long highwater = defaults.highwater;
+    if (!parseField(sep1 + 1, sep2 ? sep2 : end, &age) || (sep2 && !parseField(sep2 + 1, sep3 ? sep3 : end, &bytes)) ||
+        (sep3 && !parseField(sep3 + 1, end, &highwater)))
+        return false;
+
+    char topic[NAME_MAX + 1];
+    snprintf(topic, sizeof topic, "%.*s", (int)(sep1 - spec), spec);
+    const char *key = topic;
+
+    if (overrides == NULL)
+        overrides = ht_init_str_void();
+
+    Retention *r = ht_lookupVal(overrides, &key);
+    if (r == NULL) {
+        r = malloc(sizeof *r);
+        ht_insert(&overrides, &key, &r);
+    }
+    *r = (Retention){.age = age, .bytes = bytes, .highwater = highwater};
+
+    return true;
+}
+
+const Retention *retention_get(const char *topic) {
+
+    Retention *r = (overrides == NULL) ? NULL : ht_lookupVal(overrides, &topic);
+    return (r != NULL) ? r : &defaults;
+}
+
+// an empty field leaves val as it is
+static bool parseField(const char *s, const char *end, long long *val) {
+
+    if (s == end)
+        return true;
+
+    char     *p;
+    long long v = strtoll(s, &p, 10);
+    if (p != end || v < 0)
+        return false;
+
+    *val = v;
+    return true;
+}
@@ -0,0 +1,56 @@
+#ifndef RETENTION_H
+#define RETENTION_H
+
+/**
+ * Retention limits for topic logs.
+ *
+ * Messages are kept for a while after they are published and
+ * a topic's log may only take up so many bytes. Both limits
+ * have broker wide defaults that can be overridden per topic.
+ * Limits are applied a segment at a time: a segment goes once
+ * its newest record is past the age limit, or while the log is
+ * over its byte limit (oldest first, never the active segment).
+ *
+ * The high-water mark bounds how far the slowest subscriber or
+ * group member of a topic may fall behind, in bytes of the log.
+ * Past it, publishes to the topic are stored but not acked
+ * until the readers catch up, which stalls publishers that
+ * wait for their acks.
+ *
+ * Limits are set up in main before the shards start and only
+ * read afterwards.
+ */
+
+#include "Utils/hashtable.h"
+#include "Utils/utils.h"
+
+#define RETAIN_AGE    60 // default seconds a message is kept for
+#define RETAIN_BYTES  0  // default bytes per topic, 0 for no limit
+#define RETAIN_BEHIND 0  // default high-water mark, 0 for none
+#define RETAIN_PERIOD 1  // seconds between retention passes
+
+typedef struct Retention {
+    time_t age;       // seconds, 0 for no limit
+    off_t  bytes;     // bytes of .log files, 0 for no limit
+    off_t  highwater; // bytes of the log readers may be behind by, 0 for no limit
+} Retention;
+
+/**
+ * Sets the limits of topics without their own.
+ */
+void retention_setDefault(const Retention *r);
+
+/**
+ * Parses a "<topic>:<age>[:<bytes>[:<high water>]]" override and records it.
+ * Empty fields keep the default.
+ *
+ * Returns false if spec is malformed.
+ */
+bool retention_parse(const char *spec);
+
+/**
+ * Limits that apply to a topic.
+ */
+const Retention *retention_get(const char *topic);
+
+#endif // RETENTION_H
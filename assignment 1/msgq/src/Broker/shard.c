@@ -0,0 +1,1164 @@
+#include "broker.h"
+
+#include <poll.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+
+#define URING_OUT 1 // tags the user data of a POLLOUT request, Conn pointers are aligned
+
+static Shard *shards;
+static int    nshards;
+static bool   use_uring;
+static long   spin_us; // SHM_SPIN_US, or none on a single core
+static int    unixfd[2] = {-1, -1}; // publisher and subscriber unix listeners, shared by every shard
+
+static void  *shard_main(void *arg);
+static void   shard_init(Shard *sh);
+static Conn  *setupListener(Shard *sh, const in_addr_t addr, const int port, const enum conn_type type);
+static int    setupUnix(const char *path, const bool sub);
+static bool   isStale(const struct sockaddr_un *addr);
+static Conn  *addListener(Shard *sh, const int fd, const enum conn_type type);
+static void   addConn(Shard *sh, Conn *c);
+static void   acceptConns(Shard *sh, Conn *lc);
+static void   waitEpoll(Shard *sh, const int timeout);
+static void   waitUring(Shard *sh, const int timeout);
+static void   handleConn(Shard *sh, Conn *c, const uint32_t events);
+static void   completeConn(Shard *sh, Conn *c, const bool out, const int res);
+static bool   readConn(Shard *sh, Conn *c);
+static void   updateEvents(Shard *sh, Conn *c);
+static void   armUring(Shard *sh, Conn *c);
+static bool   queueFile(Conn *c, const char *hdrs, const size_t n, const int fd, off_t off, size_t len, size_t piece);
+static bool   copyFile(Conn *c, const char *hdrs, const size_t n, const int fd, off_t off, size_t len, size_t piece);
+static bool   sendOut(Conn *c);
+static size_t pending(const Conn *c);
+static bool   backedUp(const Conn *c);
+static void   closeConn(Shard *sh, Conn *c);
+static void   freeConn(Conn *c);
+static void   chargeFlow(const ConnRef *to, const int64_t len);
+static void   releasePushes(Shard *sh, Conn *c);
+static void   dropFlow(Flow *flow);
+static void   drainInbox(Shard *sh);
+static bool   pushBacklog(Shard *sh);
+static void   wakeShards(Shard *sh);
+static void   deliver(Shard *sh, Conn *c, Job *reply);
+static void   flushDirty(Shard *sh);
+static bool   isLocal(const int fd);
+static void   checkShm(Shard *sh, Conn *c);
+static bool   readShm(Shard *sh, Conn *c);
+static bool   sendShm(Conn *c);
+static bool   pollShm(Shard *sh);
+static bool   idleShm(Shard *sh);
+
+void shard_runAll(const int n, const bool uring, const char *unixpath) {
+
+    nshards   = n;
+    shards    = calloc(n, sizeof *shards);
+    use_uring = uring;
+    spin_us   = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SHM_SPIN_US : 0;
+
+    if (unixpath != NULL) {
+        unixfd[0] = setupUnix(unixpath, false);
+        unixfd[1] = setupUnix(unixpath, true);
+    }
+
+    // set up everything before any thread starts sending jobs
+    for (int i = 0; i < n; i++) {
+        shards[i].id = i;
+        shard_init(&shards[i]);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if ((errno = pthread_create(&shards[i].tid, NULL, shard_main, &shards[i])) != 0)
+            perror_and_exit("could not start shard");
+    }
+
+    for (int i = 0; i < n; i++)
+        pthread_join(shards[i].tid, NULL);
+}
+
+int shard_count() { return nshards; }
+
+int shard_owner(const char *topic) { return (nshards == 1) ? 0 : ht_polyRollingHash(&topic) % nshards; }
+
+Job *job_new(const enum job_type type, const Shard *sh, const Conn *c, const void *data, const size_t len) {
+
+    Job *job = malloc(sizeof *job + len);
+
+    *job = (Job){
+        .type = type,
+        .conn = {.shard = sh->id,
+                 .fd    = (c == NULL) ? -1 : c->fd,
+                 .id    = (c == NULL) ? 0 : c->id,
+                 .flow  = (c == NULL) ? NULL : c->flow},
+        .fd   = -1,
+        .len  = len,
+    };
+    memcpy(job->data, data, len);
+
+    return job;
+}
+
+void job_free(Job *job) {
+    if (job->fd != -1)
+        close(job->fd);
+    free(job);
+}
+
+void shard_send(Shard *sh, const int dst, Job *job) {
+
+    // keep per-pair ordering: never overtake jobs already waiting
+    if ((buf_len(sh->backlog[dst]) > 0 || !ring_push(shards[dst].inbox[sh->id], job)) &&
+        !buf_append(sh->backlog[dst], &job, sizeof job))
+        perror_and_exit("could not queue job");
+
+    sh->wake[dst] = true;
+}
+
+void shard_reply(Shard *sh, const Job *job, const void *data, const size_t len) {
+
+    Conn *c = (job->conn.shard == sh->id) ? shard_conn(sh, &job->conn) : NULL;
+
+    // common case, a local reply that is next in line
+    if (c != NULL && job->reqno == c->nextout && (c->held == NULL || vec_isEmpty(c->held))) {
+        if (!buf_append(c->out, data, len))
+            perror_and_exit("could not queue reply");
+        c->nextout++;
+        return;
+    }
+
+    if (job->conn.shard == sh->id && c == NULL)
+        return; // connection has gone away
+
+    Job *reply   = job_new(JOB_REPLY, sh, NULL, data, len);
+    reply->conn  = job->conn;
+    reply->reqno = job->reqno;
+
+    if (c != NULL)
+        deliver(sh, c, reply);
+    else
+        shard_send(sh, job->conn.shard, reply);
+}
+
+bool shard_push(Shard *sh, const ConnRef *to, const void *data, const size_t len) {
+
+    if (to->shard != sh->id) {
+        Job *job  = job_new(JOB_PUSH, sh, NULL, data, len);
+        job->conn = *to;
+        chargeFlow(to, len);
+        shard_send(sh, to->shard, job);
+        return true;
+    }
+
+    Conn *c = shard_conn(sh, to);
+    if (c == NULL)
+        return false;
+
+    // the caller may be in the middle of handling this very connection,
+    // so it is written out at the end of the loop iteration
+    if (!buf_append(c->out, data, len) || !buf_append(sh->dirty, to, sizeof *to))
+        perror_and_exit("could not queue push");
+    c->pushed += len;
+    chargeFlow(to, len);
+
+    return true;
+}
+
+bool shard_canPush(Shard *sh, const ConnRef *to) {
+
+    Flow *flow = to->flow;
+    if (flow == NULL || atomic_load(&flow->queued) < PUSH_WINDOW)
+        return true;
+
+    // the shard of the connection looks at the waiting shards after taking off what it sent
+    atomic_fetch_or(&flow->waiting, 1ULL << sh->id);
+
+    return atomic_load(&flow->queued) < PUSH_WINDOW;
+}
+
+bool shard_replyFile(Shard *sh, const Job *job, const void *hdr, const size_t n, const int fd, const off_t off,
+                     const size_t len) {
+
+    Conn *c = (job->conn.shard == sh->id) ? shard_conn(sh, &job->conn) : NULL;
+    if (c == NULL || job->reqno != c->nextout || (c->held != NULL && !vec_isEmpty(c->held)))
+        return false;
+
+    if (!queueFile(c, hdr, n, fd, off, len, len))
+        return false;
+    c->nextout++;
+
+    return true;
+}
+
+bool shard_pushFile(Shard *sh, const ConnRef *to, const void *hdr, const size_t n, const int fd, const off_t off,
+                    const size_t len, const size_t piece) {
+
+    // the shard of the connection queues its own duplicate, this one is closed with the job
+    if (to->shard != sh->id) {
+        int dfd = dup(fd);
+        if (dfd == -1) {
+            perror("could not duplicate log fd");
+            return false;
+        }
+        Job *job  = job_new(JOB_PUSH, sh, NULL, hdr, n);
+        job->conn = *to;
+        job->fd   = dfd;
+        job->off   = off;
+        job->flen  = len;
+        job->piece = piece;
+        chargeFlow(to, n + len);
+        shard_send(sh, to->shard, job);
+        return true;
+    }
+
+    Conn *c = shard_conn(sh, to);
+    if (c == NULL || !queueFile(c, hdr, n, fd, off, len, piece))
+        return false;
+    c->pushed += n + len;
+    chargeFlow(to, n + len);
+
+    if (!buf_append(sh->dirty, to, sizeof *to))
+        perror_and_exit("could not queue push");
+
+    return true;
+}
+
+Conn *shard_conn(const Shard *sh, const ConnRef *ref) {
+
+    if (ref->fd < 0 || (uint)ref->fd >= sh->nconns)
+        return NULL;
+
+    Conn *c = sh->conns[ref->fd];
+    return (c != NULL && c->id == ref->id) ? c : NULL;
+}
+
+const char *shard_offerShm(Shard *sh, Conn *c) {
+
+    // nothing may be on its way over the socket once the client moves
+    if (c->shm != NULL || c->nextreq != 1 || c->streaming || !isLocal(c->fd))
+        return NULL;
+
+    if ((c->shm = shm_create()) == NULL) {
+        perror("could not create shared-memory channel");
+        return NULL;
+    }
+
+    return c->shm->name;
+}
+
+bool shard_flush(Shard *sh, Conn *c) {
+
+    // a stats client is done once it has its report
+    if (!sendOut(c) || (c->type == CONN_STATS && pending(c) == 0)) {
+        closeConn(sh, c);
+        return false;
+    }
+
+    releasePushes(sh, c);
+    updateEvents(sh, c);
+
+    return true;
+}
+
+static void shard_init(Shard *sh) {
+
+    if (use_uring && (sh->uring = uring_init(URING_ENTRIES)) == NULL && sh->id == 0)
+        perror("io_uring unavailable, using epoll");
+
+    if (sh->uring == NULL && (sh->epfd = epoll_create1(0)) == -1)
+        perror_and_exit("could not create epoll instance");
+
+    sh->nconns = 1024;
+    sh->conns  = calloc(sh->nconns, sizeof(Conn *));
+
+    for (int i = 0; i < nshards; i++) {
+        sh->inbox[i]   = ring_init(JOB_RING_SIZE);
+        sh->backlog[i] = buf_init(BUF_START_SIZE);
+    }
+    sh->dirty = buf_init(BUF_START_SIZE);
+
+    int evfd = eventfd(0, EFD_NONBLOCK);
+    if (evfd == -1)
+        perror_and_exit("could not create eventfd");
+    sh->jobconn  = calloc(1, sizeof(Conn));
+    *sh->jobconn = (Conn){.fd = evfd, .type = CONN_JOBS};
+    addConn(sh, sh->jobconn);
+
+    // every shard gets its own listeners, the kernel balances between them
+    sh->pubconn = setupListener(sh, INADDR_ANY, fed_self()->pubport, CONN_PUB_LISTEN);
+    sh->subconn = setupListener(sh, INADDR_ANY, fed_self()->subport, CONN_SUB_LISTEN);
+
+    // SO_REUSEPORT does not balance unix sockets, so those are shared and taken by whichever shard is awake
+    if (unixfd[0] != -1) {
+        sh->upubconn = addListener(sh, unixfd[0], CONN_PUB_LISTEN);
+        sh->usubconn = addListener(sh, unixfd[1], CONN_SUB_LISTEN);
+    }
+
+    // reports are cheap, one shard serves them to local clients
+    if (sh->id == 0)
+        sh->statsconn = setupListener(sh, INADDR_LOOPBACK, fed_self()->statsport, CONN_STATS_LISTEN);
+}
+
+static void *shard_main(void *arg) {
+
+    Shard *sh = arg;
+
+    // one shard per core
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(sh->id % ncpu, &set);
+        if ((errno = pthread_setaffinity_np(pthread_self(), sizeof set, &set)) != 0)
+            perror("could not pin shard");
+    }
+
+    struct timespec now, last;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    int wait = -1;
+    for (;;) {
+
+        // jobs that did not fit an inbox are retried every time round, and soon if some are left
+        bool moved   = pushBacklog(sh);
+        int  timeout = (wait == 0) ? 0 : moved ? SHARD_TICK_MS : 1;
+        if (wait > 0 && wait < timeout)
+            timeout = wait;
+
+        // clients on shared memory get a moment to send more before the shard goes to sleep
+        if (timeout != 0 && sh->shmconns != NULL && !vec_isEmpty(sh->shmconns) && !idleShm(sh))
+            timeout = 0;
+
+        if (sh->uring != NULL)
+            waitUring(sh, timeout);
+        else
+            waitEpoll(sh, timeout);
+
+        wait = broker_work(sh);
+        flushDirty(sh);
+        wakeShards(sh);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - last.tv_sec) * 1000 + (now.tv_nsec - last.tv_nsec) / 1000000 >= SHARD_TICK_MS) {
+            broker_tick(sh);
+            last = now;
+        }
+    }
+
+    return NULL;
+}
+
+static void waitEpoll(Shard *sh, const int timeout) {
+
+    struct epoll_event events[MAX_EVENTS];
+
+    int n = epoll_wait(sh->epfd, events, MAX_EVENTS, timeout);
+    if (n == -1) {
+        if (errno == EINTR)
+            return;
+        else
+            perror_and_exit("epoll_wait error");
+    }
+
+    for (int i = 0; i < n; i++) {
+        Conn *c = events[i].data.ptr;
+        switch (c->type) {
+        case CONN_PUB_LISTEN:
+        case CONN_SUB_LISTEN:
+        case CONN_STATS_LISTEN:
+            acceptConns(sh, c);
+            break;
+        case CONN_JOBS:
+            drainInbox(sh);
+            break;
+        default:
+            handleConn(sh, c, events[i].events);
+            break;
+        }
+    }
+}
+
+// submits the requests queued since the last call and handles every completion
+static void waitUring(Shard *sh, const int timeout) {
+
+    if (!uring_wait(sh->uring, timeout))
+        perror_and_exit("io_uring_enter error");
+
+    uint64_t data;
+    int      res;
+    while (uring_reap(sh->uring, &data, &res)) {
+        Conn *c   = (Conn *)(uintptr_t)(data & ~(uint64_t)URING_OUT);
+        bool  out = data & URING_OUT;
+        c->events &= out ? ~EPOLLOUT : ~EPOLLIN;
+
+        if (c->closed) {
+            if (c->events == 0)
+                freeConn(c);
+            continue;
+        }
+
+        switch (c->type) {
+        case CONN_PUB_LISTEN:
+        case CONN_SUB_LISTEN:
+        case CONN_STATS_LISTEN:
+            acceptConns(sh, c);
+            updateEvents(sh, c);
+            break;
+        case CONN_JOBS:
+            drainInbox(sh);
+            updateEvents(sh, c);
+            break;
+        default:
+            completeConn(sh, c, out, res);
+            break;
+        }
+    }
+}
+
+static Conn *setupListener(Shard *sh, const in_addr_t addr, const int port, const enum conn_type type) {
+
+    // setup socket
+    int fd;
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+        perror_and_exit("could not create socket");
+
+    const int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) == -1)
+        perror_and_exit("setsockopt error");
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) == -1)
+        perror_and_exit("setsockopt error");
+
+    // setup address structure
+    struct sockaddr_in servaddr = {
+        .sin_family      = AF_INET,
+        .sin_addr.s_addr = htonl(addr),
+        .sin_port        = htons(port),
+    };
+
+    // bind and listen
+    if (bind(fd, (struct sockaddr *)&servaddr, sizeof servaddr) == -1)
+        perror_and_exit("bind error");
+    if (listen(fd, LISTENQ) == -1)
+        perror_and_exit("listen error");
+
+    return addListener(sh, fd, type);
+}
+
+// access is left to the permissions of the socket file, which follow the umask
+static int setupUnix(const char *path, const bool sub) {
+
+    struct sockaddr_un addr;
+    if (!proto_unixAddr(path, sub, &addr)) {
+        errno = ENAMETOOLONG;
+        perror_and_exit("bad socket path");
+    }
+
+    int fd;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+        perror_and_exit("could not create socket");
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr) == -1 &&
+        (errno != EADDRINUSE || !isStale(&addr) || unlink(addr.sun_path) == -1 ||
+         bind(fd, (struct sockaddr *)&addr, sizeof addr) == -1))
+        perror_and_exit("bind error");
+    if (listen(fd, LISTENQ) == -1)
+        perror_and_exit("listen error");
+
+    return fd;
+}
+
+// a socket file nobody listens on is left over from a broker that did not exit cleanly
+static bool isStale(const struct sockaddr_un *addr) {
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return false;
+
+    bool stale = connect(fd, (const struct sockaddr *)addr, sizeof *addr) == -1 && errno == ECONNREFUSED;
+    close(fd);
+    errno = EADDRINUSE;
+
+    return stale;
+}
+
+static Conn *addListener(Shard *sh, const int fd, const enum conn_type type) {
+
+    Conn *lc = calloc(1, sizeof *lc);
+    lc->fd   = fd;
+    lc->type = type;
+    addConn(sh, lc);
+
+    return lc;
+}
+
+static void addConn(Shard *sh, Conn *c) {
+
+    // grow the fd table if required
+    if ((uint)c->fd >= sh->nconns) {
+        uint n = sh->nconns;
+        while (n <= (uint)c->fd)
+            n *= 2;
+        sh->conns = realloc(sh->conns, n * sizeof(Conn *));
+        memset(sh->conns + sh->nconns, 0, (n - sh->nconns) * sizeof(Conn *));
+        sh->nconns = n;
+    }
+
+    c->id            = sh->nextid++;
+    sh->conns[c->fd] = c;
+    updateEvents(sh, c);
+}
+
+static void acceptConns(Shard *sh, Conn *lc) {
+
+    for (;;) {
+        int fd = accept4(lc->fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept error");
+            return;
+        }
+
+        Conn *c = malloc(sizeof *c);
+        *c      = (Conn){
+            .fd   = fd,
+            .type = (lc->type == CONN_PUB_LISTEN) ? CONN_PUB : (lc->type == CONN_SUB_LISTEN) ? CONN_SUB : CONN_STATS,
+            .in   = buf_init(BUF_START_SIZE),
+            .out  = buf_init(BUF_START_SIZE),
+        };
+        if (c->type != CONN_STATS)
+            c->flow = calloc(1, sizeof *c->flow);
+        addConn(sh, c);
+
+        if (c->type == CONN_STATS) {
+            stats_report(c->out);
+            shard_flush(sh, c);
+            continue;
+        }
+
+        stats_add((c->type == CONN_PUB) ? &stats_shard(sh->id)->pubconns : &stats_shard(sh->id)->subconns, 1);
+        LOG(LOG_INFO, "Connected to %s\n", (c->type == CONN_PUB) ? "Publisher" : "Subscriber");
+    }
+}
+
+static void handleConn(Shard *sh, Conn *c, const uint32_t events) {
+
+    // flush pending replies first, this may let us read again
+    if (events & EPOLLOUT) {
+        if (!sendOut(c)) {
+            closeConn(sh, c);
+            return;
+        }
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        checkShm(sh, c);
+        ssize_t n = c->shmlive ? read(c->fd, c->bell, sizeof c->bell) : buf_readFd(c->in, c->fd);
+        if (n == 0 || (n == -1 && errno != EAGAIN)) {
+            closeConn(sh, c);
+            return;
+        }
+
+        if (!(c->shmlive ? readShm(sh, c) : readConn(sh, c))) {
+            closeConn(sh, c);
+            return;
+        }
+    }
+
+    // try to send replies straight away, epoll picks up the rest
+    shard_flush(sh, c);
+}
+
+// a receive has landed in c->in (res is its return value), or c can be written to
+static void completeConn(Shard *sh, Conn *c, const bool out, const int res) {
+
+    if (!out) {
+        if (res == 0 || (res < 0 && res != -EAGAIN && res != -EINTR)) {
+            closeConn(sh, c);
+            return;
+        }
+
+        // a doorbell is dropped, even the one that landed in c->in as the client moved
+        checkShm(sh, c);
+        if (!c->shmlive)
+            c->in->end += (res > 0) ? res : 0;
+        if (!(c->shmlive ? readShm(sh, c) : readConn(sh, c))) {
+            closeConn(sh, c);
+            return;
+        }
+    }
+
+    // sends what is queued and asks for whatever is needed next
+    shard_flush(sh, c);
+}
+
+// hands new bytes to the broker, stats clients have nothing to say
+static bool readConn(Shard *sh, Conn *c) {
+
+    if (c->type != CONN_STATS)
+        return broker_read(sh, c);
+
+    buf_consume(c->in, buf_len(c->in));
+    return true;
+}
+
+// reading is paused while a client has too many replies queued or outstanding
+static void updateEvents(Shard *sh, Conn *c) {
+
+    if (sh->uring != NULL) {
+        armUring(sh, c);
+        return;
+    }
+
+    // a client on shared memory is always listened to for doorbells and never written to
+    uint32_t events = EPOLLIN;
+    if (pending(c) > 0 && !c->shmlive)
+        events |= EPOLLOUT;
+    if (backedUp(c) && !c->shmlive)
+        events &= ~EPOLLIN;
+
+    if (events == c->events)
+        return;
+
+    // a client paused with nothing to send is taken off epoll until its replies come in
+    struct epoll_event ev = {.events = events, .data.ptr = c};
+    int                op = (c->events == 0) ? EPOLL_CTL_ADD : (events == 0) ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    if (epoll_ctl(sh->epfd, op, c->fd, &ev) == -1)
+        perror_and_exit("epoll_ctl error");
+
+    c->events = events;
+}
+
+// updateEvents() for io_uring, requests already in flight cannot be taken back
+static void armUring(Shard *sh, Conn *c) {
+
+    uint32_t want = EPOLLIN;
+    if (pending(c) > 0 && !c->shmlive)
+        want |= EPOLLOUT;
+    if (backedUp(c) && !c->shmlive)
+        want &= ~EPOLLIN;
+    want &= ~c->events;
+
+    // clients are read straight into their buffer, listeners and the eventfd are polled
+    bool ok = true;
+    if (want & EPOLLIN) {
+        if (c->shmlive)
+            ok = uring_recv(sh->uring, c->fd, c->bell, sizeof c->bell, (uintptr_t)c);
+        else if (c->in != NULL)
+            ok = buf_reserve(c->in, BUF_START_SIZE) &&
+                 uring_recv(sh->uring, c->fd, c->in->data + c->in->end, c->in->cap - c->in->end, (uintptr_t)c);
+        else
+            ok = uring_poll(sh->uring, c->fd, POLLIN, (uintptr_t)c);
+        c->events |= EPOLLIN;
+    }
+    if (ok && (want & EPOLLOUT)) {
+        ok = uring_poll(sh->uring, c->fd, POLLOUT, (uintptr_t)c | URING_OUT);
+        c->events |= EPOLLOUT;
+    }
+
+    if (!ok)
+        perror_and_exit("could not queue io_uring request");
+}
+
+static void closeConn(Shard *sh, Conn *c) {
+
+    if (c->type != CONN_STATS) {
+        stats_add((c->type == CONN_PUB) ? &stats_shard(sh->id)->pubconns : &stats_shard(sh->id)->subconns, -1);
+        LOG(LOG_INFO, "Disconnected from %s\n", (c->type == CONN_PUB) ? "Publisher" : "Subscriber");
+    }
+
+    // subscriptions live with their topics, tell every shard; the last one to drop them frees the flow
+    if (c->streaming) {
+        atomic_store(&c->flow->refs, nshards);
+        for (int i = 0; i < nshards; i++) {
+            Job *job = job_new(JOB_CLOSED, sh, c, "", 0);
+            if (i != sh->id) {
+                shard_send(sh, i, job);
+                continue;
+            }
+            broker_job(sh, job);
+            dropFlow(c->flow);
+        }
+        c->flow = NULL;
+    }
+
+    sh->conns[c->fd] = NULL;
+    for (uint i = 0; c->shmlive && i < sh->shmconns->size; i++) {
+        if (vec_getValAt(sh->shmconns, i) == c) {
+            vec_removeAt(sh->shmconns, i);
+            break;
+        }
+    }
+
+    // requests on the ring still point at c, shutting down makes them complete
+    if (sh->uring != NULL && c->events != 0) {
+        shutdown(c->fd, SHUT_RDWR);
+        close(c->fd);
+        c->closed = true;
+        return;
+    }
+
+    close(c->fd); // also removes it from the epoll set
+    freeConn(c);
+}
+
+static void freeConn(Conn *c) {
+    buf_free(c->in);
+    buf_free(c->out);
+    if (c->files != NULL) {
+        for (size_t i = 0; i < buf_len(c->files); i += sizeof(struct file_chunk)) {
+            struct file_chunk *fc = (void *)(buf_peek(c->files) + i);
+            if (!fc->shared)
+                close(fc->fd);
+        }
+        buf_free(c->files);
+    }
+    if (c->held != NULL) {
+        for (uint i = 0; i < c->held->size; i++)
+            free(vec_getValAt(c->held, i));
+        vec_free(c->held);
+    }
+    if (c->spool != NULL) {
+        if (c->spool->fd != -1)
+            close(c->spool->fd);
+        free(c->spool);
+    }
+    if (c->shm != NULL) {
+        if (!c->shmlive)
+            shm_unlink(c->shm->name);
+        shm_free(c->shm);
+    }
+    free(c->flow);
+    free(c);
+}
+
+// counts bytes pushed to a connection against its window
+static void chargeFlow(const ConnRef *to, const int64_t len) {
+    if (to->flow != NULL)
+        atomic_fetch_add(&to->flow->queued, len);
+}
+
+// takes what has been sent off the window, and once half of it is free tells the shards waiting on it
+static void releasePushes(Shard *sh, Conn *c) {
+
+    if (c->flow == NULL || c->pushed == 0)
+        return;
+
+    // pushes are taken to be the last bytes in line, so none is let go before it has been sent
+    size_t left = pending(c);
+    if (left >= c->pushed)
+        return;
+    int64_t sent = c->pushed - left;
+    c->pushed    = left;
+
+    if (atomic_fetch_sub(&c->flow->queued, sent) - sent >= PUSH_WINDOW / 2 || atomic_load(&c->flow->waiting) == 0)
+        return;
+
+    // through the inbox even for this shard, which may be pushing right now
+    uint64_t waiting = atomic_exchange(&c->flow->waiting, 0);
+    for (int i = 0; i < nshards; i++) {
+        if (waiting & (1ULL << i))
+            shard_send(sh, i, job_new(JOB_ROOM, sh, NULL, "", 0));
+    }
+}
+
+static void dropFlow(Flow *flow) {
+    if (atomic_fetch_sub(&flow->refs, 1) == 1)
+        free(flow);
+}
+
+// queues len bytes of fd in pieces, each after its own header, the n bytes of hdrs being one header per piece
+static bool queueFile(Conn *c, const char *hdrs, const size_t n, const int fd, off_t off, size_t len, size_t piece) {
+
+    // the segment may be deleted before the bytes go out, one duplicate does for all the pieces
+    int dfd = dup(fd);
+    if (dfd == -1) {
+        perror("could not duplicate log fd, copying instead");
+        return copyFile(c, hdrs, n, fd, off, len, piece);
+    }
+
+    if (c->files == NULL)
+        c->files = buf_init(BUF_START_SIZE);
+
+    if (piece == 0 || piece > len)
+        piece = len;
+    size_t count  = (len > 0) ? (len + piece - 1) / piece : 1;
+    size_t hdrlen = n / count;
+    for (size_t i = 0; i < count; i++) {
+        size_t take = (len < piece) ? len : piece;
+        if (!buf_append(c->out, hdrs + i * hdrlen, hdrlen))
+            perror_and_exit("could not queue reply");
+
+        struct file_chunk fc = {
+            .fd     = dfd,
+            .off    = off,
+            .len    = take,
+            .gap    = buf_len(c->out) - c->filed,
+            .shared = i + 1 < count,
+        };
+        if (!buf_append(c->files, &fc, sizeof fc))
+            perror_and_exit("could not queue reply");
+        c->filed = buf_len(c->out);
+        off += take;
+        len -= take;
+    }
+
+    return true;
+}
+
+// queueFile() for when no duplicate of fd can be had: the pieces are read into out now, false if they cannot be
+static bool copyFile(Conn *c, const char *hdrs, const size_t n, const int fd, off_t off, size_t len, size_t piece) {
+
+    if (piece == 0 || piece > len)
+        piece = len;
+    size_t count  = (len > 0) ? (len + piece - 1) / piece : 1;
+    size_t hdrlen = n / count;
+    size_t start  = buf_len(c->out);
+    for (size_t i = 0; i < count; i++) {
+        size_t take = (len < piece) ? len : piece;
+        if (!buf_append(c->out, hdrs + i * hdrlen, hdrlen) || !buf_reserve(c->out, take))
+            perror_and_exit("could not queue reply");
+
+        if (pread(fd, c->out->data + c->out->end, take, off) != (ssize_t)take) {
+            perror("could not read message");
+            buf_truncate(c->out, start);
+            return false;
+        }
+        c->out->end += take;
+        off += take;
+        len -= take;
+    }
+
+    return true;
+}
+
+// writes out queued bytes and file chunks in order, false on error
+static bool sendOut(Conn *c) {
+
+    if (c->shmlive)
+        return sendShm(c);
+
+    for (;;) {
+        struct file_chunk *fc   = (c->files != NULL && buf_len(c->files) > 0) ? (void *)buf_peek(c->files) : NULL;
+        size_t             want = (fc != NULL) ? fc->gap : buf_len(c->out);
+
+        while (want > 0) {
+            ssize_t n = write(c->fd, buf_peek(c->out), want);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                return errno == EAGAIN;
+            }
+            buf_consume(c->out, n);
+            want -= n;
+            if (fc != NULL) {
+                fc->gap -= n;
+                c->filed -= n;
+            }
+        }
+
+        if (fc == NULL)
+            return true;
+
+        while (fc->len > 0) {
+            ssize_t n = sendfile(c->fd, fc->fd, &fc->off, fc->len);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1)
+                return errno == EAGAIN;
+            if (n == 0) {
+                errno = EIO; // file shrank underneath us, the frame can no longer be completed
+                return false;
+            }
+            fc->len -= n;
+        }
+
+        if (!fc->shared)
+            close(fc->fd);
+        buf_consume(c->files, sizeof *fc);
+    }
+}
+
+static size_t pending(const Conn *c) {
+
+    if (c->out == NULL)
+        return 0;
+
+    size_t n = buf_len(c->out);
+    for (size_t i = 0; c->files != NULL && i < buf_len(c->files); i += sizeof(struct file_chunk))
+        n += ((struct file_chunk *)(buf_peek(c->files) + i))->len;
+
+    return n;
+}
+
+// a client that does not take its replies, or whose replies are held back, is not read from
+static bool backedUp(const Conn *c) { return pending(c) >= OUT_HIGHWATER || c->nextreq - c->nextout >= REQ_HIGHWATER; }
+
+static void drainInbox(Shard *sh) {
+
+    uint64_t cnt;
+    if (read(sh->jobconn->fd, &cnt, sizeof cnt) == -1 && errno != EAGAIN)
+        perror("could not read eventfd");
+
+    for (int i = 0; i < nshards; i++) {
+        Job *job;
+        while ((job = ring_pop(sh->inbox[i])) != NULL) {
+            if (job->type == JOB_REQUEST || job->type == JOB_ROOM) {
+                broker_job(sh, job);
+                continue;
+            }
+            if (job->type == JOB_CLOSED) {
+                Flow *flow = job->conn.flow;
+                broker_job(sh, job);
+                dropFlow(flow);
+                continue;
+            }
+
+            Conn *c = shard_conn(sh, &job->conn);
+            if (c == NULL) {
+                job_free(job);
+                continue;
+            }
+
+            if (job->type == JOB_REPLY) {
+                deliver(sh, c, job);
+            } else if (job->fd == -1) {
+                if (!buf_append(c->out, job->data, job->len))
+                    perror_and_exit("could not queue push");
+                c->pushed += job->len;
+                job_free(job);
+            } else {
+                // a push that could not be queued no longer counts against the window
+                if (queueFile(c, job->data, job->len, job->fd, job->off, job->flen, job->piece))
+                    c->pushed += job->len + job->flen;
+                else
+                    chargeFlow(&job->conn, -(int64_t)(job->len + job->flen));
+                job_free(job);
+            }
+            shard_flush(sh, c);
+        }
+    }
+}
+
+// queues a reply, holding it back until the replies before it are out
+static void deliver(Shard *sh, Conn *c, Job *reply) {
+
+    if (c->held == NULL)
+        c->held = vec_init_ptr();
+    vec_pushBack(c->held, &reply);
+
+    for (bool found = true; found;) {
+        found = false;
+        for (uint i = 0; i < c->held->size; i++) {
+            Job *job = vec_getValAt(c->held, i);
+            if (job->reqno != c->nextout)
+                continue;
+
+            if (!buf_append(c->out, job->data, job->len))
+                perror_and_exit("could not queue reply");
+            c->nextout++;
+            free(job);
+            vec_removeAt(c->held, i);
+            found = true;
+            break;
+        }
+    }
+}
+
+// returns true once every backlog has been moved into the inboxes
+static bool pushBacklog(Shard *sh) {
+
+    bool done = true;
+
+    for (int i = 0; i < nshards; i++) {
+        Buffer *b = sh->backlog[i];
+        Job    *job;
+        while (buf_len(b) > 0) {
+            memcpy(&job, buf_peek(b), sizeof job);
+            if (!ring_push(shards[i].inbox[sh->id], job))
+                break;
+            buf_consume(b, sizeof job);
+            sh->wake[i] = true;
+        }
+
+        if (buf_len(b) > 0)
+            done = false;
+    }
+
+    wakeShards(sh);
+
+    return done;
+}
+
+// one eventfd write per destination per loop iteration
+static void wakeShards(Shard *sh) {
+
+    const uint64_t one = 1;
+    for (int i = 0; i < nshards; i++) {
+        if (!sh->wake[i])
+            continue;
+        if (write(shards[i].jobconn->fd, &one, sizeof one) == -1 && errno != EAGAIN)
+            perror("could not signal shard");
+        sh->wake[i] = false;
+    }
+}
+
+// sends what shard_push() queued for local connections
+static void flushDirty(Shard *sh) {
+
+    ConnRef ref;
+    while (buf_len(sh->dirty) > 0) {
+        memcpy(&ref, buf_peek(sh->dirty), sizeof ref);
+        buf_consume(sh->dirty, sizeof ref);
+
+        Conn *c = shard_conn(sh, &ref);
+        if (c != NULL)
+            shard_flush(sh, c);
+    }
+}
+
+// whether a connection comes from this host: over a unix socket, or to the client's own address
+static bool isLocal(const int fd) {
+
+    struct sockaddr_storage self, peer;
+    socklen_t               slen = sizeof self, plen = sizeof peer;
+    if (getsockname(fd, (struct sockaddr *)&self, &slen) == -1 ||
+        getpeername(fd, (struct sockaddr *)&peer, &plen) == -1)
+        return false;
+    if (self.ss_family == AF_UNIX)
+        return true;
+
+    struct sockaddr_in *s = (struct sockaddr_in *)&self, *p = (struct sockaddr_in *)&peer;
+    return s->sin_family == AF_INET && p->sin_family == AF_INET && s->sin_addr.s_addr == p->sin_addr.s_addr;
+}
+
+// the first bytes in the channel mean the client has moved, its name is no longer needed
+static void checkShm(Shard *sh, Conn *c) {
+
+    if (c->shm == NULL || c->shmlive || shm_used(c->shm->up) == 0)
+        return;
+
+    c->shmlive = true;
+    shm_unlink(c->shm->name);
+    if (sh->shmconns == NULL)
+        sh->shmconns = vec_init_ptr();
+    vec_pushBack(sh->shmconns, &c);
+}
+
+// readConn() for what is in the channel, as long as the client is not backed up
+static bool readShm(Shard *sh, Conn *c) {
+
+    while (!backedUp(c)) {
+        if (!buf_reserve(c->in, BUF_START_SIZE))
+            perror_and_exit("could not grow buffer");
+
+        size_t n = shm_read(c->shm->up, c->in->data + c->in->end, c->in->cap - c->in->end);
+        if (n == 0)
+            break;
+        c->in->end += n;
+        if (!readConn(sh, c))
+            return false;
+    }
+
+    // the client may be waiting for room
+    shm_wake(c->shm->up);
+
+    return true;
+}
+
+// sendOut() into the channel, parked when full until the client has made room
+static bool sendShm(Conn *c) {
+
+    ShmRing *r  = c->shm->down;
+    bool     ok = true;
+    for (;;) {
+        struct file_chunk *fc   = (c->files != NULL && buf_len(c->files) > 0) ? (void *)buf_peek(c->files) : NULL;
+        size_t             want = (fc != NULL) ? fc->gap : buf_len(c->out);
+        ssize_t            n;
+
+        if (want > 0) {
+            n = shm_write(r, buf_peek(c->out), want);
+            buf_consume(c->out, n);
+            if (fc != NULL) {
+                fc->gap -= n;
+                c->filed -= n;
+            }
+        } else if (fc != NULL && fc->len > 0) {
+            // file bytes are read straight into the ring
+            size_t room;
+            char  *p = shm_space(r, &room);
+            n        = (room > 0) ? pread(fc->fd, p, (room < fc->len) ? room : fc->len, fc->off) : 0;
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0 && room > 0) {
+                if (n == 0)
+                    errno = EIO; // file shrank underneath us, the frame can no longer be completed
+                ok = false;
+                break;
+            }
+            shm_produce(r, n);
+            fc->off += n;
+            fc->len -= n;
+        } else if (fc != NULL) {
+            if (!fc->shared)
+                close(fc->fd);
+            buf_consume(c->files, sizeof *fc);
+            continue;
+        } else {
+            break;
+        }
+
+        if (n == 0 && shm_park(r, false))
+            break;
+    }
+
+    // once for all that was written
+    shm_wake(r);
+
+    return ok;
+}
+
+// handles what the clients on shared memory have sent, true if there was anything
+static bool pollShm(Shard *sh) {
+
+    // backwards, as closing a connection takes it out
+    bool found = false;
+    for (uint i = sh->shmconns->size; i-- > 0;) {
+        if (i >= sh->shmconns->size)
+            continue;
+        Conn *c = vec_getValAt(sh->shmconns, i);
+        if (backedUp(c) || shm_used(c->shm->up) == 0)
+            continue;
+
+        found = true;
+        if (readShm(sh, c))
+            shard_flush(sh, c);
+        else
+            closeConn(sh, c);
+    }
+
+    return found;
+}
+
+// polls the channels for spin_us, then parks them, false if there was work after all
+static bool idleShm(Shard *sh) {
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        if (pollShm(sh))
+            return false;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000 < spin_us);
+
+    // a backed up client is picked up again by the poll once it is not
+    for (uint i = 0; i < sh->shmconns->size; i++) {
+        Conn *c = vec_getValAt(sh->shmconns, i);
+        if (!backedUp(c) && !shm_park(c->shm->up, true))
+            return false;
+    }
+
+    return true;
+}
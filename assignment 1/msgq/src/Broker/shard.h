@@ -0,0 +1,300 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+/**
+ * Broker worker threads.
+ *
+ * Every shard runs its own epoll loop with its own pair of
+ * listening sockets (bound with SO_REUSEPORT, so the kernel
+ * spreads new connections across shards) and is pinned to
+ * one core.
+ *
+ * A broker given a socket path also listens on a pair of unix
+ * sockets next to it (see proto_unixAddr()). Those are bound
+ * once and watched by every shard, as the kernel does not
+ * spread unix connections; whichever shard wakes first takes
+ * the connection. Who may connect is up to the permissions of
+ * the socket files.
+ *
+ * Topics are split between shards by hash. A shard only
+ * touches the logs of the topics it owns; requests for other
+ * topics are handed to the owner as jobs over a lock-free
+ * queue, and replies travel back the same way. Replies are
+ * numbered per connection and always sent in request order.
+ *
+ * Pushed messages (streaming subscriptions) are not replies to
+ * any request and skip the ordering, they are queued as soon
+ * as they reach the shard of the connection.
+ *
+ * A shard waits on either epoll or io_uring. With io_uring,
+ * receives are issued straight into the connection buffers and
+ * the listeners and eventfd are polled through the ring, so a
+ * loop iteration submits everything it queued and reaps every
+ * completion with a single system call. Flags in Conn.events
+ * then mean a request is in flight, and a closed connection is
+ * only freed once the last one has completed.
+ *
+ * Large stored messages can be queued as a region of a log
+ * file instead of a copy. The bytes then go from the page
+ * cache to the socket with sendfile(), in between the bytes
+ * queued before and after them. A push for a connection of
+ * another shard takes a duplicate of the file along with it.
+ *
+ * Pushes are held to PUSH_WINDOW bytes per connection, whether
+ * or not its client grants credit. Every shard that pushes to
+ * a connection adds to the count in its Flow, and the shard of
+ * the connection takes off what has been sent; a shard that
+ * finds the window full leaves its streams waiting, and is
+ * sent a JOB_ROOM once the count is down to half.
+ *
+ * A client on the same host may move its connection onto a
+ * shared-memory channel (see shm.h). Its socket is then only
+ * read for doorbells, and is never written to. Before going
+ * to sleep, a shard with such clients polls their channels
+ * for SHM_SPIN_US (if there is more than one core), so a
+ * client that keeps publishing gets its requests picked up
+ * without ringing, and then parks them.
+ * A client that is backed up is paused by leaving its
+ * requests in the channel instead of by ignoring the socket.
+ */
+
+#include "Utils/buffer.h"
+#include "Utils/ring.h"
+#include "Utils/shm.h"
+#include "Utils/uring.h"
+#include "Utils/utils.h"
+#include "Utils/vector.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define MAX_SHARDS    64
+#define JOB_RING_SIZE 4096 // jobs in flight between a pair of shards
+#define LISTENQ       128
+#define MAX_EVENTS    64
+#define SHARD_TICK_MS 1000 // how often broker_tick() runs
+#define OUT_HIGHWATER (64 * 1024) // stop reading from a client that is this far behind
+#define REQ_HIGHWATER 4096        // or has this many requests waiting for a reply
+#define URING_ENTRIES 1024        // submission queue size per shard
+#define SHM_SPIN_US   50          // how long a shard polls its shared-memory clients before sleeping
+#define PUSH_WINDOW   OUT_HIGHWATER // bytes of pushes queued for a connection before its streams wait
+
+#define CREDIT_UNMETERED INT64_MAX // credit of a stream whose client never grants any, held to PUSH_WINDOW alone
+
+enum conn_type {
+    CONN_PUB_LISTEN,
+    CONN_SUB_LISTEN,
+    CONN_PUB,
+    CONN_SUB,
+    CONN_JOBS,         // eventfd signalled when jobs arrive
+    CONN_STATS_LISTEN, // stats port, on shard 0 only
+    CONN_STATS,        // gets a report and is closed
+};
+
+// bytes of a file to be sent after gap more bytes of Conn.out
+struct file_chunk {
+    int    fd; // duplicate, closed once sent
+    off_t  off;
+    size_t len;
+    size_t gap;
+    bool   shared; // the next chunk goes on with the same fd, and closes it
+};
+
+// a message being published in pieces, gathered as they arrive
+typedef struct Spool {
+    int    fd;  // file the pieces are written to, -1 once one is lost (the message then fails with its last piece)
+    size_t len; // bytes gathered so far
+} Spool;
+
+// pushes queued for a client connection, shared by every shard that pushes to it
+typedef struct Flow {
+    _Atomic int64_t  queued;  // bytes pushed that may not have been sent yet
+    _Atomic uint64_t waiting; // bit i: shard i has streams waiting for room
+    _Atomic int      refs;    // shards yet to drop the streams of the connection, once it has closed
+} Flow;
+
+// per-connection state, also the epoll user data
+typedef struct Conn {
+    int            fd;
+    enum conn_type type;
+    uint64_t       id;        // unique within the shard, guards against fd reuse
+    uint32_t       events;    // events currently registered with epoll (or in flight on the ring)
+    bool           closed;    // waiting for ring requests before being freed
+    uint64_t       nextreq;   // number given to the next request that expects a reply
+    uint64_t       nextout;   // number of the next reply to send
+    Vector        *held;      // Vector<Job *>, replies that arrived ahead of their turn
+    Buffer        *in;        // bytes received but not yet parsed
+    Buffer        *out;       // replies not yet sent
+    Buffer        *files;     // struct file_chunk, oldest first, NULL until one is queued
+    size_t         filed;     // unread bytes of out in front of the last file chunk
+    bool           streaming; // has subscribed to pushes at some point
+    Flow          *flow;      // NULL for listeners and stats clients
+    size_t         pushed;    // bytes of pushes taken into out that may not have been sent yet
+    uint32_t       features;  // agreed on with OP_HELLO (FEAT_*)
+    Spool         *spool;     // message being published in pieces, NULL if none
+    Shm           *shm;       // shared-memory channel offered to the client, NULL if none
+    bool           shmlive;   // the client took it: frames go through it, the socket only rings
+    char           bell[8];   // doorbells land here with io_uring
+} Conn;
+
+// a client connection, as named from any shard
+typedef struct ConnRef {
+    int      shard; // shard the connection lives on
+    int      fd;
+    uint64_t id;
+    Flow    *flow; // of the connection, only read through a stream (which is dropped before it is freed)
+} ConnRef;
+
+// whether two references name the same connection
+static inline bool shard_sameConn(const ConnRef *a, const ConnRef *b) {
+    return a->shard == b->shard && a->fd == b->fd && a->id == b->id;
+}
+
+enum job_type {
+    JOB_REQUEST, // frame to be handled by the owner of its topic
+    JOB_REPLY,   // bytes for a connection on the origin shard
+    JOB_PUSH,    // unordered bytes for a connection on the origin shard
+    JOB_CLOSED,  // a streaming connection has gone away
+    JOB_ROOM,    // a connection the shard waits on has room for pushes again
+};
+
+// request or reply passed between shards
+typedef struct Job {
+    enum job_type type;
+    ConnRef       conn;  // connection the request came from
+    uint64_t      reqno; // position of the reply among the replies to the connection
+    uint64_t      ns;    // when the request was received, see stats_now()
+    int           fd;    // file going with the job, -1 if none (closed along with it)
+    off_t         off;   // its bytes that go with the job: a message pushed, or one published in pieces
+    size_t        flen;
+    size_t        piece; // pushed in pieces of this many bytes, see shard_pushFile()
+    size_t        len;
+    char          data[]; // copy of the frame or reply
+} Job;
+
+typedef struct Shard {
+    int       id;
+    pthread_t tid;
+    int       epfd;
+    Uring    *uring;               // NULL when epoll is used
+    Conn     *pubconn;
+    Conn     *subconn;
+    Conn     *upubconn;            // unix listeners, NULL unless a socket path was given
+    Conn     *usubconn;
+    Conn     *statsconn;           // NULL except on shard 0
+    Conn     *jobconn;             // eventfd for the inbox
+    Conn    **conns;               // fd -> connection
+    uint      nconns;              // size of conns
+    uint64_t  nextid;              // next connection id
+    Ring     *inbox[MAX_SHARDS];   // inbox[i] carries jobs from shard i
+    Buffer   *backlog[MAX_SHARDS]; // Job * for shard i that did not fit its inbox
+    bool      wake[MAX_SHARDS];    // shard i has unsignalled jobs from us
+    Buffer   *dirty;               // ConnRef of local connections with pushed bytes to send
+    Vector   *shmconns;            // Vector<Conn *> of the connections on shared memory, NULL until one is
+} Shard;
+
+/**
+ * Starts n shards and blocks forever.
+ * Shard i is pinned to core i (modulo the number of cores).
+ * Shards use io_uring if uring is set and it is available.
+ * With unixpath set, clients may also connect over the unix
+ * sockets under it; a leftover socket file nobody listens on
+ * is replaced.
+ */
+void shard_runAll(const int n, const bool uring, const char *unixpath);
+
+/**
+ * Number of running shards.
+ */
+int shard_count();
+
+/**
+ * Shard that owns a topic.
+ */
+int shard_owner(const char *topic);
+
+/**
+ * Creates a job holding a copy of len bytes of data.
+ * The connection may be NULL for jobs that need no reply.
+ */
+Job *job_new(const enum job_type type, const Shard *sh, const Conn *c, const void *data, const size_t len);
+
+/**
+ * Frees a job, closing the file that goes with it.
+ */
+void job_free(Job *job);
+
+/**
+ * Hands a job over to another shard (takes ownership).
+ */
+void shard_send(Shard *sh, const int dst, Job *job);
+
+/**
+ * Sends the reply to a request back to the connection it
+ * came from. Every request that expects a reply must get
+ * exactly one.
+ */
+void shard_reply(Shard *sh, const Job *job, const void *data, const size_t len);
+
+/**
+ * Queues bytes for a connection outside of the reply order.
+ *
+ * Returns false if the connection is known to be closed.
+ */
+bool shard_push(Shard *sh, const ConnRef *to, const void *data, const size_t len);
+
+/**
+ * Whether more may be pushed to a connection. If not, the
+ * shard gets a JOB_ROOM (see broker_job()) once there is room.
+ */
+bool shard_canPush(Shard *sh, const ConnRef *to);
+
+/**
+ * shard_reply() and shard_push() for a message kept in a file:
+ * the n bytes of hdr are followed by len bytes of fd from off.
+ * The fd is duplicated, so it may be closed right after.
+ *
+ * A push may split the bytes in pieces of piece bytes (the
+ * last one shorter), hdr then holding one header per piece,
+ * all of the same size, each sent right before its piece.
+ *
+ * A reply only works for a local connection, if it is next in
+ * line. Returns false otherwise (or if the connection is known
+ * to be closed, or the fd could not be duplicated), with
+ * nothing queued, and the caller should send a copy instead.
+ */
+bool shard_replyFile(Shard *sh, const Job *job, const void *hdr, const size_t n, const int fd, const off_t off,
+                     const size_t len);
+bool shard_pushFile(Shard *sh, const ConnRef *to, const void *hdr, const size_t n, const int fd, const off_t off,
+                    const size_t len, const size_t piece);
+
+/**
+ * Local connection behind a reference, if it is still open.
+ */
+Conn *shard_conn(const Shard *sh, const ConnRef *ref);
+
+/**
+ * Sends queued replies and updates the epoll registration.
+ *
+ * Returns false if the connection had to be closed.
+ */
+bool shard_flush(Shard *sh, Conn *c);
+
+/**
+ * Offers a client a shared-memory channel for its connection,
+ * in answer to an OP_HELLO. Only a first request from the
+ * same host gets one.
+ *
+ * Returns the name of the channel, or NULL if none is offered.
+ */
+const char *shard_offerShm(Shard *sh, Conn *c);
+
+/**
+ * Provided by the broker.
+ */
+bool broker_read(Shard *sh, Conn *c); // new bytes in c->in, false to close c
+void broker_job(Shard *sh, Job *job); // request or close from a shard (takes ownership)
+int  broker_work(Shard *sh);          // once per loop iteration, ms it can wait (0 if more work is left, -1 for ever)
+void broker_tick(Shard *sh);          // called every SHARD_TICK_MS
+
+#endif // SHARD_H
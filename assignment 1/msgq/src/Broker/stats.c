@@ -0,0 +1,122 @@
+#include "stats.h"
+
+#include "Broker/index.h"
+#include "Broker/shard.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+
+static ShardStats shard_stats[MAX_SHARDS];
+
+static const char *lat_names[LAT_MAX] = {
+    [LAT_STORE]   = "publish_to_store",
+    [LAT_DELIVER] = "store_to_deliver",
+    [LAT_SYNC]    = "store_to_sync",
+};
+
+static void put(Buffer *b, const char *fmt, ...);
+static void putTopic(Buffer *b, const char *metric, const char *topic, const uint64_t v);
+
+ShardStats *stats_shard(const int id) { return &shard_stats[id]; }
+
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_latency(const int id, const enum latency l, const uint64_t ns) {
+
+    // index of the highest set bit, plus one
+    int i = (ns == 0) ? 0 : 64 - __builtin_clzll(ns);
+    if (i >= HIST_BUCKETS)
+        i = HIST_BUCKETS - 1;
+
+    Histogram *h = &shard_stats[id].lat[l];
+    stats_add(&h->bucket[i], 1);
+    stats_add(&h->sum, ns);
+}
+
+void stats_add(_Atomic uint64_t *counter, const uint64_t n) { atomic_fetch_add_explicit(counter, n, memory_order_relaxed); }
+
+void stats_report(Buffer *b) {
+
+    uint64_t pubconns = 0, subconns = 0;
+    uint64_t bucket[LAT_MAX][HIST_BUCKETS] = {{0}};
+    uint64_t sum[LAT_MAX]                  = {0};
+    for (int s = 0; s < shard_count(); s++) {
+        ShardStats *st = &shard_stats[s];
+        pubconns += atomic_load_explicit(&st->pubconns, memory_order_relaxed);
+        subconns += atomic_load_explicit(&st->subconns, memory_order_relaxed);
+        for (int l = 0; l < LAT_MAX; l++) {
+            for (int i = 0; i < HIST_BUCKETS; i++)
+                bucket[l][i] += atomic_load_explicit(&st->lat[l].bucket[i], memory_order_relaxed);
+            sum[l] += atomic_load_explicit(&st->lat[l].sum, memory_order_relaxed);
+        }
+    }
+
+    put(b, "msgq_shards %d\n", shard_count());
+    put(b, "msgq_clients{type=\"publisher\"} %" PRIu64 "\n", pubconns);
+    put(b, "msgq_clients{type=\"subscriber\"} %" PRIu64 "\n", subconns);
+
+    // cumulative buckets, as histograms are usually read
+    for (int l = 0; l < LAT_MAX; l++) {
+        uint64_t total = 0;
+        for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+            total += bucket[l][i];
+            put(b, "msgq_latency_ns_bucket{stage=\"%s\",le=\"%" PRIu64 "\"} %" PRIu64 "\n", lat_names[l],
+                (uint64_t)1 << i, total);
+        }
+        total += bucket[l][HIST_BUCKETS - 1];
+        put(b, "msgq_latency_ns_bucket{stage=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", lat_names[l], total);
+        put(b, "msgq_latency_ns_sum{stage=\"%s\"} %" PRIu64 "\n", lat_names[l], sum[l]);
+        put(b, "msgq_latency_ns_count{stage=\"%s\"} %" PRIu64 "\n", lat_names[l], total);
+    }
+
+    for (uint i = 0; i < INDEX_SLOTS; i++) {
+        TopicIndex *ix = index_slot(i);
+        if (ix == NULL)
+            continue;
+
+        TopicStats *ts    = &ix->stats;
+        uint64_t    end   = index_end(ix);
+        uint64_t    start = atomic_load_explicit(&ts->start, memory_order_relaxed);
+        putTopic(b, "msgq_topic_published_messages", ix->name, atomic_load_explicit(&ts->published, memory_order_relaxed));
+        putTopic(b, "msgq_topic_published_bytes", ix->name, atomic_load_explicit(&ts->pubbytes, memory_order_relaxed));
+        putTopic(b, "msgq_topic_fetched_messages", ix->name, atomic_load_explicit(&ts->fetched, memory_order_relaxed));
+        putTopic(b, "msgq_topic_fetched_bytes", ix->name, atomic_load_explicit(&ts->fetchbytes, memory_order_relaxed));
+        putTopic(b, "msgq_topic_pushed_messages", ix->name, atomic_load_explicit(&ts->pushed, memory_order_relaxed));
+        putTopic(b, "msgq_topic_pushed_bytes", ix->name, atomic_load_explicit(&ts->pushbytes, memory_order_relaxed));
+        putTopic(b, "msgq_topic_stored_messages", ix->name, (end > start) ? end - start : 0);
+        putTopic(b, "msgq_topic_subscribers", ix->name, atomic_load_explicit(&ts->subs, memory_order_relaxed));
+        putTopic(b, "msgq_topic_group_members", ix->name, atomic_load_explicit(&ts->members, memory_order_relaxed));
+        putTopic(b, "msgq_topic_backlog_messages", ix->name, atomic_load_explicit(&ts->backlog, memory_order_relaxed));
+    }
+}
+
+static void put(Buffer *b, const char *fmt, ...) {
+
+    char    line[2 * TMP_BUFLEN];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof line, fmt, ap);
+    va_end(ap);
+
+    if (n > 0 && !buf_append(b, line, ((size_t)n < sizeof line) ? (size_t)n : sizeof line - 1))
+        perror_and_exit("could not grow buffer");
+}
+
+static void putTopic(Buffer *b, const char *metric, const char *topic, const uint64_t v) {
+
+    // label values escape backslashes, quotes and newlines
+    char label[2 * TOPIC_MAXLEN + 1];
+    uint n = 0;
+    for (const char *p = topic; *p != '\0'; p++) {
+        if (*p == '\\' || *p == '"' || *p == '\n')
+            label[n++] = '\\';
+        label[n++] = (*p == '\n') ? 'n' : *p;
+    }
+    label[n] = '\0';
+
+    put(b, "%s{topic=\"%s\"} %" PRIu64 "\n", metric, label, v);
+}
@@ -0,0 +1,86 @@
+#ifndef STATS_H
+#define STATS_H
+
+/**
+ * Broker counters, served as text on a local port.
+ *
+ * Shard wide numbers (connections, latency histograms) are
+ * kept per shard and only written by that shard. Per-topic
+ * counters sit in the topic's index slot, which every shard
+ * can already reach; topics left out of the index are not
+ * reported. All counters are relaxed atomics, a report is a
+ * consistent enough snapshot but not an exact one.
+ *
+ * Latencies are counted in log-scale buckets: bucket i holds
+ * the samples of less than 2^i ns (and at least 2^(i-1)).
+ *
+ * A connection to the stats port gets one report, in the
+ * Prometheus text format, and is then closed.
+ */
+
+#include "Utils/buffer.h"
+#include "Utils/utils.h"
+
+#include <stdatomic.h>
+
+#define BROKER_STATS_PORT 15342
+#define HIST_BUCKETS      40 // up to ~9 minutes
+
+enum latency {
+    LAT_STORE,   // publish frame received -> message in the log
+    LAT_DELIVER, // message in the log -> queued for a streaming subscriber
+    LAT_SYNC,    // message in the log -> on disk and acknowledged (with -d)
+    LAT_MAX,
+};
+
+typedef struct Histogram {
+    _Atomic uint64_t bucket[HIST_BUCKETS];
+    _Atomic uint64_t sum; // ns
+} Histogram;
+
+typedef struct ShardStats {
+    _Atomic uint64_t pubconns; // connected publishers
+    _Atomic uint64_t subconns; // connected subscribers
+    Histogram        lat[LAT_MAX];
+} ShardStats;
+
+// counters of one topic, kept in its index slot
+typedef struct TopicStats {
+    _Atomic uint64_t published; // messages
+    _Atomic uint64_t pubbytes;
+    _Atomic uint64_t fetched; // messages sent in reply to fetches
+    _Atomic uint64_t fetchbytes;
+    _Atomic uint64_t pushed; // messages sent to streaming subscribers
+    _Atomic uint64_t pushbytes;
+    _Atomic uint64_t start;   // oldest message still stored (owner only)
+    _Atomic uint64_t subs;    // streaming subscribers (owner only)
+    _Atomic uint64_t members; // consumer group members (owner only)
+    _Atomic uint64_t backlog; // messages still to be pushed to either (owner only)
+} TopicStats;
+
+/**
+ * Counters of shard id.
+ */
+ShardStats *stats_shard(const int id);
+
+/**
+ * Current time for latency samples, in ns.
+ */
+uint64_t stats_now();
+
+/**
+ * Counts a latency sample of ns in a histogram of shard id.
+ */
+void stats_latency(const int id, const enum latency l, const uint64_t ns);
+
+/**
+ * Adds n to a counter.
+ */
+void stats_add(_Atomic uint64_t *counter, const uint64_t n);
+
+/**
+ * Appends a report over every shard and indexed topic to b.
+ */
+void stats_report(Buffer *b);
+
+#endif // STATS_H
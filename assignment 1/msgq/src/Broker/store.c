@@ -0,0 +1,935 @@
+#include "store.h"
+#include "Utils/proto.h"
+
+#include <endian.h>
+#include <inttypes.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+
+static int                 store_dfd; // root directory of the store
+static bool                sync_on;   // see store_init()
+static __thread Hashtable *logs;      // topic name -> TopicLog *, per shard
+static __thread Vector    *dirty;     // Vector<TopicLog *> appended to since the last sync, per shard
+static __thread Buffer    *spare;     // records being read or opened up, per shard
+
+// the compressed record decompressed last, per shard
+static __thread struct {
+    const TopicLog *tl;    // NULL until one is held
+    uint64_t        base;  // segment the record is in
+    off_t           pos;   // where it starts in the segment
+    uint32_t        count; // messages in it
+    uint32_t       *offs;  // where message i starts in raw
+    Buffer         *raw;   // the messages, each a u32 length and the bytes
+} unpacked;
+
+// every message of a compressed record has its own place in the index entry
+_Static_assert(LZ_BATCH_MAX < (1 << (64 - IDX_POS_BITS)), "compressed batch too large for the index");
+
+static int64_t  appendRecord(TopicLog *tl, const void *data, const uint32_t len, const uint32_t count, const time_t ts);
+static int64_t  indexRecord(TopicLog *tl, Segment *s, const off_t size, const uint32_t nent, const time_t ts);
+static bool     copyFile(const int in, const int out, off_t at, const size_t len);
+static void     markDirty(TopicLog *tl);
+static off_t    entryPos(const struct idx_entry *e);
+static uint32_t entryPlace(const struct idx_entry *e);
+static off_t    rec_end(const Segment *s, const off_t pos);
+static bool     rec_load(const TopicLog *tl, const Segment *s, const off_t pos, const struct rec_hdr *hdr);
+static bool     rec_unpack(const TopicLog *tl, const Segment *s, const off_t pos, const struct rec_hdr *hdr,
+                           const char *payload);
+static bool     spanWhole(const Buffer *b, const size_t mark, uint32_t place, uint64_t want, const bool packed);
+static uint64_t spanUnpack(const TopicLog *tl, const Segment *s, off_t pos, Buffer *b, const size_t mark,
+                           uint32_t place, const uint64_t want, const bool packed, const size_t room, const bool first);
+static bool     validName(const char *topic);
+static Segment *seg_open(TopicLog *tl, const uint64_t base, const bool create);
+static void     seg_load(Segment *s);
+static bool     seg_recover(const TopicLog *tl, Segment *s);
+static void     seg_remove(const TopicLog *tl, const uint64_t base);
+static void     seg_close(Segment *s);
+static bool     seg_entry(const Segment *s, const uint64_t i, struct idx_entry *e);
+static void     log_scan(TopicLog *tl);
+static Segment *log_active(TopicLog *tl);
+static Segment *log_roll(TopicLog *tl);
+static Segment *log_segment(const TopicLog *tl, const uint64_t seq);
+static void     log_drop(TopicLog *tl);
+
+void store_init(const char *dir, const bool sync) {
+
+    if (mkdir(dir, S_IRWXU) == -1 && errno != EEXIST)
+        perror_and_exit("could not create message directory");
+    if ((store_dfd = open(dir, O_RDONLY | O_DIRECTORY)) == -1)
+        perror_and_exit("could not open message directory");
+
+    // two brokers appending to the same logs would corrupt them
+    if (flock(store_dfd, LOCK_EX | LOCK_NB) == -1)
+        perror_and_exit("message directory is in use");
+
+    sync_on = sync;
+}
+
+bool store_sync() {
+
+    if (dirty == NULL || vec_isEmpty(dirty))
+        return true;
+
+    bool ok = true;
+    for (uint i = 0; i < dirty->size; i++) {
+        TopicLog *tl = vec_getValAt(dirty, i);
+
+        // every segment holding records past the synced ones, usually just the active one
+        for (uint j = tl->segments->size; j-- > 0;) {
+            Segment *s = vec_getValAt(tl->segments, j);
+            if (s->base + s->count <= tl->synced)
+                break;
+            if (fdatasync(s->logfd) == -1 || fdatasync(s->idxfd) == -1) {
+                perror("could not sync log");
+                ok = false;
+            }
+        }
+
+        if (ok)
+            tl->synced = log_end(tl);
+        tl->dirty = false;
+    }
+
+    vec_free(dirty);
+    dirty = vec_init_ptr();
+
+    return ok;
+}
+
+TopicLog *store_get(const char *topic, const bool create) {
+
+    if (logs == NULL)
+        logs = ht_init_str_void();
+
+    TopicLog *tl = ht_lookupVal(logs, &topic);
+    if (tl != NULL)
+        return tl;
+
+    if (!validName(topic))
+        return NULL;
+
+    if (create && mkdirat(store_dfd, topic, S_IRWXU) == -1) {
+        if (errno != EEXIST) {
+            perror("could not create topic directory");
+            return NULL;
+        }
+    } else if (create && sync_on && fsync(store_dfd) == -1) {
+        perror("could not sync message directory");
+    }
+
+    int dfd = openat(store_dfd, topic, O_RDONLY | O_DIRECTORY);
+    if (dfd == -1) {
+        if (errno != ENOENT)
+            perror("could not open topic directory");
+        return NULL;
+    }
+
+    tl  = malloc(sizeof *tl);
+    *tl = (TopicLog){
+        .name     = strdup(topic),
+        .dirfd    = dfd,
+        .segments = vec_init_ptr(),
+    };
+
+    log_scan(tl);
+    log_active(tl);
+    tl->synced = log_end(tl);
+
+    ht_insert(&logs, &topic, &tl);
+
+    return tl;
+}
+
+uint log_retain(TopicLog *tl, const Retention *r, const time_t now) {
+
+    uint dropped = 0;
+
+    // segments are oldest first, so only the front ever has to be looked at
+    while (r->age > 0 && !vec_isEmpty(tl->segments)) {
+        Segment *s = vec_getValAt(tl->segments, 0);
+        if (s->count == 0 || s->last_ts >= now - r->age)
+            break;
+
+        // keep the sequence going if the active segment goes away
+        if (tl->segments->size == 1 && log_roll(tl) == NULL)
+            break;
+
+        log_drop(tl);
+        dropped++;
+    }
+
+    while (r->bytes > 0 && tl->bytes > r->bytes && tl->segments->size > 1) {
+        log_drop(tl);
+        dropped++;
+    }
+
+    return dropped;
+}
+
+int64_t log_append(TopicLog *tl, const void *data, const uint32_t len, const time_t ts) {
+    return appendRecord(tl, data, len, 0, ts);
+}
+
+int64_t log_appendPacked(TopicLog *tl, const void *data, const uint32_t len, const uint32_t count, const time_t ts) {
+    return (count == 0 || count > LZ_BATCH_MAX) ? -1 : appendRecord(tl, data, len, count, ts);
+}
+
+int64_t log_appendBatch(TopicLog *tl, const struct iovec *msgs, const uint32_t n, const time_t ts) {
+
+    Segment *s = log_active(tl);
+    if (s != NULL && s->size >= SEGMENT_MAX_BYTES)
+        s = log_roll(tl);
+    if (s == NULL)
+        return -1;
+
+    // a header and an index entry per record, all records go out together
+    struct rec_hdr   *hdrs = malloc(n * sizeof *hdrs);
+    struct idx_entry *ents = malloc(n * sizeof *ents);
+    struct iovec     *iov  = malloc(2 * n * sizeof *iov);
+    off_t             pos  = s->size;
+    for (uint32_t i = 0; i < n; i++) {
+        hdrs[i]        = (struct rec_hdr){.len = msgs[i].iov_len, .ts = ts};
+        ents[i]        = (struct idx_entry){.pos = pos, .ts = ts};
+        iov[2 * i]     = (struct iovec){.iov_base = &hdrs[i], .iov_len = sizeof hdrs[i]};
+        iov[2 * i + 1] = msgs[i];
+        pos += sizeof hdrs[i] + msgs[i].iov_len;
+    }
+
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < 2 * n; i += IOV_MAX) {
+        int     cnt  = (2 * n - i < IOV_MAX) ? 2 * n - i : IOV_MAX;
+        ssize_t want = 0;
+        for (int j = 0; j < cnt; j++)
+            want += iov[i + j].iov_len;
+        ok = writev(s->logfd, iov + i, cnt) == want;
+    }
+    if (!ok)
+        perror("could not append to log");
+    else if (write(s->idxfd, ents, n * sizeof *ents) != (ssize_t)(n * sizeof *ents)) {
+        perror("could not append to index");
+        ok = false;
+    }
+
+    free(hdrs);
+    free(ents);
+    free(iov);
+
+    // all or nothing
+    if (!ok) {
+        if (ftruncate(s->logfd, s->size) == -1 || ftruncate(s->idxfd, s->count * sizeof(struct idx_entry)) == -1)
+            perror("could not truncate log");
+        return -1;
+    }
+
+    if (s->count == 0)
+        s->first_ts = ts;
+    s->last_ts = ts;
+    tl->bytes += pos - s->size;
+    s->size = pos;
+    s->count += n;
+    markDirty(tl);
+
+    return s->base + s->count - n;
+}
+
+int64_t log_appendFile(TopicLog *tl, const int fd, const uint32_t len, const time_t ts) {
+
+    Segment *s = log_active(tl);
+    if (s != NULL && s->size >= SEGMENT_MAX_BYTES)
+        s = log_roll(tl);
+    if (s == NULL)
+        return -1;
+
+    // copy_file_range() will not write to a file opened for appending, the record goes in at its offset instead
+    struct rec_hdr hdr   = {.len = len, .ts = ts};
+    int            flags = fcntl(s->logfd, F_GETFL);
+    bool           ok    = flags != -1 && fcntl(s->logfd, F_SETFL, flags & ~O_APPEND) != -1;
+    ok = ok && pwrite(s->logfd, &hdr, sizeof hdr, s->size) == sizeof hdr &&
+         copyFile(fd, s->logfd, s->size + sizeof hdr, len);
+    if (flags != -1 && fcntl(s->logfd, F_SETFL, flags) == -1)
+        ok = false;
+    if (!ok) {
+        perror("could not append to log");
+        if (ftruncate(s->logfd, s->size) == -1)
+            perror("could not truncate log");
+        return -1;
+    }
+
+    return indexRecord(tl, s, sizeof hdr + len, 1, ts);
+}
+
+int store_spool() {
+
+    int fd = openat(store_dfd, ".", O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        perror("could not create spool file");
+
+    return fd;
+}
+
+uint64_t log_start(TopicLog *tl) {
+
+    Segment *s = vec_getValAt(tl->segments, 0);
+    return (s == NULL) ? 0 : s->base;
+}
+
+uint64_t log_end(TopicLog *tl) {
+
+    Segment *s = vec_getValAt(tl->segments, tl->segments->size - 1);
+    return (s == NULL) ? 0 : s->base + s->count;
+}
+
+ssize_t log_read(TopicLog *tl, const uint64_t seq, Buffer *b, time_t *ts) {
+
+    Segment *s = log_segment(tl, seq);
+    if (s == NULL)
+        return -1;
+
+    struct idx_entry e;
+    struct rec_hdr   hdr;
+    if (!seg_entry(s, seq - s->base, &e))
+        return -1;
+    off_t pos = entryPos(&e);
+    if (pread(s->logfd, &hdr, sizeof hdr, pos) != sizeof hdr) {
+        perror("could not read record header");
+        return -1;
+    }
+
+    if (ts)
+        *ts = hdr.ts;
+
+    // a message of a compressed record comes out of the decompressed copy
+    if (hdr.count > 0) {
+        uint32_t place = entryPlace(&e);
+        if (!rec_load(tl, s, pos, &hdr) || place >= unpacked.count)
+            return -1;
+
+        uint32_t    len;
+        const char *msg = buf_peek(unpacked.raw) + unpacked.offs[place];
+        memcpy(&len, msg, sizeof len);
+        len = be32toh(len);
+        if (!buf_append(b, msg + sizeof len, len))
+            return -1;
+
+        return len;
+    }
+
+    if (!buf_reserve(b, hdr.len))
+        return -1;
+    if (pread(s->logfd, b->data + b->end, hdr.len, pos + sizeof hdr) != (ssize_t)hdr.len) {
+        perror("could not read record");
+        return -1;
+    }
+    b->end += hdr.len;
+
+    return hdr.len;
+}
+
+bool log_locate(TopicLog *tl, const uint64_t seq, int *fd, off_t *off, uint32_t *len, time_t *ts) {
+
+    Segment *s = log_segment(tl, seq);
+    if (s == NULL)
+        return false;
+
+    struct idx_entry e;
+    struct rec_hdr   hdr;
+    if (!seg_entry(s, seq - s->base, &e))
+        return false;
+    if (pread(s->logfd, &hdr, sizeof hdr, entryPos(&e)) != sizeof hdr) {
+        perror("could not read record header");
+        return false;
+    }
+    if (hdr.count > 0)
+        return false;
+
+    *fd  = s->logfd;
+    *off = entryPos(&e) + sizeof hdr;
+    *len = hdr.len;
+    if (ts)
+        *ts = hdr.ts;
+
+    return true;
+}
+
+off_t log_bytesFrom(TopicLog *tl, const uint64_t seq) {
+
+    Segment *s = log_segment(tl, seq);
+    if (s == NULL)
+        return (seq < log_start(tl)) ? tl->bytes : 0;
+
+    struct idx_entry e;
+    off_t            bytes = seg_entry(s, seq - s->base, &e) ? s->size - entryPos(&e) : s->size;
+
+    // and every segment after it
+    for (uint i = tl->segments->size; i-- > 0;) {
+        Segment *later = vec_getValAt(tl->segments, i);
+        if (later == s)
+            break;
+        bytes += later->size;
+    }
+
+    return bytes;
+}
+
+ssize_t log_readBatch(TopicLog *tl, uint64_t seq, const uint32_t max, const size_t maxbytes, const bool packed,
+                      Buffer *b) {
+
+    uint32_t n     = 0;
+    size_t   bytes = 0;
+    bool     huge  = false; // stopped before a record too large for a frame
+
+    while (n < max && !huge) {
+        Segment *s = log_segment(tl, seq);
+        if (s == NULL)
+            break;
+
+        // index entries of the records wanted, plus the next one to find where the last record ends
+        uint64_t i    = seq - s->base;
+        uint64_t k    = (s->count - i < max - n) ? s->count - i : max - n;
+        uint64_t nent = (i + k < s->count) ? k + 1 : k;
+
+        struct idx_entry *e  = malloc(nent * sizeof *e);
+        size_t            sz = nent * sizeof *e;
+        if (pread(s->idxfd, e, sz, i * sizeof *e) != (ssize_t)sz) {
+            perror("could not read segment index");
+            free(e);
+            break;
+        }
+
+        // records are back to back, take as many as fit (at least one per batch),
+        // the messages of a compressed record all point at it
+        uint64_t fit   = 0;
+        off_t    start = entryPos(&e[0]);
+        off_t    end   = start;
+        while (fit < k) {
+            off_t    pos = entryPos(&e[fit]);
+            uint64_t j   = fit + 1;
+            while (j < nent && entryPos(&e[j]) == pos)
+                j++;
+
+            off_t next;
+            if (j < nent)
+                next = entryPos(&e[j]);
+            else if (i + nent < s->count)
+                next = rec_end(s, pos); // the record goes on past the entries read
+            else
+                next = s->size;
+            if (next != -1 && next - pos > (off_t)(sizeof(struct rec_hdr) + MSG_MAXLEN))
+                huge = true;
+            if (next == -1 || huge || ((n > 0 || fit > 0) && bytes + (next - start) > maxbytes))
+                break;
+            end = next;
+            fit = (j < k) ? j : k;
+        }
+        uint32_t place = entryPlace(&e[0]);
+        free(e);
+
+        size_t span = end - start;
+        size_t mark = buf_len(b);
+        if (fit == 0 || !buf_reserve(b, span))
+            break;
+        if (pread(s->logfd, b->data + b->end, span, start) != (ssize_t)span) {
+            perror("could not read records");
+            break;
+        }
+        b->end += span;
+
+        // compressed records that cannot go out as they are get opened up
+        uint64_t got  = fit;
+        size_t   room = (bytes < maxbytes) ? maxbytes - bytes : 0;
+        if (!spanWhole(b, mark, place, fit, packed))
+            got = spanUnpack(tl, s, start, b, mark, place, fit, packed, room, n == 0);
+
+        bytes += buf_len(b) - mark;
+        n += got;
+        seq += got;
+
+        if (got < k)
+            break;
+    }
+
+    return (n == 0 && max > 0 && !huge && log_segment(tl, seq) != NULL) ? -1 : n;
+}
+
+// writes a record and its index entries, one per message
+static int64_t appendRecord(TopicLog *tl, const void *data, const uint32_t len, const uint32_t count, const time_t ts) {
+
+    Segment *s = log_active(tl);
+    if (s != NULL && s->size >= SEGMENT_MAX_BYTES)
+        s = log_roll(tl);
+    if (s == NULL)
+        return -1;
+
+    // header and payload go out in a single append
+    struct rec_hdr hdr   = {.len = len, .count = count, .ts = ts};
+    struct iovec   iov[] = {
+        {.iov_base = &hdr,         .iov_len = sizeof hdr},
+        {.iov_base = (void *)data, .iov_len = len       },
+    };
+    ssize_t n = writev(s->logfd, iov, NUM_ELEM(iov));
+    if (n != (ssize_t)(sizeof hdr + len)) {
+        perror("could not append to log");
+        if (n > 0 && ftruncate(s->logfd, s->size) == -1)
+            perror("could not truncate log");
+        return -1;
+    }
+
+    return indexRecord(tl, s, n, (count > 0) ? count : 1, ts);
+}
+
+// adds the index entries of a record of size bytes just written at the end of a segment, dropping it on error
+static int64_t indexRecord(TopicLog *tl, Segment *s, const off_t size, const uint32_t nent, const time_t ts) {
+
+    struct idx_entry *ents = malloc(nent * sizeof *ents);
+    for (uint32_t i = 0; i < nent; i++)
+        ents[i] = (struct idx_entry){.pos = s->size | (uint64_t)i << IDX_POS_BITS, .ts = ts};
+    bool ok = write(s->idxfd, ents, nent * sizeof *ents) == (ssize_t)(nent * sizeof *ents);
+    free(ents);
+    if (!ok) {
+        perror("could not append to index");
+        if (ftruncate(s->logfd, s->size) == -1 || ftruncate(s->idxfd, s->count * sizeof(struct idx_entry)) == -1)
+            perror("could not truncate log");
+        return -1;
+    }
+
+    if (s->count == 0)
+        s->first_ts = ts;
+    s->last_ts = ts;
+    s->size += size;
+    tl->bytes += size;
+    s->count += nent;
+    markDirty(tl);
+
+    return s->base + s->count - nent;
+}
+
+// copies the first len bytes of in to out at an offset, in the kernel where the file systems allow it
+static bool copyFile(const int in, const int out, off_t at, const size_t len) {
+
+    off_t from = 0;
+    while ((size_t)from < len) {
+        ssize_t n = copy_file_range(in, &from, out, &at, len - from, 0);
+        if (n > 0)
+            continue;
+        if (n == 0 || (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP))
+            return false;
+        break;
+    }
+
+    // otherwise through a buffer, a segment's worth at a time
+    if (spare == NULL)
+        spare = buf_init(BUF_START_SIZE);
+    buf_consume(spare, buf_len(spare));
+    if ((size_t)from < len && !buf_reserve(spare, SEGMENT_MAX_BYTES))
+        return false;
+    while ((size_t)from < len) {
+        size_t  want = (len - from < SEGMENT_MAX_BYTES) ? len - from : SEGMENT_MAX_BYTES;
+        ssize_t n    = pread(in, spare->data, want, from);
+        if (n <= 0 || pwrite(out, spare->data, n, at) != n)
+            return false;
+        from += n;
+        at += n;
+    }
+
+    return true;
+}
+
+static void markDirty(TopicLog *tl) {
+
+    if (!sync_on || tl->dirty)
+        return;
+
+    if (dirty == NULL)
+        dirty = vec_init_ptr();
+    vec_pushBack(dirty, &tl);
+    tl->dirty = true;
+}
+
+static off_t entryPos(const struct idx_entry *e) { return e->pos & ((UINT64_C(1) << IDX_POS_BITS) - 1); }
+
+static uint32_t entryPlace(const struct idx_entry *e) { return e->pos >> IDX_POS_BITS; }
+
+// where the record at pos ends, -1 on error
+static off_t rec_end(const Segment *s, const off_t pos) {
+
+    struct rec_hdr hdr;
+    if (pread(s->logfd, &hdr, sizeof hdr, pos) != sizeof hdr) {
+        perror("could not read record header");
+        return -1;
+    }
+
+    return pos + sizeof hdr + hdr.len;
+}
+
+// reads in a compressed record and decompresses it, unless it is the one held already
+static bool rec_load(const TopicLog *tl, const Segment *s, const off_t pos, const struct rec_hdr *hdr) {
+
+    if (unpacked.tl == tl && unpacked.base == s->base && unpacked.pos == pos)
+        return true;
+
+    if (spare == NULL)
+        spare = buf_init(BUF_START_SIZE);
+    buf_consume(spare, buf_len(spare));
+    if (!buf_reserve(spare, hdr->len))
+        return false;
+    if (pread(s->logfd, spare->data + spare->end, hdr->len, pos + sizeof *hdr) != (ssize_t)hdr->len) {
+        perror("could not read record");
+        return false;
+    }
+    spare->end += hdr->len;
+
+    return rec_unpack(tl, s, pos, hdr, buf_peek(spare));
+}
+
+// decompresses the payload of a compressed record into unpacked, unless it is the one held already
+static bool rec_unpack(const TopicLog *tl, const Segment *s, const off_t pos, const struct rec_hdr *hdr,
+                       const char *payload) {
+
+    if (unpacked.tl == tl && unpacked.base == s->base && unpacked.pos == pos)
+        return true;
+
+    if (unpacked.raw == NULL)
+        unpacked.raw = buf_init(BUF_START_SIZE);
+    unpacked.tl = NULL;
+    buf_consume(unpacked.raw, buf_len(unpacked.raw));
+    if (!proto_unpack(payload, hdr->len, hdr->count, unpacked.raw)) {
+        LOG(LOG_ERROR, "corrupt compressed record in %s/%020" PRIu64 "\n", tl->name, s->base);
+        return false;
+    }
+
+    // the lengths were checked while unpacking
+    const char *raw = buf_peek(unpacked.raw);
+    uint32_t    off = 0;
+    unpacked.offs   = realloc(unpacked.offs, hdr->count * sizeof *unpacked.offs);
+    for (uint32_t i = 0; i < hdr->count; i++) {
+        uint32_t len;
+        memcpy(&len, raw + off, sizeof len);
+        unpacked.offs[i] = off;
+        off += sizeof len + be32toh(len);
+    }
+
+    unpacked.tl    = tl;
+    unpacked.base  = s->base;
+    unpacked.pos   = pos;
+    unpacked.count = hdr->count;
+
+    return true;
+}
+
+// whether the records read into b from mark on can be used as they are, for want messages from place on
+static bool spanWhole(const Buffer *b, const size_t mark, uint32_t place, uint64_t want, const bool packed) {
+
+    const char *p   = buf_peek(b) + mark;
+    const char *end = buf_peek(b) + buf_len(b);
+    while (p < end) {
+        struct rec_hdr hdr;
+        memcpy(&hdr, p, sizeof hdr);
+        if (hdr.count > 0 && (!packed || place > 0 || hdr.count > want))
+            return false;
+
+        want -= (hdr.count > 0) ? hdr.count : 1;
+        place = 0;
+        p += sizeof hdr + hdr.len;
+    }
+
+    return true;
+}
+
+/**
+ * Rewrites the records read into b from mark on, the first of
+ * them at pos in s, as the want messages they hold from place
+ * on. Compressed records are kept whole if packed is set and
+ * all of them is wanted, any other message becomes a plain
+ * record. Stops before going over room bytes, unless first is
+ * set and nothing has been taken yet.
+ *
+ * Returns the number of messages left in b.
+ */
+static uint64_t spanUnpack(const TopicLog *tl, const Segment *s, off_t pos, Buffer *b, const size_t mark,
+                           uint32_t place, const uint64_t want, const bool packed, const size_t room, const bool first) {
+
+    if (spare == NULL)
+        spare = buf_init(BUF_START_SIZE);
+    buf_consume(spare, buf_len(spare));
+    if (!buf_append(spare, buf_peek(b) + mark, buf_len(b) - mark))
+        perror_and_exit("could not grow buffer");
+    buf_truncate(b, mark);
+
+    const char *p    = buf_peek(spare);
+    const char *end  = p + buf_len(spare);
+    uint64_t    got  = 0;
+    size_t      used = 0;
+    bool        full = false;
+    while (p < end && got < want && !full) {
+        struct rec_hdr hdr;
+        memcpy(&hdr, p, sizeof hdr);
+        size_t sz = sizeof hdr + hdr.len;
+
+        if (hdr.count == 0 || (packed && place == 0 && hdr.count <= want - got)) {
+            full = (got > 0 || !first) && used + sz > room;
+            if (full)
+                break;
+            if (!buf_append(b, p, sz))
+                perror_and_exit("could not grow buffer");
+            got += (hdr.count > 0) ? hdr.count : 1;
+            used += sz;
+        } else {
+            if (!rec_unpack(tl, s, pos, &hdr, p + sizeof hdr))
+                break;
+
+            for (uint32_t i = place; i < unpacked.count && got < want; i++) {
+                uint32_t    len;
+                const char *msg = buf_peek(unpacked.raw) + unpacked.offs[i];
+                memcpy(&len, msg, sizeof len);
+                len = be32toh(len);
+
+                struct rec_hdr mh = {.len = len, .ts = hdr.ts};
+                full              = (got > 0 || !first) && used + sizeof mh + len > room;
+                if (full)
+                    break;
+                if (!buf_append(b, &mh, sizeof mh) || !buf_append(b, msg + sizeof len, len))
+                    perror_and_exit("could not grow buffer");
+                got++;
+                used += sizeof mh + len;
+            }
+        }
+
+        place = 0;
+        pos += sz;
+        p += sz;
+    }
+
+    return got;
+}
+
+static bool validName(const char *topic) {
+    return topic[0] != '\0' && strchr(topic, '/') == NULL && strcmp(topic, ".") != 0 && strcmp(topic, "..") != 0 &&
+           strlen(topic) < NAME_MAX;
+}
+
+static Segment *seg_open(TopicLog *tl, const uint64_t base, const bool create) {
+
+    char      logname[NAME_MAX];
+    char      idxname[NAME_MAX];
+    const int flags = O_RDWR | O_APPEND | (create ? O_CREAT : 0);
+    snprintf(logname, sizeof logname, "%020" PRIu64 ".log", base);
+    snprintf(idxname, sizeof idxname, "%020" PRIu64 ".idx", base);
+
+    int logfd = openat(tl->dirfd, logname, flags, S_IRUSR | S_IWUSR);
+    if (logfd == -1) {
+        perror("could not open segment");
+        return NULL;
+    }
+
+    int idxfd = openat(tl->dirfd, idxname, flags, S_IRUSR | S_IWUSR);
+    if (idxfd == -1) {
+        perror("could not open segment index");
+        close(logfd);
+        return NULL;
+    }
+
+    // the new names have to survive a crash along with what goes in the files
+    if (create && sync_on && fsync(tl->dirfd) == -1)
+        perror("could not sync topic directory");
+
+    Segment *s = malloc(sizeof *s);
+    *s         = (Segment){
+        .base  = base,
+        .logfd = logfd,
+        .idxfd = idxfd,
+    };
+    seg_load(s);
+
+    return s;
+}
+
+static void seg_load(Segment *s) {
+
+    struct stat st;
+    if (fstat(s->logfd, &st) == 0)
+        s->size = st.st_size;
+    if (fstat(s->idxfd, &st) == 0)
+        s->count = st.st_size / sizeof(struct idx_entry);
+
+    struct idx_entry e;
+    if (s->count > 0 && seg_entry(s, 0, &e))
+        s->first_ts = e.ts;
+    if (s->count > 0 && seg_entry(s, s->count - 1, &e))
+        s->last_ts = e.ts;
+}
+
+// cuts a segment back to its last whole record, false if anything had to go
+static bool seg_recover(const TopicLog *tl, Segment *s) {
+
+    struct stat st;
+    if (fstat(s->idxfd, &st) == -1) {
+        perror("could not check segment index");
+        return true;
+    }
+
+    // the last entry has to be the last message of a record that was written out in full
+    uint64_t n   = s->count;
+    off_t    end = 0;
+    for (; n > 0; n--) {
+        struct idx_entry e;
+        struct rec_hdr   hdr;
+        if (!seg_entry(s, n - 1, &e))
+            return true;
+
+        off_t pos = entryPos(&e);
+        if (pread(s->logfd, &hdr, sizeof hdr, pos) != sizeof hdr || hdr.ts != e.ts)
+            continue;
+        if (entryPlace(&e) + 1 != ((hdr.count > 0) ? hdr.count : 1))
+            continue;
+        if (pos + (off_t)sizeof hdr + hdr.len > s->size)
+            continue;
+
+        end = pos + sizeof hdr + hdr.len;
+        break;
+    }
+
+    if (n == s->count && end == s->size && st.st_size == (off_t)(n * sizeof(struct idx_entry)))
+        return true;
+
+    LOG(LOG_INFO, "recovering %s/%020" PRIu64 ": keeping %" PRIu64 " of %" PRIu64 " records\n", tl->name, s->base, n,
+        s->count);
+
+    if (ftruncate(s->logfd, end) == -1 || ftruncate(s->idxfd, n * sizeof(struct idx_entry)) == -1)
+        perror("could not truncate segment");
+    s->first_ts = s->last_ts = 0;
+    seg_load(s);
+
+    return false;
+}
+
+static void seg_remove(const TopicLog *tl, const uint64_t base) {
+
+    char name[NAME_MAX];
+    snprintf(name, sizeof name, "%020" PRIu64 ".log", base);
+    if (unlinkat(tl->dirfd, name, 0) == -1)
+        perror("could not delete segment");
+    snprintf(name, sizeof name, "%020" PRIu64 ".idx", base);
+    if (unlinkat(tl->dirfd, name, 0) == -1 && errno != ENOENT)
+        perror("could not delete segment index");
+}
+
+static void seg_close(Segment *s) {
+    close(s->logfd);
+    close(s->idxfd);
+    free(s);
+}
+
+static bool seg_entry(const Segment *s, const uint64_t i, struct idx_entry *e) {
+    if (pread(s->idxfd, e, sizeof *e, i * sizeof *e) != sizeof *e) {
+        perror("could not read segment index");
+        return false;
+    }
+    return true;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// builds the segment list from the topic directory
+static void log_scan(TopicLog *tl) {
+
+    DIR *dp = fdopendir(dup(tl->dirfd));
+    if (dp == NULL) {
+        perror("could not open topic directory");
+        return;
+    }
+    rewinddir(dp);
+
+    // collect the base of every segment on disk
+    size_t         n = 0, cap = VEC_START_SIZE;
+    uint64_t      *bases = malloc(cap * sizeof *bases);
+    struct dirent *ent;
+    while ((ent = readdir(dp)) != NULL) {
+        char    *end;
+        uint64_t base = strtoull(ent->d_name, &end, 10);
+        if (end == ent->d_name || strcmp(end, ".log") != 0)
+            continue;
+        if (n == cap)
+            bases = realloc(bases, (cap *= 2) * sizeof *bases);
+        bases[n++] = base;
+    }
+    closedir(dp);
+    qsort(bases, n, sizeof *bases, cmp_u64);
+
+    // whatever follows a torn segment or a gap in the numbering was never synced
+    bool torn = false;
+    for (size_t j = 0; j < n; j++) {
+        Segment *last = vec_getValAt(tl->segments, tl->segments->size - 1);
+        if (torn || (last != NULL && bases[j] != last->base + last->count)) {
+            LOG(LOG_INFO, "recovering %s: removing segment %020" PRIu64 "\n", tl->name, bases[j]);
+            seg_remove(tl, bases[j]);
+            torn = true;
+            continue;
+        }
+
+        Segment *s = seg_open(tl, bases[j], false);
+        if (s != NULL) {
+            torn = !seg_recover(tl, s);
+            vec_pushBack(tl->segments, &s);
+            tl->bytes += s->size;
+        }
+    }
+
+    free(bases);
+}
+
+static Segment *log_active(TopicLog *tl) {
+
+    if (vec_isEmpty(tl->segments)) {
+        Segment *s = seg_open(tl, 0, true);
+        if (s == NULL)
+            return NULL;
+        vec_pushBack(tl->segments, &s);
+    }
+
+    return vec_getValAt(tl->segments, tl->segments->size - 1);
+}
+
+static Segment *log_roll(TopicLog *tl) {
+
+    Segment *s = seg_open(tl, log_end(tl), true);
+    if (s != NULL)
+        vec_pushBack(tl->segments, &s);
+
+    return s;
+}
+
+static Segment *log_segment(const TopicLog *tl, const uint64_t seq) {
+
+    // last segment with base <= seq
+    uint lo = 0, hi = tl->segments->size;
+    while (lo < hi) {
+        uint mid = lo + (hi - lo) / 2;
+        if (((Segment *)vec_getValAt(tl->segments, mid))->base <= seq)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0)
+        return NULL;
+
+    Segment *s = vec_getValAt(tl->segments, lo - 1);
+    return (seq < s->base + s->count) ? s : NULL;
+}
+
+// deletes the oldest segment
+static void log_drop(TopicLog *tl) {
+
+    Segment *s = vec_getValAt(tl->segments, 0);
+    seg_remove(tl, s->base);
+
+    LOG(LOG_INFO, "removed old segment %s/%020" PRIu64 "\n", tl->name, s->base);
+
+    tl->bytes -= s->size;
+    seg_close(s);
+    vec_removeAt(tl->segments, 0);
+}
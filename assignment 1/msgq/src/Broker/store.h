@@ -0,0 +1,217 @@
+#ifndef STORE_H
+#define STORE_H
+
+/**
+ * Per-topic append-only message log.
+ *
+ * Every topic is a directory holding fixed-size segments.
+ * A segment is a pair of files named after the sequence
+ * number of its first record:
+ *
+ *   <base>.log  records (struct rec_hdr followed by the payload)
+ *   <base>.idx  one struct idx_entry per record
+ *
+ * Records are numbered densely from 0 and the numbers carry on
+ * across expired segments, so they double as message ids.
+ * A compressed batch is kept as a single record holding all
+ * its messages, each of which still has its own index entry.
+ * Looking up a record is a binary search over segments
+ * followed by a single pread of the index.
+ *
+ * Open logs are cached per thread. A topic must only ever be
+ * used from the shard that owns it.
+ *
+ * A log is checked when it is opened. A crash can only tear
+ * the records written after the last store_sync(), so only
+ * the end of every segment is looked at: index entries are
+ * dropped until the last one points at a whole record that
+ * carries the same timestamp, the rest of the files is cut
+ * off and any segment after a torn one goes as well.
+ */
+
+#include "Broker/retention.h"
+#include "Utils/buffer.h"
+#include "Utils/hashtable.h"
+#include "Utils/utils.h"
+#include "Utils/vector.h"
+
+#include <sys/uio.h>
+
+#define SEGMENT_MAX_BYTES (1 << 20)  // roll over to a new segment past this size
+#define SENDFILE_MIN_LEN  (32 << 10) // messages this large are sent straight from the log
+#define IDX_POS_BITS      48         // bits of idx_entry.pos that hold the offset
+
+// header in front of every record in a .log file
+struct rec_hdr {
+    uint32_t len;   // payload length
+    uint32_t count; // messages in a compressed record (see proto.h), 0 for a plain one
+    int64_t  ts;    // time of publishing
+};
+
+// fixed width entry in a .idx file
+struct idx_entry {
+    uint64_t pos; // offset of the record header in the .log file, above IDX_POS_BITS the place in its record
+    int64_t  ts;  // copy of the record timestamp (for seeking by time)
+};
+
+typedef struct Segment {
+    uint64_t base;     // sequence number of the first record
+    uint64_t count;    // number of records
+    off_t    size;     // bytes in the .log file
+    int      logfd;    // .log file
+    int      idxfd;    // .idx file
+    time_t   first_ts; // timestamp of the first record
+    time_t   last_ts;  // timestamp of the last record
+} Segment;
+
+typedef struct TopicLog {
+    char    *name;     // topic name
+    int      dirfd;    // topic directory
+    Vector  *segments; // Vector<Segment *>, oldest first
+    off_t    bytes;    // size of all .log files
+    uint64_t synced;   // records before this are on disk
+    bool     dirty;    // appended to since the last store_sync()
+} TopicLog;
+
+/**
+ * Sets up the store in dir, created if needed. Only one
+ * process may use a directory at a time.
+ *
+ * With sync set, files and directories are synced as they are
+ * created and store_sync() makes appended records durable.
+ */
+void store_init(const char *dir, const bool sync);
+
+/**
+ * Flushes every log this thread appended to since the last
+ * call to disk, one fdatasync() per file written.
+ *
+ * Returns false if any of them failed.
+ */
+bool store_sync();
+
+/**
+ * Returns the log for a topic, opening it if required.
+ * The topic is created only if create is set.
+ *
+ * Returns NULL if the topic does not exist (or is not a
+ * valid name).
+ */
+TopicLog *store_get(const char *topic, const bool create);
+
+/**
+ * Drops whole segments that fall outside the retention limits
+ * r, as of now. Deleting a segment is two unlinks, whatever
+ * the number of records in it.
+ *
+ * Returns the number of segments dropped.
+ */
+uint log_retain(TopicLog *tl, const Retention *r, const time_t now);
+
+/**
+ * Appends a record to the active segment, rolling over to a
+ * new segment if it is full.
+ *
+ * Returns the sequence number of the record, or -1 on error.
+ */
+int64_t log_append(TopicLog *tl, const void *data, const uint32_t len, const time_t ts);
+
+/**
+ * Appends n records with a single gathered write. A batch is
+ * never split across segments, so a segment may end up larger
+ * than SEGMENT_MAX_BYTES by up to one batch.
+ *
+ * Returns the sequence number of the first record, or -1 if
+ * none were stored.
+ */
+int64_t log_appendBatch(TopicLog *tl, const struct iovec *msgs, const uint32_t n, const time_t ts);
+
+/**
+ * Appends a compressed batch of count messages as a single
+ * record, the payload going to disk as it is. The messages
+ * are numbered like any others.
+ *
+ * Returns the sequence number of the first message, or -1 on
+ * error.
+ */
+int64_t log_appendPacked(TopicLog *tl, const void *data, const uint32_t len, const uint32_t count, const time_t ts);
+
+/**
+ * Appends a record whose len bytes of payload are the start
+ * of the file fd, copied over by the kernel rather than read
+ * in. The record goes in whole or not at all.
+ *
+ * Returns the sequence number of the record, or -1 on error.
+ */
+int64_t log_appendFile(TopicLog *tl, const int fd, const uint32_t len, const time_t ts);
+
+/**
+ * Opens an unnamed file in the store directory, gone as soon
+ * as it is closed, to gather a message in before it is handed
+ * to log_appendFile(). Being on the same file system as the
+ * logs, it can be copied over without going through memory.
+ *
+ * Returns the fd, or -1 on error.
+ */
+int store_spool();
+
+/**
+ * Sequence number of the oldest record still stored.
+ */
+uint64_t log_start(TopicLog *tl);
+
+/**
+ * Sequence number one past the newest record.
+ */
+uint64_t log_end(TopicLog *tl);
+
+/**
+ * Appends the payload of a record to b.
+ * The record timestamp is stored in ts, if not NULL.
+ *
+ * A message of a compressed record is decompressed along
+ * with the rest of it; the last record decompressed is kept
+ * per thread, so reading its messages in turn costs one pass.
+ *
+ * Returns the payload length, or -1 if the record does not
+ * exist.
+ */
+ssize_t log_read(TopicLog *tl, const uint64_t seq, Buffer *b, time_t *ts);
+
+/**
+ * Finds where the payload of a record is kept, for sending it
+ * without reading it in: len bytes of fd from off. The fd is
+ * only good until the next call into the store.
+ * The record timestamp is stored in ts, if not NULL.
+ *
+ * Returns false if the record does not exist or is part of a
+ * compressed one.
+ */
+bool log_locate(TopicLog *tl, const uint64_t seq, int *fd, off_t *off, uint32_t *len, time_t *ts);
+
+/**
+ * Bytes of the log from the record holding seq to the end,
+ * headers included. Costs one index read.
+ */
+off_t log_bytesFrom(TopicLog *tl, const uint64_t seq);
+
+/**
+ * Appends up to max records starting at seq to b, exactly as
+ * they are stored (struct rec_hdr followed by the payload).
+ * Stops before the appended bytes would go over maxbytes, but
+ * always takes at least one record, unless it is larger than
+ * MSG_MAXLEN: such records are never read in, the batch stops
+ * before them. A run of records within a segment is read with
+ * a single pread.
+ *
+ * Compressed records are passed on whole if packed is set.
+ * Otherwise, or when only some of their messages are wanted,
+ * those messages are appended as plain records instead.
+ *
+ * Returns the number of messages appended (0 past the end of
+ * the log), or -1 on error.
+ */
+ssize_t log_readBatch(TopicLog *tl, uint64_t seq, const uint32_t max, const size_t maxbytes, const bool packed,
+                      Buffer *b);
+
+#endif // STORE_H
@@ -0,0 +1,267 @@
+#include "topic.h"
+
+static __thread Hashtable *topics;   // name -> Topic *, per shard
+static __thread Topic    **byid;     // id -> Topic *, NULL if not opened, per shard
+static __thread uint32_t   nbyid;    // size of byid
+static __thread Vector    *all;      // Vector<Topic *>, per shard
+static __thread Trie      *watches;  // pattern -> Vector<Watch *>, per shard
+static __thread Vector    *watching; // Vector<Watch *>, per shard
+
+static void remember(Topic *t);
+static void attach(void *watchers, void *topic);
+
+Topic *topic_get(const char *name, const bool create) {
+
+    if (topics == NULL)
+        topics = ht_init_str_void();
+
+    Topic *t = ht_lookupVal(topics, &name);
+    if (t != NULL)
+        return t;
+
+    if (!trie_validName(name, false))
+        return NULL;
+
+    TopicLog *tl = store_get(name, create);
+    if (tl == NULL)
+        return NULL;
+
+    t  = malloc(sizeof *t);
+    *t = (Topic){
+        .name   = tl->name,
+        .id     = registry_add(name),
+        .log    = tl,
+        .index  = index_add(name, log_end(tl)),
+        .retain = retention_get(name),
+        .subs   = vec_init_ptr(),
+        .groups = vec_init_ptr(),
+        .held   = vec_init_ptr(),
+    };
+    ht_insert(&topics, &name, &t);
+    vec_pushBack(topic_all(), &t);
+    remember(t);
+
+    if (t->index != NULL)
+        atomic_store_explicit(&t->index->stats.start, log_start(tl), memory_order_relaxed);
+
+    if (watches != NULL)
+        trie_match(watches, name, attach, t);
+
+    return t;
+}
+
+Topic *topic_byId(const uint32_t id, const bool create) {
+
+    if (id < nbyid && byid[id] != NULL)
+        return byid[id];
+
+    const char *name = registry_name(id);
+    return (name == NULL) ? NULL : topic_get(name, create);
+}
+
+Vector *topic_all() {
+
+    if (all == NULL)
+        all = vec_init_ptr();
+
+    return all;
+}
+
+int64_t topic_append(Topic *t, const void *data, const uint32_t len, const time_t ts) {
+
+    int64_t seq = log_append(t->log, data, len, ts);
+    if (seq == -1)
+        return -1;
+
+    t->stored_ns   = stats_now();
+    t->stored_from = seq;
+    if (t->index != NULL) {
+        index_append(t->index, seq, data, len, ts);
+        stats_add(&t->index->stats.published, 1);
+        stats_add(&t->index->stats.pubbytes, len);
+    }
+
+    return seq;
+}
+
+int64_t topic_appendBatch(Topic *t, const struct iovec *msgs, const uint32_t n, const time_t ts) {
+
+    int64_t seq = log_appendBatch(t->log, msgs, n, ts);
+    if (seq == -1)
+        return -1;
+
+    t->stored_ns   = stats_now();
+    t->stored_from = seq;
+    if (t->index != NULL) {
+        uint64_t bytes = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            index_append(t->index, seq + i, msgs[i].iov_base, msgs[i].iov_len, ts);
+            bytes += msgs[i].iov_len;
+        }
+        stats_add(&t->index->stats.published, n);
+        stats_add(&t->index->stats.pubbytes, bytes);
+    }
+
+    return seq;
+}
+
+int64_t topic_appendPacked(Topic *t, const void *data, const uint32_t len, const uint32_t count, const uint32_t raw,
+                           const time_t ts) {
+
+    int64_t seq = log_appendPacked(t->log, data, len, count, ts);
+    if (seq == -1)
+        return -1;
+
+    // they are read from the log, where they stay compressed
+    t->stored_ns   = stats_now();
+    t->stored_from = seq;
+    if (t->index != NULL) {
+        index_trim(t->index, seq + count);
+        stats_add(&t->index->stats.published, count);
+        stats_add(&t->index->stats.pubbytes, raw - count * sizeof(uint32_t));
+    }
+
+    return seq;
+}
+
+int64_t topic_appendFile(Topic *t, const int fd, const uint32_t len, const time_t ts) {
+
+    int64_t seq = log_appendFile(t->log, fd, len, ts);
+    if (seq == -1)
+        return -1;
+
+    t->stored_ns   = stats_now();
+    t->stored_from = seq;
+    if (t->index != NULL) {
+        index_trim(t->index, seq + 1);
+        stats_add(&t->index->stats.published, 1);
+        stats_add(&t->index->stats.pubbytes, len);
+    }
+
+    return seq;
+}
+
+ssize_t topic_read(Topic *t, const uint64_t seq, Buffer *b, time_t *ts) {
+
+    ssize_t n = (t->index == NULL) ? -1 : index_read(t->index, seq, b, ts);
+
+    return (n != -1) ? n : log_read(t->log, seq, b, ts);
+}
+
+void topic_retain(const time_t now) {
+
+    Vector *v = topic_all();
+    for (uint i = 0; i < v->size; i++) {
+        Topic *t = vec_getValAt(v, i);
+        if (log_retain(t->log, t->retain, now) > 0 && t->index != NULL) {
+            index_trim(t->index, log_start(t->log));
+            atomic_store_explicit(&t->index->stats.start, log_start(t->log), memory_order_relaxed);
+        }
+    }
+}
+
+Sub *topic_subscribe(Topic *t, const ConnRef *conn, const uint64_t next, const int64_t credit) {
+
+    Sub *s = malloc(sizeof *s);
+    *s     = (Sub){.conn = *conn, .next = next, .credit = credit};
+    vec_pushBack(t->subs, &s);
+    if (t->index != NULL)
+        atomic_store_explicit(&t->index->stats.subs, t->subs->size, memory_order_relaxed);
+
+    return s;
+}
+
+void topic_unsubscribe(Topic *t, const uint i) {
+    free(vec_getValAt(t->subs, i));
+    vec_removeAt(t->subs, i);
+    if (t->index != NULL)
+        atomic_store_explicit(&t->index->stats.subs, t->subs->size, memory_order_relaxed);
+}
+
+void topic_watch(const char *pattern, const ConnRef *conn, const int64_t credit) {
+
+    if (watches == NULL) {
+        watches  = trie_init();
+        watching = vec_init_ptr();
+    }
+
+    Watch *w = malloc(sizeof *w);
+    *w       = (Watch){.pattern = strdup(pattern), .conn = *conn, .credit = credit};
+    vec_pushBack(watching, &w);
+
+    void **watchers = trie_slot(watches, pattern);
+    if (*watchers == NULL)
+        *watchers = vec_init_ptr();
+    vec_pushBack(*watchers, &w);
+
+    // topics opened later are matched by the trie
+    Vector *v = topic_all();
+    for (uint i = 0; i < v->size; i++) {
+        Topic *t = vec_getValAt(v, i);
+        if (trie_matches(pattern, t->name))
+            topic_subscribe(t, conn, log_end(t->log), credit)->matched = true;
+    }
+}
+
+void topic_unwatch(const ConnRef *conn) {
+
+    for (uint i = 0; watching != NULL && i < watching->size;) {
+        Watch *w = vec_getValAt(watching, i);
+        if (!shard_sameConn(&w->conn, conn)) {
+            i++;
+            continue;
+        }
+
+        Vector *watchers = trie_find(watches, w->pattern);
+        for (uint j = 0; j < watchers->size; j++) {
+            if (vec_getValAt(watchers, j) == w) {
+                vec_removeAt(watchers, j);
+                break;
+            }
+        }
+
+        vec_removeAt(watching, i);
+        free(w->pattern);
+        free(w);
+    }
+}
+
+Group *topic_group(Topic *t, const char *name, const bool create) {
+
+    Group *g = group_find(t->groups, name);
+    if (g == NULL && create) {
+        g = group_new(name);
+        vec_pushBack(t->groups, &g);
+    }
+
+    return g;
+}
+
+// files a newly opened topic under its id, growing the array if required
+static void remember(Topic *t) {
+
+    if (t->id == TOPIC_NOID)
+        return;
+
+    if (t->id >= nbyid) {
+        uint32_t n = (nbyid > 0) ? nbyid : 64;
+        while (n <= t->id)
+            n *= 2;
+        byid = realloc(byid, n * sizeof(Topic *));
+        memset(byid + nbyid, 0, (n - nbyid) * sizeof(Topic *));
+        nbyid = n;
+    }
+
+    byid[t->id] = t;
+}
+
+// starts a stream of a newly opened topic for every watcher of a pattern it matches
+static void attach(void *watchers, void *topic) {
+
+    Vector *v = watchers;
+    Topic  *t = topic;
+    for (uint i = 0; i < v->size; i++) {
+        Watch *w = vec_getValAt(v, i);
+        topic_subscribe(t, &w->conn, log_end(t->log), w->credit)->matched = true;
+    }
+}
@@ -0,0 +1,143 @@
+#ifndef TOPIC_H
+#define TOPIC_H
+
+/**
+ * Broker state for a topic, kept by the shard that owns it:
+ * the message log, its in-memory index, the connections
+ * streaming from it and its consumer groups.
+ *
+ * Like the logs, topics are cached per thread, by name and in
+ * an array indexed by their registry id.
+ *
+ * Pattern subscriptions are kept by every shard in a topic
+ * trie. A topic is matched against them once, when its shard
+ * opens it, and gets a stream for every match; publishes then
+ * fan out over the topic's streams as usual.
+ */
+
+#include "Broker/group.h"
+#include "Broker/index.h"
+#include "Broker/registry.h"
+#include "Broker/retention.h"
+#include "Broker/shard.h"
+#include "Broker/store.h"
+#include "Utils/hashtable.h"
+#include "Utils/trie.h"
+#include "Utils/utils.h"
+#include "Utils/vector.h"
+
+// a connection streaming a topic
+typedef struct Sub {
+    ConnRef  conn;
+    uint64_t next;    // id of the next message to push
+    int64_t  credit;  // bytes that may still be pushed, CREDIT_UNMETERED leaves it to the window of the connection
+    bool     matched; // started by a pattern subscription
+} Sub;
+
+// a connection streaming every topic that matches a pattern
+typedef struct Watch {
+    char   *pattern;
+    ConnRef conn;
+    int64_t credit; // given to the stream of each topic
+} Watch;
+
+typedef struct Topic {
+    char            *name;
+    uint32_t         id;          // in the registry, TOPIC_NOID if it was full
+    TopicLog        *log;
+    TopicIndex      *index;       // recent messages, NULL if the index is full
+    const Retention *retain;      // limits on what the log keeps
+    Vector          *subs;        // Vector<Sub *>
+    Vector          *groups;      // Vector<Group *>
+    bool             lagging;     // some subscriber has messages still to be pushed
+    bool             stalled;     // some stream waits for its connection to make room
+    bool             flooded;     // readers are past the high-water mark, publish acks are held
+    Vector          *held;        // Vector<Job *>, publish acks waiting for the readers to catch up
+    uint64_t         stored_ns;   // when the latest append was stored, see stats_now()
+    uint64_t         stored_from; // id of its first message
+} Topic;
+
+/**
+ * Returns a topic, opening (or creating, if create is set)
+ * its log if required.
+ *
+ * Returns NULL if the topic does not exist or is not a valid
+ * name. A topic being opened is registered, if it is not yet,
+ * and joins the pattern subscriptions it matches.
+ */
+Topic *topic_get(const char *name, const bool create);
+
+/**
+ * topic_get() for the topic with a registry id, NULL if there
+ * is no such id.
+ */
+Topic *topic_byId(const uint32_t id, const bool create);
+
+/**
+ * Every topic opened by this thread, Vector<Topic *>.
+ */
+Vector *topic_all();
+
+/**
+ * Appends messages to the log and the index, and counts them.
+ * Same return values as log_append() and log_appendBatch().
+ */
+int64_t topic_append(Topic *t, const void *data, const uint32_t len, const time_t ts);
+int64_t topic_appendBatch(Topic *t, const struct iovec *msgs, const uint32_t n, const time_t ts);
+
+/**
+ * Appends a message kept in a file to the log, see
+ * log_appendFile(). It is left out of the index.
+ */
+int64_t topic_appendFile(Topic *t, const int fd, const uint32_t len, const time_t ts);
+
+/**
+ * Appends a compressed batch to the log, see log_appendPacked().
+ * Its messages are left out of the index, raw is the size of
+ * the entries once decompressed.
+ */
+int64_t topic_appendPacked(Topic *t, const void *data, const uint32_t len, const uint32_t count, const uint32_t raw,
+                           const time_t ts);
+
+/**
+ * log_read(), from the index if the message is still there.
+ */
+ssize_t topic_read(Topic *t, const uint64_t seq, Buffer *b, time_t *ts);
+
+/**
+ * log_retain() for every topic opened by this thread, and
+ * drops the expired messages from the index as well.
+ */
+void topic_retain(const time_t now);
+
+/**
+ * Adds a subscriber starting at message id next, with credit
+ * bytes to be pushed.
+ */
+Sub *topic_subscribe(Topic *t, const ConnRef *conn, const uint64_t next, const int64_t credit);
+
+/**
+ * Removes the subscriber at position i of t->subs.
+ */
+void topic_unsubscribe(Topic *t, const uint i);
+
+/**
+ * Streams every topic of this thread that matches a pattern,
+ * open now or opened later, to a connection. Streams start at
+ * the end of their topic.
+ */
+void topic_watch(const char *pattern, const ConnRef *conn, const int64_t credit);
+
+/**
+ * Forgets the patterns of a connection. The streams they
+ * started are left to topic_unsubscribe().
+ */
+void topic_unwatch(const ConnRef *conn);
+
+/**
+ * Returns a consumer group of the topic, creating it if
+ * create is set. Returns NULL if there is no such group.
+ */
+Group *topic_group(Topic *t, const char *name, const bool create);
+
+#endif // TOPIC_H
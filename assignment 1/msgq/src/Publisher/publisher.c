@@ -1,30 +1,108 @@
 #include "Broker/broker.h"
+#include "Utils/proto.h"
+#include "Utils/trie.h"
 #include "Utils/utils.h"
 #include "Utils/vector.h"
 
-#define TOPICS_FILE "data/topics.txt"
-#define OUT         "publisher"
+#include <getopt.h>
 
-static Vector *topics;
-static int     brokerfd;
+#define OUT "publisher"
+
+#define BATCH_MAX_MSGS  1024        // messages per batch
+#define BATCH_MAX_BYTES (256 << 10) // bytes per batch
+#define DEFAULT_WINDOW  8           // batches in flight
+#define READ_CHUNK      (1 << 20)   // bytes read from the input at a time
+#define FOLLOW_MAX      1           // redirects followed when looking for the owner of a topic
 
-static void    usage();
-static void    handlerSIGPIPE(int sig);
-static void    connBroker(const char *addr);
-static void    addTopic();
-static void    sendMsg();
-static void    sendMsgs();
-static Vector *loadTopics(const char *topics_file);
-static void    viewTopics(const Vector *topics);
-static bool    validateTopic(const char *topic);
+// batches sent but not yet acknowledged
+typedef struct Window {
+    uint64_t  sent;   // batches sent so far, also the next batch number
+    uint64_t  acked;  // batches settled
+    uint32_t *counts; // messages in batch i, at i % window
+    uint64_t  stored; // messages acknowledged
+    uint64_t  failed; // messages the broker refused
+    uint64_t  first;  // id of the first message stored
+    uint64_t  last;   // id of the last message stored
+} Window;
+
+static int     brokerfd;
+static Owner   broker; // address brokerfd is connected to
+static Buffer *outbuf;
+static Buffer *inbuf;
+static Buffer *lzbuf; // a batch being compressed
+static uint    window = DEFAULT_WINDOW;
+static bool    compress; // asked for with -z
+static bool    packed;   // batches go out compressed, if the broker agreed to it
+static bool    byid;     // topics go out as their ids, if the broker agreed to it
+static bool    chunked;  // large messages go out in pieces, if the broker agreed to it
+
+static void     usage();
+static void     handlerSIGPIPE(int sig);
+static void     connBroker();
+static void     findOwner(const char *topic);
+static uint32_t topicId(const char *topic, const bool create);
+static void     addTopic();
+static void     sendMsg();
+static void     sendMsgs();
+static void     sendFile();
+static bool     publish(const char *topic, const uint32_t id, const char *msg, const size_t len, const bool more);
+static bool     streamLines(const int fd, const char *topic, const uint32_t id);
+static bool     publishWhole(const int fd, const char *topic, const uint32_t id);
+static uint32_t buildBatch(Buffer *in, const char *topic, const uint32_t id, const uint64_t batch, const bool eof);
+static void     waitAck(Window *w);
+static void     viewTopics();
+static bool     validateTopic(const char *topic, uint32_t *id);
 
 int main(int argc, char **argv) {
 
-    if (argc != 2)
+    static const struct option longopts[] = {
+        {"window", required_argument, NULL, 'w'},
+        {"topic", required_argument, NULL, 't'},
+        {"file", required_argument, NULL, 'f'},
+        {"stdin", no_argument, NULL, 'i'},
+        {"compress", no_argument, NULL, 'z'},
+        {"one", no_argument, NULL, 'o'},
+        {NULL, 0, NULL, 0},
+    };
+
+    const char *topic = NULL; // set for the non-interactive mode
+    const char *file  = NULL;  // input of the non-interactive mode, stdin if not given
+    bool        whole = false; // the input is one message rather than one per line
+    int         opt;
+    while ((opt = getopt_long(argc, argv, "w:t:f:izo", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 't':
+            topic = optarg;
+            break;
+        case 'f':
+            file = optarg;
+            break;
+        case 'i':
+            file = NULL;
+            break;
+        case 'z':
+            compress = true;
+            break;
+        case 'o':
+            whole = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 1 || window == 0 || ((file != NULL || whole) && topic == NULL))
         usage();
 
-    connBroker(argv[1]);
-    topics = loadTopics(TOPICS_FILE);
+    if (!proto_parseAddr(argv[optind], &broker))
+        usage();
+    outbuf = buf_init(BUF_START_SIZE);
+    inbuf  = buf_init(BUF_START_SIZE);
+    lzbuf  = buf_init(BUF_START_SIZE);
+    connBroker();
 
     // setup sigpipe handler
     struct sigaction sa;
@@ -32,6 +110,20 @@ int main(int argc, char **argv) {
     if (sigaction(SIGPIPE, &sa, NULL) == -1)
         perror_and_exit("failed to setup sigpipe handler");
 
+    // publish every line of the input (or all of it) and exit, without the menu
+    if (topic != NULL) {
+        int fd = STDIN_FILENO;
+        if (file != NULL && (fd = open(file, O_RDONLY)) == -1)
+            perror_and_exit("could not open file");
+
+        // publishing would create the topic anyway
+        findOwner(topic);
+        uint32_t id = topicId(topic, true);
+        bool     ok = whole ? publishWhole(fd, topic, id) : streamLines(fd, topic, id);
+        proto_close(brokerfd);
+        exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
     int choice = 0;
     for (;;) {
         printf("\n------- PUBLISHER -------\n");
@@ -40,13 +132,14 @@ int main(int argc, char **argv) {
         printf("2. Send a message\n");
         printf("3. Send series of messages from file\n");
         printf("4. View all topics\n");
+        printf("5. Send a file as a single message\n");
         printf("Enter choice: ");
         scanf("%d", &choice);
 
         switch (choice) {
 
         case 0:
-            close(brokerfd);
+            proto_close(brokerfd);
             exit(EXIT_SUCCESS);
 
         case 1:
@@ -62,7 +155,11 @@ int main(int argc, char **argv) {
             break;
 
         case 4:
-            viewTopics(topics);
+            viewTopics();
+            break;
+
+        case 5:
+            sendFile();
             break;
 
         default:
@@ -74,43 +171,39 @@ int main(int argc, char **argv) {
 }
 
 static void usage() {
-    printf("Usage: " OUT " <broker address>\n");
+    printf("Usage: " OUT " [-w <batches in flight>] [-z] [-t <topic> [-o] [-f <file> | -i]]\n"
+           "       <broker address>[:<port>] | unix:<socket path>\n");
+    printf("  -w, --window    batches sent ahead of their acknowledgement\n");
+    printf("  -z, --compress  compress batches, if the broker takes them\n");
+    printf("  -t, --topic     publish each line of the input to the topic and exit\n");
+    printf("  -o, --one       publish the whole input as a single message instead, of any size\n");
+    printf("  -f, --file      read the lines from a file\n");
+    printf("  -i, --stdin     read the lines from stdin (default)\n");
     exit(EXIT_FAILURE);
 }
 
-static Vector *loadTopics(const char *topics_file) {
-
-    FILE *fp = fopen(topics_file, "r");
-    if (fp == NULL)
-        perror_and_exit("error opening topics file");
+// the topics are kept by the broker, every publisher and subscriber sees the same ones
+static void viewTopics() {
 
-    Vector *vec = vec_init_ptr();
-    char    tmp[TMP_BUFLEN];
-    while (readLine(fp, tmp, TMP_BUFLEN) != NULL) {
-        char *topic = strndup(tmp, TMP_BUFLEN);
-        vec_pushBack(vec, &topic);
+    Vector *topics = vec_init_ptr();
+    if (!proto_listTopics(brokerfd, outbuf, inbuf, topics)) {
+        printf(RED "Lost connection to broker" RST "\n");
+        exit(EXIT_FAILURE);
     }
 
-    fclose(fp);
-
-    return vec;
-}
-
-static void viewTopics(const Vector *topics) {
-
-    if (topics == NULL) {
+    if (vec_isEmpty(topics))
         printf("No topics have been added\n");
-        return;
-    }
 
     printf("\n");
 
     for (int i = 0; i < topics->size; i++) {
         char *topic = vec_getValAt(topics, i);
         printf("%s\n", topic);
+        free(topic);
     }
 
     printf("\n");
+    vec_free(topics);
 }
 
 static void addTopic() {
@@ -118,34 +211,36 @@ static void addTopic() {
     flushstdin();
 
     char tmp[TMP_BUFLEN];
-    printf("\nTopic name (max 512 characters): ");
+    printf("\nTopic name (max 255 characters): ");
     if (readLine(stdin, tmp, TMP_BUFLEN) == NULL)
         return;
 
-    // update topics vector
-    char *topic = strndup(tmp, TMP_BUFLEN);
-    vec_pushBack(topics, &topic);
+    if (!trie_validName(tmp, false) || strlen(tmp) > TOPIC_MAXLEN) {
+        printf(RED "Invalid topic name" RST "\n");
+        return;
+    }
 
-    // update topics.txt
-    FILE *fp = fopen(TOPICS_FILE, "a");
-    if (fp == NULL)
-        perror_and_exit("error opening topics file");
-    fprintf(fp, "%s\n", topic);
-    fclose(fp);
+    // registered with the broker that owns it
+    findOwner(tmp);
+    uint32_t id = topicId(tmp, true);
+    if (id == TOPIC_NOID) {
+        printf(RED "Broker could not add %s" RST "\n", tmp);
+        return;
+    }
 
-    printf("Added %s\n", topic);
+    printf("Added %s with ID %u\n", tmp, id);
 }
 
-static bool validateTopic(const char *topic) {
-    if (topics == NULL)
+// a topic has to be registered with the broker that owns it, which is connected to
+static bool validateTopic(const char *topic, uint32_t *id) {
+
+    if (!trie_validName(topic, false) || strlen(topic) > TOPIC_MAXLEN)
         return false;
 
-    for (int i = 0; i < topics->size; i++) {
-        if (strcmp(topic, vec_getValAt(topics, i)) == 0)
-            return true;
-    }
+    findOwner(topic);
+    *id = topicId(topic, false);
 
-    return false;
+    return *id != TOPIC_NOID;
 }
 
 static void sendMsg() {
@@ -157,7 +252,8 @@ static void sendMsg() {
     if (readLine(stdin, tmp, TMP_BUFLEN) == NULL)
         return;
 
-    if (!validateTopic(tmp)) {
+    uint32_t id;
+    if (!validateTopic(tmp, &id)) {
         printf(RED "Invalid topic name" RST "\n");
         return;
     }
@@ -167,18 +263,44 @@ static void sendMsg() {
     if (readLine(stdin, tmp2, TMP_BUFLEN) == NULL)
         return;
 
-    struct msg msg;
-    strncpy(msg.topic, tmp, TMP_BUFLEN);
-    strncpy(msg.msg, tmp2, TMP_BUFLEN);
-    if (write(brokerfd, &msg, sizeof msg) == -1) {
-        perror("error sending message");
+    if (!publish(tmp, id, tmp2, strlen(tmp2), false))
+        return;
+}
+
+static void sendMsgs() {
+
+    flushstdin();
+
+    char filename[TMP_BUFLEN];
+    printf("\nFilename: ");
+    if (readLine(stdin, filename, TMP_BUFLEN) == NULL)
+        return;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("could not open file");
+        return;
+    }
+
+    char topic[TMP_BUFLEN];
+    printf("\nTopic: ");
+    if (readLine(stdin, topic, TMP_BUFLEN) == NULL) {
+        close(fd);
         return;
     }
 
-    printf("Message sent to broker\n");
+    uint32_t id;
+    if (!validateTopic(topic, &id)) {
+        printf(RED "Invalid topic name" RST "\n");
+        close(fd);
+        return;
+    }
+
+    streamLines(fd, topic, id);
+    close(fd);
 }
 
-static void sendMsgs() {
+static void sendFile() {
 
     flushstdin();
 
@@ -187,54 +309,337 @@ static void sendMsgs() {
     if (readLine(stdin, filename, TMP_BUFLEN) == NULL)
         return;
 
-    FILE *fp = fopen(filename, "r");
-    if (fp == NULL) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
         perror("could not open file");
         return;
     }
 
     char topic[TMP_BUFLEN];
     printf("\nTopic: ");
-    if (readLine(stdin, topic, TMP_BUFLEN) == NULL)
+    if (readLine(stdin, topic, TMP_BUFLEN) == NULL) {
+        close(fd);
         return;
+    }
 
-    if (!validateTopic(topic)) {
+    uint32_t id;
+    if (!validateTopic(topic, &id)) {
         printf(RED "Invalid topic name" RST "\n");
+        close(fd);
         return;
     }
 
-    char tmp[TMP_BUFLEN];
-    while (readLine(stdin, tmp, TMP_BUFLEN) != NULL) {
-        struct msg msg;
-        strncpy(msg.topic, topic, TMP_BUFLEN);
-        strncpy(msg.msg, tmp, TMP_BUFLEN);
-        if (write(brokerfd, &msg, sizeof msg) == -1) {
-            perror("error while sending message");
+    publishWhole(fd, topic, id);
+    close(fd);
+}
+
+/**
+ * Publishes every line of fd as a message, in batches sent back
+ * to back with up to window of them unacknowledged. Input is
+ * read in large chunks and whatever whole lines have arrived
+ * go out right away, so a slow pipe is not held back waiting
+ * for a full batch.
+ *
+ * Returns false if any message was not stored.
+ */
+static bool streamLines(const int fd, const char *topic, const uint32_t id) {
+
+    Buffer *in  = buf_init(READ_CHUNK);
+    bool    eof = false;
+    Window  w   = {.counts = calloc(window, sizeof(uint32_t))};
+    for (;;) {
+        uint32_t n = buildBatch(in, topic, id, w.sent, eof);
+        if (n > 0) {
+            if (!proto_send(brokerfd, outbuf)) {
+                perror("error sending messages");
+                break;
+            }
+            w.counts[w.sent++ % window] = n;
+
+            if (w.sent - w.acked == window)
+                waitAck(&w);
             continue;
         }
 
-        printf("Message sent to broker\n");
+        if (eof)
+            break;
+
+        // no whole line left, wait for more input
+        if (!buf_reserve(in, READ_CHUNK))
+            perror_and_exit("could not grow buffer");
+        ssize_t r = read(fd, in->data + in->end, in->cap - in->end);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1)
+            perror("error reading input");
+        if (r <= 0)
+            eof = true;
+        else
+            in->end += r;
     }
+
+    while (w.acked < w.sent)
+        waitAck(&w);
+
+    if (w.stored > 0)
+        printf("%lu messages stored with IDs %lu to %lu\n", (unsigned long)w.stored, (unsigned long)w.first,
+               (unsigned long)w.last);
+    if (w.failed > 0)
+        printf(RED "%lu messages were not stored" RST "\n", (unsigned long)w.failed);
+
+    bool ok = (w.failed == 0 && buf_len(in) == 0);
+    free(w.counts);
+    buf_free(in);
+
+    return ok;
 }
 
-static void connBroker(const char *addr) {
+/**
+ * Moves whole lines from the front of in into a batch, one
+ * message per line without the newline. The last line is
+ * only taken without a newline once eof is set, and a line
+ * longer than MSG_MAXLEN is split over several messages.
+ *
+ * Returns the number of messages in the batch.
+ */
+static uint32_t buildBatch(Buffer *in, const char *topic, const uint32_t id, const uint64_t batch, const bool eof) {
+
+    // without the broker's agreement the topic goes by name
+    uint32_t wire  = byid ? id : TOPIC_NOID;
+    uint16_t flags = (packed ? FLAG_LZ : 0) | ((wire != TOPIC_NOID) ? FLAG_ID : 0);
+    size_t   pos   = proto_begin(outbuf, OP_PUBLISH_BATCH, flags);
+    proto_putTopic(outbuf, topic, wire);
+    proto_putU64(outbuf, batch);
+    size_t countpos = buf_len(outbuf);
+    proto_putU32(outbuf, 0); // filled in at the end
+
+    uint32_t n = 0;
+    while (n < BATCH_MAX_MSGS && buf_len(in) > 0) {
+        const char *line  = buf_peek(in);
+        size_t      avail = buf_len(in);
+        const char *nl    = memchr(line, '\n', (avail < MSG_MAXLEN) ? avail : MSG_MAXLEN);
+
+        size_t len;
+        if (nl != NULL)
+            len = nl - line;
+        else if (avail >= MSG_MAXLEN || eof)
+            len = (avail < MSG_MAXLEN) ? avail : MSG_MAXLEN;
+        else
+            break; // rest of the line is still to be read
+
+        // a batch always takes its first message, however long
+        if (n > 0 && buf_len(outbuf) - pos + len >= BATCH_MAX_BYTES)
+            break;
+
+        proto_putU32(outbuf, len);
+        proto_putBytes(outbuf, line, len);
+        buf_consume(in, len + (nl != NULL));
+        n++;
+    }
 
-    // create socket
-    if ((brokerfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-        perror_and_exit("could not create socket");
+    if (n == 0) {
+        buf_consume(outbuf, buf_len(outbuf));
+        return 0;
+    }
 
-    // setup address structure
-    struct sockaddr_in brokeraddr = {
-        .sin_family = AF_INET,
-        .sin_port   = htons(BROKER_PUB_PORT),
-    };
-    inet_pton(AF_INET, addr, &brokeraddr.sin_addr);
+    proto_setU32(outbuf, countpos, n);
+
+    // the entries are replaced by their length and a single block, the broker keeps it that way
+    if (packed) {
+        size_t   entries = countpos + sizeof(uint32_t);
+        uint32_t raw     = buf_len(outbuf) - entries;
+        if (!buf_reserve(lzbuf, lz_bound(raw)))
+            perror_and_exit("could not grow buffer");
+        size_t len = lz_compress(buf_peek(outbuf) + entries, raw, lzbuf->data + lzbuf->end);
+        buf_truncate(outbuf, entries);
+        proto_putU32(outbuf, raw);
+        proto_putBytes(outbuf, lzbuf->data + lzbuf->end, len);
+    }
+
+    proto_end(outbuf, pos);
+
+    return n;
+}
+
+/**
+ * Publishes all of fd as a single message, bytes as they are.
+ * A message larger than CHUNK_LEN goes out in pieces, read
+ * one at a time, so the input never has to fit in memory; a
+ * broker that does not take pieces only takes MSG_MAXLEN.
+ *
+ * Returns false if the message was not stored.
+ */
+static bool publishWhole(const int fd, const char *topic, const uint32_t id) {
+
+    // a piece only goes out once more input shows it is not the last
+    size_t  piece = chunked ? CHUNK_LEN : MSG_MAXLEN;
+    Buffer *in    = buf_init(piece + 1);
+    size_t  sent  = 0;
+    bool    eof   = false;
+    bool    ok    = true;
+    while (ok) {
+        while (!eof && buf_len(in) <= piece) {
+            if (!buf_reserve(in, piece + 1 - buf_len(in)))
+                perror_and_exit("could not grow buffer");
+            ssize_t r = read(fd, in->data + in->end, piece + 1 - buf_len(in));
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r == -1) {
+                perror("error reading input");
+                ok = false;
+            }
+            if (r <= 0)
+                eof = true;
+            else
+                in->end += r;
+        }
+        if (!ok)
+            break;
+
+        bool more = buf_len(in) > piece;
+        if ((more && !chunked) || sent + buf_len(in) > CHUNK_MAXLEN) {
+            printf(RED "Input is too large for a single message" RST "\n");
+            ok = false;
+            break;
+        }
+
+        size_t len = more ? piece : buf_len(in);
+        ok         = publish(topic, id, buf_peek(in), len, more);
+        buf_consume(in, len);
+        sent += len;
+        if (!more)
+            break;
+    }
+
+    buf_free(in);
+    return ok;
+}
+
+// settles the oldest batch in flight, and any acknowledged along with it
+static void waitAck(Window *w) {
 
-    // connect
-    if (connect(brokerfd, (struct sockaddr *)&brokeraddr, sizeof brokeraddr) == -1)
+    Frame f;
+    if (!proto_recv(brokerfd, inbuf, &f)) {
+        printf(RED "Lost connection to broker" RST "\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Reader r = proto_reader(&f);
+    if (f.opcode == OP_BATCH_ACK) {
+        uint64_t batch = proto_getU64(&r);
+        uint64_t first = proto_getU64(&r);
+        uint32_t count = proto_getU32(&r);
+
+        // acks are cumulative, everything up to this batch is settled
+        for (; w->acked < w->sent && w->acked < batch; w->acked++)
+            w->failed += w->counts[w->acked % window];
+        if (w->stored == 0)
+            w->first = first;
+        w->last = first + count - 1;
+        w->stored += count;
+        w->acked = batch + 1;
+    } else {
+        Owner o;
+        if (f.opcode == OP_ERROR) {
+            proto_getU16(&r);
+            printf(RED "Broker error: %.*s" RST "\n", (int)r.left, r.p);
+        } else if (f.opcode == OP_OWNER && proto_getOwner(&r, &o)) {
+            printf(RED "Topic has moved to %s:%u" RST "\n", o.host, o.pubport);
+        }
+        w->failed += w->counts[w->acked++ % window];
+    }
+
+    proto_consume(inbuf, &f);
+}
+
+// publishes a message, or a piece of one if more is set, which goes unanswered
+static bool publish(const char *topic, const uint32_t id, const char *msg, const size_t len, const bool more) {
+
+    uint32_t wire  = byid ? id : TOPIC_NOID;
+    uint16_t flags = ((wire != TOPIC_NOID) ? FLAG_ID : 0) | (more ? FLAG_MORE : 0);
+    size_t   pos   = proto_begin(outbuf, OP_PUBLISH, flags);
+    proto_putTopic(outbuf, topic, wire);
+    proto_putBytes(outbuf, msg, len);
+    proto_end(outbuf, pos);
+
+    if (!proto_send(brokerfd, outbuf)) {
+        perror("error sending message");
+        return false;
+    }
+    if (more)
+        return true;
+
+    // the broker acknowledges with the id of the stored message
+    Frame f;
+    if (!proto_recv(brokerfd, inbuf, &f)) {
+        printf(RED "Lost connection to broker" RST "\n");
+        exit(EXIT_FAILURE);
+    }
+
+    bool   ok = (f.opcode == OP_ACK);
+    Reader r  = proto_reader(&f);
+    if (ok) {
+        printf("Message stored with ID %lu\n", (unsigned long)proto_getU64(&r));
+    } else if (f.opcode == OP_ERROR) {
+        proto_getU16(&r);
+        printf(RED "Broker error: %.*s" RST "\n", (int)r.left, r.p);
+    } else if (f.opcode == OP_OWNER) {
+        printf(RED "Topic has just moved, send again" RST "\n");
+    }
+
+    proto_consume(inbuf, &f);
+    return ok;
+}
+
+static void connBroker() {
+
+    if ((brokerfd = proto_connect(&broker, false)) == -1)
         perror_and_exit("Connect error");
 
-    printf("Connected to broker\n");
+    if (proto_isUnix(&broker))
+        printf("Connected to broker at %s\n", broker.host);
+    else
+        printf("Connected to broker at %s:%u\n", broker.host, broker.pubport);
+
+    int64_t got = proto_hello(brokerfd, outbuf, inbuf, FEAT_IDS | FEAT_CHUNKS | FEAT_SHM | (compress ? FEAT_LZ : 0));
+    if (got == -1)
+        perror_and_exit("could not reach broker");
+    packed  = got & FEAT_LZ;
+    byid    = got & FEAT_IDS;
+    chunked = got & FEAT_CHUNKS;
+    if (compress && !packed)
+        printf(YEL "Broker does not take compressed batches, sending them as they are" RST "\n");
+}
+
+// moves the connection over to the broker that owns a topic, if it is another one
+static void findOwner(const char *topic) {
+
+    for (int i = 0; i < FOLLOW_MAX; i++) {
+        Owner o;
+        if (!proto_locate(brokerfd, outbuf, inbuf, topic, &o)) {
+            printf(RED "Lost connection to broker" RST "\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (o.host[0] == '\0' || (strcmp(o.host, broker.host) == 0 && o.pubport == broker.pubport))
+            return;
+
+        proto_close(brokerfd);
+        broker = o;
+        connBroker();
+    }
+}
+
+// id of a topic at the broker connected to, registering it first if create is set
+static uint32_t topicId(const char *topic, const bool create) {
+
+    int64_t id = proto_topicId(brokerfd, outbuf, inbuf, topic, create);
+    if (id == -1) {
+        printf(RED "Lost connection to broker" RST "\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return id;
 }
 
 static void handlerSIGPIPE(int sig) {
@@ -1,34 +1,65 @@
 #include "Broker/broker.h"
+#include "Utils/proto.h"
+#include "Utils/trie.h"
 #include "Utils/utils.h"
 #include "Utils/vector.h"
 
-#define OUT         "subscriber"
-#define TOPICS_FILE "data/topics.txt"
-
-static Vector       *topics;
-static int           brokerfd;
-static char          subscribed[TMP_BUFLEN];
-static unsigned long last_seen;
-
-static void    usage();
-static void    connBroker(const char *addr);
-static void    handlerSIGPIPE(int sig);
-static void    subscribe();
-static bool    retrieveOne();
-static void    retrieveAll();
-static Vector *loadTopics(const char *topics_file);
-static void    viewTopics(const Vector *topics);
-static bool    validateTopic(const char *topic);
+#define OUT "subscriber"
+
+#define FETCH_MAX_MSGS  16384     // messages asked for per batch
+#define FETCH_MAX_BYTES (8 << 20) // bytes asked for per batch
+#define FOLLOW_MAX      1         // redirects followed when looking for the owner of a topic
+#define STREAM_CREDIT   (1 << 20) // bytes of pushes the broker may have in flight
+
+static int        brokerfd;
+static Owner      broker; // address brokerfd is connected to
+static Buffer    *outbuf;
+static Buffer    *inbuf;
+static Buffer    *rawbuf;   // messages of a compressed batch
+static bool       packed;   // the broker may send batches compressed
+static bool       metered;  // the broker takes credit for pushes
+static bool       byid;     // the broker takes topics by id
+static Hashtable *consumed; // topic -> bytes pushed since credit was last granted (in the void *)
+static char       subscribed[TMP_BUFLEN];
+static uint32_t   topic_id = TOPIC_NOID; // of the subscribed topic at this broker, TOPIC_NOID to go by name
+static uint64_t   next_id;               // id of the next message to retrieve
+static uint64_t   next_off;              // bytes of it already retrieved, when it comes in pieces
+static bool       midmsg;                // the message printed last has more pieces to come
+static bool       followed;              // moved on an OP_OWNER during this menu choice
+
+static void     usage();
+static void     connBroker();
+static void     moveTo(const Owner *o);
+static void     findOwner(const char *topic);
+static bool     followOwner(const Frame *f);
+static bool     sendSubscribe();
+static bool     sendJoin(const char *group);
+static void     grant(const char *topic, const size_t len);
+static void     resetCredit();
+static void     handlerSIGPIPE(int sig);
+static void     subscribe();
+static bool     retrieveOne();
+static void     gotMessage(const Frame *f, Reader *r);
+static void     printMsg(const char *topic, const uint64_t id, const Reader *r, const bool more);
+static uint32_t retrieveBatch();
+static void     retrieveAll();
+static void     stream();
+static void     joinGroup();
+static void     commit(const char *group, uint64_t *done, const uint32_t nparts);
+static void     viewTopics();
+static bool     validateTopic(const char *topic);
 
 int main(int argc, char **argv) {
 
-    if (argc != 2)
+    if (argc != 2 || !proto_parseAddr(argv[1], &broker))
         usage();
 
     subscribed[0] = '\0';
 
-    connBroker(argv[1]);
-    topics = loadTopics(TOPICS_FILE);
+    outbuf = buf_init(BUF_START_SIZE);
+    inbuf  = buf_init(BUF_START_SIZE);
+    rawbuf = buf_init(BUF_START_SIZE);
+    connBroker();
 
     // setup sigpipe handler
     struct sigaction sa;
@@ -43,14 +74,17 @@ int main(int argc, char **argv) {
         printf("1. Subscribe to a topic\n");
         printf("2. Retrieve a message\n");
         printf("3. Retrieve all messages\n");
-        printf("4. View all topics\n");
+        printf("4. Stream messages (until interrupted)\n");
+        printf("5. View all topics\n");
+        printf("6. Share the topic with a consumer group (until interrupted)\n");
         printf("Enter choice: ");
         scanf("%d", &choice);
+        followed = false;
 
         switch (choice) {
 
         case 0:
-            close(brokerfd);
+            proto_close(brokerfd);
             exit(EXIT_SUCCESS);
 
         case 1:
@@ -67,7 +101,15 @@ int main(int argc, char **argv) {
             break;
 
         case 4:
-            viewTopics(topics);
+            stream();
+            break;
+
+        case 5:
+            viewTopics();
+            break;
+
+        case 6:
+            joinGroup();
             break;
 
         default:
@@ -79,28 +121,57 @@ int main(int argc, char **argv) {
 }
 
 static void usage() {
-    printf("Usage: " OUT " <broker address>\n");
+    printf("Usage: " OUT " <broker address>[:<publisher port>] | unix:<socket path>\n");
     exit(EXIT_FAILURE);
 }
 
-static void connBroker(const char *addr) {
+static void connBroker() {
 
-    // create socket
-    if ((brokerfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-        perror_and_exit("could not create socket");
+    if ((brokerfd = proto_connect(&broker, true)) == -1)
+        perror_and_exit("Connect error");
 
-    // setup address structure
-    struct sockaddr_in brokeraddr = {
-        .sin_family = AF_INET,
-        .sin_port   = htons(BROKER_SUB_PORT),
-    };
-    inet_pton(AF_INET, addr, &brokeraddr.sin_addr);
+    if (proto_isUnix(&broker))
+        printf("Connected to broker at %s\n", broker.host);
+    else
+        printf("Connected to broker at %s:%u\n", broker.host, broker.pubport);
+
+    // decompressing costs less than the bytes it saves
+    int64_t got = proto_hello(brokerfd, outbuf, inbuf, FEAT_LZ | FEAT_CREDIT | FEAT_IDS | FEAT_CHUNKS | FEAT_SHM);
+    if (got == -1)
+        perror_and_exit("could not reach broker");
+    packed  = got & FEAT_LZ;
+    metered = got & FEAT_CREDIT;
+    byid    = got & FEAT_IDS;
+}
 
-    // connect
-    if (connect(brokerfd, (struct sockaddr *)&brokeraddr, sizeof brokeraddr) == -1)
-        perror_and_exit("Connect error");
+// reconnects to another broker, dropping whatever was in flight
+static void moveTo(const Owner *o) {
 
-    printf("Connected to broker\n");
+    proto_close(brokerfd);
+    buf_consume(inbuf, buf_len(inbuf));
+    buf_consume(outbuf, buf_len(outbuf));
+
+    // topic ids belong to the broker that gave them out
+    broker   = *o;
+    topic_id = TOPIC_NOID;
+    connBroker();
+}
+
+// moves the connection over to the broker that owns a topic, if it is another one
+static void findOwner(const char *topic) {
+
+    for (int i = 0; i < FOLLOW_MAX; i++) {
+        Owner o;
+        if (!proto_locate(brokerfd, outbuf, inbuf, topic, &o)) {
+            printf(RED "Lost connection to broker" RST "\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (o.host[0] == '\0' || (strcmp(o.host, broker.host) == 0 && o.pubport == broker.pubport))
+            return;
+
+        moveTo(&o);
+    }
 }
 
 static void handlerSIGPIPE(int sig) {
@@ -114,7 +185,7 @@ static void subscribe() {
 
     flushstdin();
 
-    printf("\nTopic name (max 512 characters): ");
+    printf("\nTopic name (max 255 characters): ");
     if (readLine(stdin, subscribed, TMP_BUFLEN) == NULL)
         return;
 
@@ -124,93 +195,502 @@ static void subscribe() {
         return;
     }
 
-    last_seen = 0;
+    next_id  = 0;
+    next_off = 0;
     printf("Subscribed to %s\n", subscribed);
+    if (trie_isPattern(subscribed))
+        printf("Topics matching a pattern can only be streamed\n");
 }
 
 static bool retrieveOne() {
 
-    // tell the broker which topic we are subscribed to
-    if (write(brokerfd, &subscribed, TMP_BUFLEN) == -1) {
-        perror("error retrieving message");
-        return false;
+    // a message that comes in pieces takes a fetch per piece
+    bool newmsg = false;
+    do {
+        // ask for the message after the last one we saw, or for the rest of it
+        size_t pos = proto_begin(outbuf, OP_FETCH, (topic_id != TOPIC_NOID) ? FLAG_ID : 0);
+        proto_putTopic(outbuf, subscribed, topic_id);
+        proto_putU64(outbuf, next_id);
+        if (next_off > 0)
+            proto_putU64(outbuf, next_off);
+        proto_end(outbuf, pos);
+        if (!proto_send(brokerfd, outbuf)) {
+            perror("error retrieving message");
+            return false;
+        }
+
+        Frame f;
+        if (!proto_recv(brokerfd, inbuf, &f)) {
+            printf(RED "Lost connection to broker" RST "\n");
+            exit(EXIT_FAILURE);
+        }
+
+        Reader r = proto_reader(&f);
+        if (f.opcode == OP_MSG) {
+            gotMessage(&f, &r);
+            newmsg = true;
+            proto_consume(inbuf, &f);
+            continue;
+        }
+
+        // the message is fetched from its start next time
+        if (midmsg)
+            printf("\n");
+        midmsg   = false;
+        next_off = 0;
+
+        switch (f.opcode) {
+
+        case OP_ERROR:
+            proto_getU16(&r);
+            printf(RED "Broker error: %.*s" RST "\n", (int)r.left, r.p);
+            break;
+
+        case OP_OWNER:
+            if (followOwner(&f))
+                return false;
+            break;
+        }
+
+        proto_consume(inbuf, &f);
+    } while (next_off > 0);
+
+    return newmsg;
+}
+
+// prints a fetched message, or a piece of it, and moves past it
+static void gotMessage(const Frame *f, Reader *r) {
+
+    uint64_t id   = proto_getU64(r);
+    bool     more = f->flags & FLAG_MORE;
+
+    // a message that expired before all its pieces came is cut short, the oldest one left starts over
+    uint64_t at = (id == next_id) ? next_off : 0;
+    if (midmsg && at == 0) {
+        printf("\n");
+        midmsg = false;
     }
 
-    // tell the broker the timestamp of the last seen message
-    if (write(brokerfd, &last_seen, sizeof last_seen) == -1) {
-        perror("error retrieving message");
-        return false;
+    printMsg(NULL, id, r, more);
+    next_id  = more ? id : id + 1;
+    next_off = more ? at + r->left : 0;
+}
+
+// prints a message as it is, or a piece of one: the first piece starts it, the last ends it
+static void printMsg(const char *topic, const uint64_t id, const Reader *r, const bool more) {
+
+    if (!midmsg) {
+        printf("\n");
+        if (topic != NULL)
+            printf("Topic: %s\n", topic);
+        printf("Message ID: %lu\n", (unsigned long)id);
+        printf("Message: ");
+    }
+    fwrite(r->p, 1, r->left, stdout);
+    if (!more)
+        printf("\n");
+    midmsg = more;
+}
+
+// returns the number of messages received
+static uint32_t retrieveBatch() {
+
+    size_t pos = proto_begin(outbuf, OP_FETCH_BATCH, (packed ? FLAG_LZ : 0) | ((topic_id != TOPIC_NOID) ? FLAG_ID : 0));
+    proto_putTopic(outbuf, subscribed, topic_id);
+    proto_putU64(outbuf, next_id);
+    proto_putU32(outbuf, FETCH_MAX_MSGS);
+    proto_putU32(outbuf, FETCH_MAX_BYTES);
+    proto_end(outbuf, pos);
+    if (!proto_send(brokerfd, outbuf)) {
+        perror("error retrieving messages");
+        return 0;
+    }
+
+    Frame f;
+    if (!proto_recv(brokerfd, inbuf, &f)) {
+        printf(RED "Lost connection to broker" RST "\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t count = 0;
+    Reader   r     = proto_reader(&f);
+    switch (f.opcode) {
+
+    case OP_BATCH: {
+        uint64_t id = proto_getU64(&r);
+        count       = proto_getU32(&r);
+        for (uint32_t i = 0; i < count && !r.err;) {
+            uint32_t len = proto_getU32(&r);
+            uint32_t n   = proto_getU32(&r); // messages in a compressed entry
+            proto_getU64(&r);
+            const char *msg = proto_getBytes(&r, len);
+            if (msg == NULL)
+                break;
+
+            // a compressed entry is a whole batch, read like one sent as it is
+            Reader m = {.p = msg, .left = len};
+            if (n > 0) {
+                buf_consume(rawbuf, buf_len(rawbuf));
+                if (!proto_unpack(msg, len, n, rawbuf)) {
+                    printf(RED "Malformed compressed batch" RST "\n");
+                    break;
+                }
+                m = (Reader){.p = buf_peek(rawbuf), .left = buf_len(rawbuf)};
+            }
+
+            for (uint32_t j = 0; j < ((n > 0) ? n : 1); j++, i++, id++) {
+                uint32_t    mlen = (n > 0) ? proto_getU32(&m) : len;
+                const char *mp   = proto_getBytes(&m, mlen);
+                printMsg(NULL, id, &(Reader){.p = mp, .left = (mp != NULL) ? mlen : 0}, false);
+            }
+        }
+        next_id = id;
+        break;
+    }
+
+    // a message too large for any batch comes on its own, the rest of its pieces are fetched one at a time
+    case OP_MSG:
+        gotMessage(&f, &r);
+        count = 1;
+        break;
+
+    case OP_ERROR:
+        proto_getU16(&r);
+        printf(RED "Broker error: %.*s" RST "\n", (int)r.left, r.p);
+        break;
+
+    case OP_OWNER:
+        if (followOwner(&f))
+            return 0;
+        break;
+    }
+
+    proto_consume(inbuf, &f);
+    if (next_off > 0)
+        retrieveOne();
+
+    return count;
+}
+
+static void retrieveAll() {
+
+    // a whole batch per round trip
+    while (retrieveBatch() > 0)
+        ;
+    printf("\nNo more messages\n");
+}
+
+// subscribes once, then the broker pushes every message as it is published
+static void stream() {
+
+    if (!sendSubscribe())
+        return;
+
+    printf("Streaming %s, press Ctrl-C to stop\n", subscribed);
+
+    // the connection stays subscribed, so there is no going back to the menu
+    for (;;) {
+        Frame f;
+        if (!proto_recv(brokerfd, inbuf, &f)) {
+            printf(RED "Lost connection to broker" RST "\n");
+            exit(EXIT_FAILURE);
+        }
+
+        char   topic[TOPIC_MAXLEN + 1];
+        Reader r = proto_reader(&f);
+        switch (f.opcode) {
+
+        case OP_PUSH: {
+            proto_getStr(&r, topic, sizeof topic);
+            uint64_t id   = proto_getU64(&r);
+            bool     more = f.flags & FLAG_MORE;
+            if (!more)
+                next_id = id + 1;
+            printMsg(trie_isPattern(subscribed) ? topic : NULL, id, &r, more);
+            grant(topic, r.left);
+            break;
+        }
+
+        case OP_ACK:
+            printf("Starting at message ID %lu\n", (unsigned long)proto_getU64(&r));
+            break;
+
+        case OP_ERROR:
+            proto_getU16(&r);
+            printf(RED "Broker error: %.*s" RST "\n", (int)r.left, r.p);
+            proto_consume(inbuf, &f);
+            return;
+
+        case OP_OWNER:
+            if (followOwner(&f)) {
+                if (!sendSubscribe())
+                    return;
+                continue;
+            }
+            proto_consume(inbuf, &f);
+            return;
+        }
+
+        proto_consume(inbuf, &f);
     }
+}
 
-    struct msg msg;
-    ssize_t    n = read(brokerfd, &msg, sizeof msg);
-    if (n < 0) {
-        perror("error retrieving message");
+static bool sendSubscribe() {
+
+    size_t pos = proto_begin(outbuf, OP_SUBSCRIBE, 0);
+    proto_putStr(outbuf, subscribed);
+    proto_putU64(outbuf, next_id);
+    if (metered)
+        proto_putU32(outbuf, STREAM_CREDIT);
+    proto_end(outbuf, pos);
+    resetCredit();
+    if (!proto_send(brokerfd, outbuf)) {
+        perror("error subscribing");
         return false;
     }
 
-    if (msg.topic[0] == '\0')
+    return true;
+}
+
+// follows a topic that has moved to another broker, true if f is an OP_OWNER it went after
+static bool followOwner(const Frame *f) {
+
+    Owner  o;
+    Reader r = proto_reader(f);
+    if (f->opcode != OP_OWNER || !proto_getOwner(&r, &o))
         return false;
 
-    last_seen = strtoul(msg.topic, NULL, 10);
+    // being sent on again means the brokers disagree about the owner for now
+    if (followed) {
+        printf(RED "Brokers disagree on who owns %s, try again later" RST "\n", subscribed);
+        return false;
+    }
+    followed = true;
+
+    // the frame goes along with the rest of the input, and the new broker has ids of its own
+    printf(YEL "%s has moved to %s:%u" RST "\n", subscribed, o.host, o.pubport);
+    moveTo(&o);
+    next_id  = 0;
+    next_off = 0;
+    midmsg   = false;
 
-    printf("\n");
-    printf("Message ID: %s\n", msg.topic);
-    printf("Message: %s\n", msg.msg);
-    printf("\n");
     return true;
 }
 
-static void retrieveAll() {
+// joins a consumer group, the broker then pushes the messages of the partitions it gives us
+static void joinGroup() {
 
-    while (retrieveOne())
-        ;
-    printf("No more messages\n");
+    flushstdin();
+
+    char group[TMP_BUFLEN];
+    printf("\nGroup name: ");
+    if (readLine(stdin, group, TMP_BUFLEN) == NULL)
+        return;
+
+    if (!sendJoin(group))
+        return;
+
+    printf("Joined group %s of %s, press Ctrl-C to stop\n", group, subscribed);
+
+    // per partition, one past the last message printed since the last commit (0 if none)
+    uint64_t *done   = NULL;
+    uint32_t  nparts = 0;
+    for (;;) {
+        Frame f;
+
+        // commit once everything received so far has been printed
+        if (proto_parse(inbuf, &f) != 1 && done != NULL)
+            commit(group, done, nparts);
+
+        if (!proto_recv(brokerfd, inbuf, &f)) {
+            printf(RED "Lost connection to broker" RST "\n");
+            exit(EXIT_FAILURE);
+        }
+
+        char   topic[TOPIC_MAXLEN + 1];
+        Reader r = proto_reader(&f);
+        switch (f.opcode) {
+
+        case OP_ASSIGN: {
+            proto_getStr(&r, topic, sizeof topic);
+            proto_getStr(&r, topic, sizeof topic); // the group, already known
+            uint64_t generation = proto_getU64(&r);
+            uint32_t n          = proto_getU32(&r);
+            uint32_t count      = proto_getU32(&r);
+            if (n != nparts) {
+                free(done);
+                nparts = n;
+                done   = calloc(nparts, sizeof *done);
+            }
+
+            printf("\nGeneration %lu, partitions:", (unsigned long)generation);
+            for (uint32_t i = 0; i < count && !r.err; i++)
+                printf(" %u", proto_getU32(&r));
+            printf("%s\n", (count == 0) ? " none" : "");
+            break;
+        }
+
+        case OP_PUSH: {
+            proto_getStr(&r, topic, sizeof topic);
+            uint64_t id   = proto_getU64(&r);
+            bool     more = f.flags & FLAG_MORE;
+            if (nparts > 0 && !more)
+                done[id % nparts] = id + 1;
+            printMsg(NULL, id, &r, more);
+            grant(topic, r.left);
+            break;
+        }
+
+        case OP_ERROR:
+            proto_getU16(&r);
+            printf(RED "Broker error: %.*s" RST "\n", (int)r.left, r.p);
+            proto_consume(inbuf, &f);
+            free(done);
+            return;
+
+        case OP_OWNER:
+            if (followOwner(&f)) {
+                if (done != NULL)
+                    memset(done, 0, nparts * sizeof *done);
+                if (!sendJoin(group)) {
+                    free(done);
+                    return;
+                }
+                continue;
+            }
+            proto_consume(inbuf, &f);
+            free(done);
+            return;
+            break;
+        }
+
+        proto_consume(inbuf, &f);
+    }
+}
+
+static bool sendJoin(const char *group) {
+
+    size_t pos = proto_begin(outbuf, OP_JOIN, 0);
+    proto_putStr(outbuf, subscribed);
+    proto_putStr(outbuf, group);
+    if (metered)
+        proto_putU32(outbuf, STREAM_CREDIT);
+    proto_end(outbuf, pos);
+    resetCredit();
+    if (!proto_send(brokerfd, outbuf)) {
+        perror("error joining group");
+        return false;
+    }
+
+    return true;
 }
 
-static Vector *loadTopics(const char *topics_file) {
+// gives back the credit of pushes that have been printed, half the window at a time, per topic as patterns span several
+static void grant(const char *topic, const size_t len) {
 
-    FILE *fp = fopen(topics_file, "r");
-    if (fp == NULL)
-        perror_and_exit("error opening topics file");
+    if (!metered)
+        return;
 
-    Vector *vec = vec_init_ptr();
-    char    tmp[TMP_BUFLEN];
-    while (readLine(fp, tmp, TMP_BUFLEN) != NULL) {
-        char *topic = strndup(tmp, TMP_BUFLEN);
-        vec_pushBack(vec, &topic);
+    void **n = ht_lookup(consumed, &topic);
+    if (n == NULL) {
+        void *none = NULL;
+        ht_insert(&consumed, &topic, &none);
+        n = ht_lookup(consumed, &topic);
     }
 
-    fclose(fp);
+    *n = (void *)((uintptr_t)*n + len);
+    if ((uintptr_t)*n < STREAM_CREDIT / 2)
+        return;
 
-    return vec;
+    size_t pos = proto_begin(outbuf, OP_CREDIT, 0);
+    proto_putStr(outbuf, topic);
+    proto_putU32(outbuf, (uintptr_t)*n);
+    proto_end(outbuf, pos);
+    if (!proto_send(brokerfd, outbuf))
+        perror("error granting credit");
+    *n = NULL;
 }
 
-static void viewTopics(const Vector *topics) {
+// a new stream starts with a full window
+static void resetCredit() {
+    if (consumed != NULL)
+        ht_free(consumed);
+    consumed = ht_init_str_void();
+}
 
-    if (topics == NULL) {
-        printf("No topics have been added\n");
+// tells the broker which messages have been processed, per partition the last one
+static void commit(const char *group, uint64_t *done, const uint32_t nparts) {
+
+    size_t pos = proto_begin(outbuf, OP_COMMIT, 0);
+    proto_putStr(outbuf, subscribed);
+    proto_putStr(outbuf, group);
+    size_t countpos = buf_len(outbuf);
+    proto_putU32(outbuf, 0);
+
+    uint32_t n = 0;
+    for (uint32_t p = 0; p < nparts; p++) {
+        if (done[p] > 0) {
+            proto_putU64(outbuf, done[p] - 1);
+            done[p] = 0;
+            n++;
+        }
+    }
+
+    if (n == 0) {
+        buf_consume(outbuf, buf_len(outbuf));
         return;
     }
 
+    proto_setU32(outbuf, countpos, n);
+    proto_end(outbuf, pos);
+    if (!proto_send(brokerfd, outbuf))
+        perror("error committing");
+}
+
+// the topics are kept by the broker, every publisher and subscriber sees the same ones
+static void viewTopics() {
+
+    Vector *topics = vec_init_ptr();
+    if (!proto_listTopics(brokerfd, outbuf, inbuf, topics)) {
+        printf(RED "Lost connection to broker" RST "\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (vec_isEmpty(topics))
+        printf("No topics have been added\n");
+
     printf("\n");
 
     for (int i = 0; i < topics->size; i++) {
         char *topic = vec_getValAt(topics, i);
         printf("%s\n", topic);
+        free(topic);
     }
 
     printf("\n");
+    vec_free(topics);
 }
 
+/**
+ * A topic has to be registered with the broker that owns it,
+ * which is connected to, and is then fetched by its id if the
+ * broker takes them. A pattern only has to be well formed.
+ */
 static bool validateTopic(const char *topic) {
-    if (topics == NULL)
+
+    topic_id = TOPIC_NOID;
+    if (trie_isPattern(topic))
+        return trie_validName(topic, true);
+    if (!trie_validName(topic, false) || strlen(topic) > TOPIC_MAXLEN)
         return false;
 
-    for (int i = 0; i < topics->size; i++) {
-        if (strcmp(topic, vec_getValAt(topics, i)) == 0)
-            return true;
+    findOwner(topic);
+    int64_t id = proto_topicId(brokerfd, outbuf, inbuf, topic, false);
+    if (id == -1) {
+        printf(RED "Lost connection to broker" RST "\n");
+        exit(EXIT_FAILURE);
     }
+    topic_id = byid ? id : TOPIC_NOID;
 
-    return false;
+    return id != TOPIC_NOID;
 }
@@ -0,0 +1,122 @@
+#include "buffer.h"
+
+Buffer *buf_init(const size_t cap) {
+
+    Buffer *b = malloc(sizeof *b);
+
+    *b = (Buffer){
+        .data  = malloc(cap),
+        .start = 0,
+        .end   = 0,
+        .cap   = cap,
+    };
+
+    return b;
+}
+
+size_t buf_len(const Buffer *b) { return b->end - b->start; }
+
+char *buf_peek(const Buffer *b) { return b->data + b->start; }
+
+bool buf_reserve(Buffer *b, const size_t n) {
+
+    if (b->cap - b->end >= n)
+        return true;
+
+    // reclaim consumed space first
+    size_t len = buf_len(b);
+    memmove(b->data, b->data + b->start, len);
+    b->start = 0;
+    b->end   = len;
+    if (b->cap - b->end >= n)
+        return true;
+
+    size_t cap = b->cap;
+    while (cap - len < n)
+        cap *= 2;
+
+    char *data = realloc(b->data, cap);
+    if (data == NULL)
+        return false;
+
+    b->data = data;
+    b->cap  = cap;
+
+    return true;
+}
+
+bool buf_append(Buffer *b, const void *src, const size_t n) {
+
+    if (!buf_reserve(b, n))
+        return false;
+
+    memcpy(b->data + b->end, src, n);
+    b->end += n;
+
+    return true;
+}
+
+void buf_consume(Buffer *b, const size_t n) {
+
+    b->start += (n < buf_len(b)) ? n : buf_len(b);
+
+    // cheap reset once everything has been read
+    if (b->start == b->end)
+        b->start = b->end = 0;
+}
+
+void buf_truncate(Buffer *b, const size_t len) {
+    if (len < buf_len(b))
+        b->end = b->start + len;
+}
+
+ssize_t buf_readFd(Buffer *b, const int fd) {
+
+    ssize_t total = 0;
+
+    for (;;) {
+        if (!buf_reserve(b, BUF_START_SIZE))
+            return -1;
+
+        ssize_t n = read(fd, b->data + b->end, b->cap - b->end);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return (total > 0 && errno == EAGAIN) ? total : -1;
+        }
+
+        if (n == 0)
+            return total;
+
+        b->end += n;
+        total += n;
+
+        // short read, the socket has been drained
+        if (b->end < b->cap)
+            return total;
+    }
+}
+
+ssize_t buf_writeFd(Buffer *b, const int fd) {
+
+    ssize_t total = 0;
+
+    while (buf_len(b) > 0) {
+        ssize_t n = write(fd, buf_peek(b), buf_len(b));
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return (total > 0 && errno == EAGAIN) ? total : -1;
+        }
+
+        buf_consume(b, n);
+        total += n;
+    }
+
+    return total;
+}
+
+void buf_free(Buffer *b) {
+    free(b->data);
+    free(b);
+}
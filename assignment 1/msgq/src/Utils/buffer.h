@@ -0,0 +1,84 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+/**
+ * Growable byte buffer.
+ *
+ * Bytes are appended at the end and consumed from the
+ * front. Consumed space is reclaimed lazily by moving the
+ * unread bytes back to the start before growing.
+ */
+
+#define BUF_START_SIZE 4096
+
+#include "utils.h"
+
+typedef struct Buffer {
+    char  *data;  // backing storage
+    size_t start; // first unread byte
+    size_t end;   // one past the last byte
+    size_t cap;   // size of data
+} Buffer;
+
+/**
+ * Initialize a buffer.
+ * Recommended capacity is BUF_START_SIZE.
+ */
+Buffer *buf_init(const size_t cap);
+
+/**
+ * Number of unread bytes.
+ */
+size_t buf_len(const Buffer *b);
+
+/**
+ * Pointer to the first unread byte.
+ */
+char *buf_peek(const Buffer *b);
+
+/**
+ * Makes room for at least n more bytes at the end.
+ *
+ * Returns false if the allocation failed.
+ */
+bool buf_reserve(Buffer *b, const size_t n);
+
+/**
+ * Appends n bytes to the end of the buffer.
+ *
+ * Returns false if the allocation failed.
+ */
+bool buf_append(Buffer *b, const void *src, const size_t n);
+
+/**
+ * Marks n bytes at the front as read.
+ */
+void buf_consume(Buffer *b, const size_t n);
+
+/**
+ * Drops everything after the first len unread bytes.
+ */
+void buf_truncate(Buffer *b, const size_t len);
+
+/**
+ * Reads whatever is available on fd into the buffer.
+ *
+ * Returns the number of bytes read, 0 on EOF and -1 on error
+ * (errno is EAGAIN if nothing is available yet).
+ */
+ssize_t buf_readFd(Buffer *b, const int fd);
+
+/**
+ * Writes as much of the buffer to fd as it will take.
+ *
+ * Returns the number of bytes written, or -1 on error
+ * (errno is EAGAIN if fd is full).
+ */
+ssize_t buf_writeFd(Buffer *b, const int fd);
+
+/**
+ * Cleans up all allocations.
+ */
+void buf_free(Buffer *b);
+
+#endif // BUFFER_H
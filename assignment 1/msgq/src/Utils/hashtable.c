@@ -0,0 +1,175 @@
+#include "hashtable.h"
+
+u_long ht_computehash(const Hashtable *ht, const void *key) { return ht->hash_fn(key) % ht->capacity; }
+
+Hashtable *ht_init(const size_t key_width, const size_t val_width, const ht_hash hash_fn, const ht_kcopy kcopy,
+                   const ht_vcopy vcopy, const ht_kdtr kdtr, const ht_vdtr vdtr, const ht_kequal kequal,
+                   const uint capacity) {
+
+    Hashtable *ht = malloc(sizeof *ht);
+
+    // starting field values
+    *ht = (Hashtable){
+        .table     = calloc(capacity, sizeof(Bucket *)),
+        .size      = 0,
+        .capacity  = capacity,
+        .key_width = key_width,
+        .val_width = val_width,
+        .kcopy     = kcopy,
+        .vcopy     = vcopy,
+        .kdtr      = kdtr,
+        .vdtr      = vdtr,
+        .kequal    = kequal,
+        .hash_fn   = hash_fn,
+    };
+
+    return ht;
+}
+
+Hashtable *ht_init_int_void() {
+    return ht_init(sizeof(int), sizeof(void *), (ht_hash)ht_moduloHash, NULL, NULL, NULL, NULL,
+                   (ht_kequal)ht_kequal_int, HT_START_SIZE);
+}
+
+Hashtable *ht_init_uint16_void() {
+    return ht_init(sizeof(uint16_t), sizeof(void *), (ht_hash)ht_moduloHash_uint16, NULL, NULL, NULL, NULL,
+                   (ht_kequal)ht_kequal_uint16, HT_START_SIZE);
+}
+
+Hashtable *ht_init_str_void() {
+    return ht_init(sizeof(char *), sizeof(void *), (ht_hash)ht_polyRollingHash, (ht_kcopy)ht_kcopy_str, NULL,
+                   (ht_kdtr)ht_kdtr_str, NULL, (ht_kequal)ht_kequal_str, HT_START_SIZE);
+}
+
+bool ht_insert(Hashtable **ht, const void *key, const void *val) {
+
+    // dynamic resizing
+    if ((*ht)->capacity == (*ht)->size)
+        *ht = ht_grow(*ht);
+
+    (*ht)->size++;
+    uint    pos = ht_computehash(*ht, key);
+    Bucket *b   = malloc(sizeof *b);
+
+    // prepare the bucket
+    *b = (Bucket){
+        .key = malloc((*ht)->key_width),
+        .val = malloc((*ht)->val_width),
+    };
+
+    // copy the key value pair into the bucket
+    if ((*ht)->kcopy)
+        (*ht)->kcopy(b->key, key);
+    else
+        memcpy(b->key, key, (*ht)->key_width);
+    if ((*ht)->vcopy)
+        (*ht)->vcopy(b->val, val);
+    else
+        memcpy(b->val, val, (*ht)->val_width);
+
+    // add to has(*ht)able, linearly probe when collisions occur
+    for (uint i = 0; i < (*ht)->capacity; i++) {
+        if ((*ht)->table[pos] == NULL) {
+            (*ht)->table[pos] = b;
+            return true;
+        }
+
+        pos = (pos + 1 == (*ht)->capacity) ? 0 : pos + 1; // avoid modulo
+    }
+
+    return false; // could not find space (shuold not happen...)
+}
+
+void *ht_lookup(const Hashtable *ht, const void *key) {
+
+    uint pos = ht_computehash(ht, key);
+
+    // compare keys
+    for (int i = 0; i < ht->capacity; i++) {
+        if (ht->table[pos] == NULL)
+            return NULL;
+
+        if (ht->kequal && ht->kequal(key, ht->table[pos]->key))
+            return ht->table[pos]->val;
+        else if (!ht->kequal && key == ht->table[pos]->key)
+            return ht->table[pos]->val;
+
+        pos = (pos + 1 == ht->capacity) ? 0 : pos + 1;
+    }
+
+    return NULL;
+}
+
+void *ht_lookupVal(const Hashtable *ht, const void *key) {
+    void **res = ht_lookup(ht, key);
+    if (res == NULL)
+        return NULL;
+    return *res;
+}
+
+void ht_free(Hashtable *ht) {
+
+    for (int i = 0; i < ht->capacity; i++) {
+        if (ht->table[i]) {
+
+            // free key
+            if (ht->kdtr)
+                ht->kdtr(ht->table[i]->key);
+            free(ht->table[i]->key);
+
+            // free value
+            if (ht->vdtr)
+                ht->vdtr(ht->table[i]->val);
+            free(ht->table[i]->val);
+
+            // free bucket
+            free(ht->table[i]);
+        }
+    }
+
+    free(ht->table);
+    free(ht);
+}
+
+Hashtable *ht_grow(Hashtable *ht) {
+
+    // make a new hashtable twice as large
+    Hashtable *ht_bigger = ht_init(ht->key_width, ht->val_width, ht->hash_fn, ht->kcopy, ht->vcopy, ht->kdtr, ht->vdtr,
+                                   ht->kequal, ht->capacity * 2);
+
+    // add all k-v pairs into the bigger hashtable
+    for (uint i = 0; i < ht->capacity; i++) {
+        if (ht->table[i])
+            ht_insert(&ht_bigger, ht->table[i]->key, ht->table[i]->val);
+    }
+
+    // free the old hashtable
+    ht_free(ht);
+
+    return ht_bigger;
+}
+
+u_long ht_polyRollingHash(const char **key) {
+    u_long hash_value = 0;
+    // compute hash of string key using a polynomial rolling hash
+    const uint p    = 53;
+    const uint m    = 1e9 + 9;
+    ulong      ppow = 1;
+    size_t     len  = strlen(*key);
+    for (size_t i = 0; i < len; i++) {
+        hash_value = (hash_value + ((*key)[i] - 'a' + 1) * ppow) % m;
+        ppow       = (ppow * p) % m;
+    }
+
+    return hash_value;
+}
+
+u_long ht_moduloHash(int *key) { return *key % (1000000009); }
+u_long ht_moduloHash_uint16(uint16_t *key) { return *key % (1000000009); }
+
+bool ht_kequal_int(int *k1, int *k2) { return (*k1 == *k2); }
+bool ht_kequal_uint16(uint16_t *k1, uint16_t *k2) { return (*k1 == *k2); }
+bool ht_kequal_str(const char **k1, const char **k2) { return (strcmp(*k1, *k2) == 0); }
+
+void ht_kcopy_str(char **dest, const char **src) { *dest = strdup(*src); }
+void ht_kdtr_str(char **p) { free(*p); }
@@ -0,0 +1,158 @@
+#include "lz.h"
+
+#define HASH_BITS     14
+#define MAX_DISTANCE  UINT16_MAX
+#define LAST_LITERALS 5  // a block always ends in this many literals
+#define MATCH_LIMIT   12 // no match starts this close to the end
+#define SKIP_SHIFT    6  // misses before the step grows by one byte
+
+static uint32_t read32(const uint8_t *p);
+static uint32_t hash(const uint32_t v);
+static uint8_t *putLen(uint8_t *op, size_t len);
+static uint8_t *putSeq(uint8_t *op, const uint8_t *lit, const size_t nlit, const size_t dist, const size_t mlen);
+static bool     getLen(const uint8_t **ip, const uint8_t *end, size_t *len);
+
+size_t lz_bound(const size_t n) { return n + n / 255 + 16; }
+
+size_t lz_compress(const char *src, const size_t n, char *dst) {
+
+    const uint8_t *in     = (const uint8_t *)src;
+    const uint8_t *end    = in + n;
+    const uint8_t *ip     = in;
+    const uint8_t *anchor = in; // first literal not yet written
+    uint8_t       *op     = (uint8_t *)dst;
+
+    // last position each hash was seen at, a stale slot is caught by comparing the bytes
+    uint32_t table[1 << HASH_BITS] = {0};
+
+    if (n > MATCH_LIMIT) {
+        const uint8_t *limit = end - MATCH_LIMIT;
+        const uint8_t *mend  = end - LAST_LITERALS;
+        while (ip < limit) {
+            uint32_t       v   = read32(ip);
+            uint32_t       h   = hash(v);
+            const uint8_t *ref = in + table[h];
+            table[h]           = ip - in;
+
+            if (ref >= ip || ip - ref > MAX_DISTANCE || read32(ref) != v) {
+                ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+                continue;
+            }
+
+            const uint8_t *mp = ip + LZ_MIN_MATCH;
+            const uint8_t *rp = ref + LZ_MIN_MATCH;
+            while (mp < mend && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            op = putSeq(op, anchor, ip - anchor, ip - ref, mp - ip);
+            ip = anchor = mp;
+        }
+    }
+
+    // whatever is left goes out as literals
+    size_t nlit = end - anchor;
+    *op++       = ((nlit >= 15) ? 15 : nlit) << 4;
+    if (nlit >= 15)
+        op = putLen(op, nlit - 15);
+    memcpy(op, anchor, nlit);
+    op += nlit;
+
+    return op - (uint8_t *)dst;
+}
+
+ssize_t lz_decompress(const char *src, const size_t n, char *dst, const size_t cap) {
+
+    const uint8_t *ip   = (const uint8_t *)src;
+    const uint8_t *end  = ip + n;
+    uint8_t       *out  = (uint8_t *)dst;
+    uint8_t       *op   = out;
+    uint8_t       *oend = out + cap;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+
+        size_t nlit = token >> 4;
+        if (nlit == 15 && !getLen(&ip, end, &nlit))
+            return -1;
+        if (nlit > (size_t)(end - ip) || nlit > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+
+        // the last sequence stops after its literals
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        size_t dist = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        size_t mlen = token & 15;
+        if (mlen == 15 && !getLen(&ip, end, &mlen))
+            return -1;
+        mlen += LZ_MIN_MATCH;
+        if (dist == 0 || dist > (size_t)(op - out) || mlen > (size_t)(oend - op))
+            return -1;
+
+        // a match may overlap the bytes it is producing
+        const uint8_t *ref = op - dist;
+        if (dist >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            while (mlen-- > 0)
+                *op++ = *ref++;
+        }
+    }
+
+    return op - out;
+}
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint32_t hash(const uint32_t v) { return (v * 2654435761u) >> (32 - HASH_BITS); }
+
+static uint8_t *putLen(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+static uint8_t *putSeq(uint8_t *op, const uint8_t *lit, const size_t nlit, const size_t dist, const size_t mlen) {
+
+    size_t ml = mlen - LZ_MIN_MATCH;
+    *op++     = ((nlit >= 15) ? 15 : nlit) << 4 | ((ml >= 15) ? 15 : ml);
+    if (nlit >= 15)
+        op = putLen(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    *op++ = dist & 0xff;
+    *op++ = dist >> 8;
+    if (ml >= 15)
+        op = putLen(op, ml - 15);
+
+    return op;
+}
+
+static bool getLen(const uint8_t **ip, const uint8_t *end, size_t *len) {
+
+    uint8_t c;
+    do {
+        if (*ip == end)
+            return false;
+        c = *(*ip)++;
+        *len += c;
+    } while (c == 255);
+
+    return true;
+}
@@ -0,0 +1,49 @@
+#ifndef LZ_H
+#define LZ_H
+
+/**
+ * LZ77 block compression, laid out like LZ4 blocks.
+ *
+ * A block is a series of sequences, each a run of literal
+ * bytes followed by a match (a copy of earlier output). A
+ * sequence starts with a token: the number of literals in the
+ * high nibble and the match length less LZ_MIN_MATCH in the
+ * low one. A nibble of 15 is continued in the bytes that
+ * follow, which add to it up to and including the first one
+ * below 255. Next come the literals, the u16 little endian
+ * distance back to the match and any more bytes of its
+ * length. The last sequence has literals only.
+ *
+ * The compressor probes a single hash slot per position and
+ * skips ahead faster the longer it goes without a match, so it
+ * costs little more than a copy on data that does not shrink.
+ */
+
+#include "utils.h"
+
+#define LZ_MIN_MATCH 4
+
+/**
+ * Largest block n bytes can compress to.
+ */
+size_t lz_bound(const size_t n);
+
+/**
+ * Compresses n bytes of src into dst, which must have room
+ * for lz_bound(n) bytes.
+ *
+ * Returns the size of the block.
+ */
+size_t lz_compress(const char *src, const size_t n, char *dst);
+
+/**
+ * Decompresses a block of n bytes into dst, writing at most
+ * cap bytes. Never reads or writes out of bounds, whatever the
+ * input.
+ *
+ * Returns the number of bytes written, or -1 if the block is
+ * malformed or does not fit.
+ */
+ssize_t lz_decompress(const char *src, const size_t n, char *dst, const size_t cap);
+
+#endif // LZ_H
@@ -0,0 +1,501 @@
+#include "proto.h"
+
+#include <endian.h>
+#include <poll.h>
+
+#define LINK_MAXFD   1024 // connections on higher fds stay on their socket
+#define LINK_POLL_MS 100  // how often a client asleep on a channel checks the socket
+
+static Shm *links[LINK_MAXFD]; // fd -> shared-memory channel of the connection, NULL if none
+
+static bool sendShm(const int fd, Shm *s, Buffer *b);
+static bool recvShm(const int fd, Shm *s, Buffer *b, Frame *f);
+static bool waitShm(const int fd, ShmRing *r, const bool reading);
+static bool ring(const int fd);
+
+int proto_decode(const char *p, const size_t n, Frame *f) {
+
+    if (n < FRAME_HDR_LEN)
+        return 0;
+
+    uint16_t flags;
+    uint32_t len;
+    memcpy(&flags, p + 2, sizeof flags);
+    memcpy(&len, p + 4, sizeof len);
+
+    *f = (Frame){
+        .opcode = (uint8_t)p[1],
+        .flags  = be16toh(flags),
+        .len    = be32toh(len),
+        .data   = p + FRAME_HDR_LEN,
+        .raw    = p,
+    };
+
+    if ((uint8_t)p[0] != PROTO_VERSION || f->len > FRAME_MAX_LEN)
+        return -1;
+
+    return (n - FRAME_HDR_LEN >= f->len) ? 1 : 0;
+}
+
+int proto_parse(const Buffer *b, Frame *f) { return proto_decode(buf_peek(b), buf_len(b), f); }
+
+void proto_consume(Buffer *b, const Frame *f) { buf_consume(b, FRAME_HDR_LEN + f->len); }
+
+size_t proto_begin(Buffer *b, const uint8_t opcode, const uint16_t flags) {
+
+    size_t pos = buf_len(b);
+
+    // the payload length is filled in by proto_end()
+    proto_putU8(b, PROTO_VERSION);
+    proto_putU8(b, opcode);
+    proto_putU16(b, flags);
+    proto_putU32(b, 0);
+
+    return pos;
+}
+
+void proto_end(Buffer *b, const size_t pos) { proto_endWith(b, pos, 0); }
+
+void proto_endWith(Buffer *b, const size_t pos, const size_t n) {
+    proto_setU32(b, pos + 4, buf_len(b) - pos - FRAME_HDR_LEN + n);
+}
+
+void proto_setU32(Buffer *b, const size_t pos, const uint32_t v) {
+    uint32_t be = htobe32(v);
+    memcpy(buf_peek(b) + pos, &be, sizeof be);
+}
+
+void proto_putU8(Buffer *b, const uint8_t v) { proto_putBytes(b, &v, sizeof v); }
+
+void proto_putU16(Buffer *b, const uint16_t v) {
+    uint16_t be = htobe16(v);
+    proto_putBytes(b, &be, sizeof be);
+}
+
+void proto_putU32(Buffer *b, const uint32_t v) {
+    uint32_t be = htobe32(v);
+    proto_putBytes(b, &be, sizeof be);
+}
+
+void proto_putU64(Buffer *b, const uint64_t v) {
+    uint64_t be = htobe64(v);
+    proto_putBytes(b, &be, sizeof be);
+}
+
+void proto_putBytes(Buffer *b, const void *p, const size_t n) {
+    if (!buf_append(b, p, n))
+        perror_and_exit("could not grow buffer");
+}
+
+void proto_putStr(Buffer *b, const char *s) {
+    size_t n = strnlen(s, UINT16_MAX);
+    proto_putU16(b, n);
+    proto_putBytes(b, s, n);
+}
+
+void proto_putTopic(Buffer *b, const char *topic, const uint32_t id) {
+    if (id != TOPIC_NOID)
+        proto_putU32(b, id);
+    else
+        proto_putStr(b, topic);
+}
+
+void proto_error(Buffer *b, const uint16_t code, const char *reason) {
+
+    size_t pos = proto_begin(b, OP_ERROR, 0);
+    proto_putU16(b, code);
+    proto_putBytes(b, reason, strlen(reason));
+    proto_end(b, pos);
+}
+
+Reader proto_reader(const Frame *f) { return (Reader){.p = f->data, .left = f->len}; }
+
+const char *proto_getBytes(Reader *r, const size_t n) {
+
+    if (r->err || r->left < n) {
+        r->err = true;
+        return NULL;
+    }
+
+    const char *p = r->p;
+    r->p += n;
+    r->left -= n;
+
+    return p;
+}
+
+uint8_t proto_getU8(Reader *r) {
+    const char *p = proto_getBytes(r, sizeof(uint8_t));
+    return (p == NULL) ? 0 : (uint8_t)*p;
+}
+
+uint16_t proto_getU16(Reader *r) {
+    uint16_t    v = 0;
+    const char *p = proto_getBytes(r, sizeof v);
+    if (p != NULL)
+        memcpy(&v, p, sizeof v);
+    return be16toh(v);
+}
+
+uint32_t proto_getU32(Reader *r) {
+    uint32_t    v = 0;
+    const char *p = proto_getBytes(r, sizeof v);
+    if (p != NULL)
+        memcpy(&v, p, sizeof v);
+    return be32toh(v);
+}
+
+uint64_t proto_getU64(Reader *r) {
+    uint64_t    v = 0;
+    const char *p = proto_getBytes(r, sizeof v);
+    if (p != NULL)
+        memcpy(&v, p, sizeof v);
+    return be64toh(v);
+}
+
+char *proto_getStr(Reader *r, char *buf, const size_t n) {
+
+    uint16_t    len = proto_getU16(r);
+    const char *p   = proto_getBytes(r, len);
+    if (p == NULL || len >= n) {
+        r->err = true;
+        buf[0] = '\0';
+        return NULL;
+    }
+
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+
+    return buf;
+}
+
+bool proto_send(const int fd, Buffer *b) {
+
+    if (fd < LINK_MAXFD && links[fd] != NULL)
+        return sendShm(fd, links[fd], b);
+
+    while (buf_len(b) > 0) {
+        ssize_t n = write(fd, buf_peek(b), buf_len(b));
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf_consume(b, n);
+    }
+
+    return true;
+}
+
+bool proto_recv(const int fd, Buffer *b, Frame *f) {
+
+    if (fd < LINK_MAXFD && links[fd] != NULL)
+        return recvShm(fd, links[fd], b, f);
+
+    int r;
+    while ((r = proto_parse(b, f)) == 0) {
+        if (!buf_reserve(b, BUF_START_SIZE))
+            return false;
+
+        // one read at a time, the fd is blocking
+        ssize_t n = read(fd, b->data + b->end, b->cap - b->end);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        b->end += n;
+    }
+
+    return r == 1;
+}
+
+void proto_close(const int fd) {
+
+    if (fd < LINK_MAXFD && links[fd] != NULL) {
+        shm_free(links[fd]);
+        links[fd] = NULL;
+    }
+    close(fd);
+}
+
+bool proto_parseAddr(const char *spec, Owner *o) {
+
+    // a path may hold colons of its own
+    size_t plen = strlen(UNIX_PREFIX);
+    if (strncmp(spec, UNIX_PREFIX, plen) == 0) {
+        struct sockaddr_un sa;
+        if (spec[plen] == '\0' || strlen(spec) > HOST_MAXLEN || !proto_unixAddr(spec + plen, true, &sa))
+            return false;
+        snprintf(o->host, sizeof o->host, "%s", spec);
+        o->pubport = 0;
+        o->subport = 0;
+        return true;
+    }
+
+    const char *sep  = strrchr(spec, ':');
+    size_t      len  = (sep == NULL) ? strlen(spec) : (size_t)(sep - spec);
+    long        port = BROKER_PUB_PORT;
+    if (sep != NULL) {
+        char *end;
+        port = strtol(sep + 1, &end, 10);
+        if (*end != '\0')
+            return false;
+    }
+
+    long subport = BROKER_SUB_PORT + port - BROKER_PUB_PORT;
+    if (len == 0 || len > HOST_MAXLEN || port <= 0 || port > UINT16_MAX || subport <= 0 || subport > UINT16_MAX)
+        return false;
+
+    snprintf(o->host, sizeof o->host, "%.*s", (int)len, spec);
+    o->pubport = port;
+    o->subport = subport;
+
+    return true;
+}
+
+bool proto_isUnix(const Owner *o) { return strncmp(o->host, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0; }
+
+bool proto_unixAddr(const char *path, const bool sub, struct sockaddr_un *sa) {
+
+    *sa        = (struct sockaddr_un){.sun_family = AF_UNIX};
+    size_t len = snprintf(sa->sun_path, sizeof sa->sun_path, "%s%s", path, sub ? UNIX_SUB_SUFFIX : UNIX_PUB_SUFFIX);
+
+    return len < sizeof sa->sun_path;
+}
+
+int proto_connect(const Owner *o, const bool sub) {
+
+    struct sockaddr_un sun;
+    struct sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons(sub ? o->subport : o->pubport)};
+    struct sockaddr   *sa  = (struct sockaddr *)&sin;
+    socklen_t          len = sizeof sin;
+    if (proto_isUnix(o)) {
+        if (!proto_unixAddr(o->host + strlen(UNIX_PREFIX), sub, &sun)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        sa  = (struct sockaddr *)&sun;
+        len = sizeof sun;
+    } else if (inet_pton(AF_INET, o->host, &sin.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = socket(sa->sa_family, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    if (connect(fd, sa, len) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+bool proto_getOwner(Reader *r, Owner *o) {
+    proto_getStr(r, o->host, sizeof o->host);
+    o->pubport = proto_getU16(r);
+    o->subport = proto_getU16(r);
+    return !r->err;
+}
+
+bool proto_locate(const int fd, Buffer *out, Buffer *in, const char *topic, Owner *o) {
+
+    size_t pos = proto_begin(out, OP_LOCATE, 0);
+    proto_putStr(out, topic);
+    proto_end(out, pos);
+
+    Frame f;
+    if (!proto_send(fd, out) || !proto_recv(fd, in, &f))
+        return false;
+
+    Reader r  = proto_reader(&f);
+    bool   ok = (f.opcode == OP_OWNER && proto_getOwner(&r, o));
+    proto_consume(in, &f);
+
+    return ok;
+}
+
+int64_t proto_hello(const int fd, Buffer *out, Buffer *in, uint32_t want) {
+
+    if (fd >= LINK_MAXFD)
+        want &= ~FEAT_SHM;
+
+    size_t pos = proto_begin(out, OP_HELLO, 0);
+    proto_putU32(out, want);
+    proto_end(out, pos);
+
+    Frame f;
+    if (!proto_send(fd, out) || !proto_recv(fd, in, &f))
+        return -1;
+
+    // an older broker does not know the opcode
+    Reader  r   = proto_reader(&f);
+    int64_t got = (f.opcode == OP_HELLO) ? proto_getU32(&r) & want : 0;
+
+    // the broker goes on reading the socket until the first frame comes through the channel
+    char name[SHM_NAMELEN];
+    if (!r.err && (got & FEAT_SHM) && (proto_getStr(&r, name, sizeof name) == NULL || r.err ||
+                                       (links[fd] = shm_attach(name)) == NULL))
+        got &= ~FEAT_SHM;
+    proto_consume(in, &f);
+
+    return r.err ? -1 : got;
+}
+
+int64_t proto_topicId(const int fd, Buffer *out, Buffer *in, const char *topic, const bool create) {
+
+    size_t pos = proto_begin(out, create ? OP_CREATE : OP_LOOKUP, 0);
+    proto_putStr(out, topic);
+    proto_end(out, pos);
+
+    Frame f;
+    if (!proto_send(fd, out) || !proto_recv(fd, in, &f))
+        return -1;
+
+    // an error or an owner elsewhere leaves the topic without an id here
+    Reader   r  = proto_reader(&f);
+    uint64_t id = (f.opcode == OP_ACK) ? proto_getU64(&r) : TOPIC_NOID;
+    proto_consume(in, &f);
+
+    return (r.err || id > TOPIC_NOID) ? -1 : (int64_t)id;
+}
+
+bool proto_listTopics(const int fd, Buffer *out, Buffer *in, Vector *topics) {
+
+    for (uint32_t next = 0;;) {
+        size_t pos = proto_begin(out, OP_LIST, 0);
+        proto_putU32(out, next);
+        proto_end(out, pos);
+
+        Frame f;
+        if (!proto_send(fd, out) || !proto_recv(fd, in, &f))
+            return false;
+        if (f.opcode != OP_TOPICS) {
+            proto_consume(in, &f);
+            return false;
+        }
+
+        Reader   r     = proto_reader(&f);
+        uint32_t count = proto_getU32(&r);
+        for (uint32_t i = 0; i < count && !r.err; i++) {
+            char name[TOPIC_MAXLEN + 1];
+            next = proto_getU32(&r) + 1;
+            if (proto_getStr(&r, name, sizeof name) != NULL) {
+                char *topic = strdup(name);
+                vec_pushBack(topics, &topic);
+            }
+        }
+        proto_consume(in, &f);
+
+        if (r.err)
+            return false;
+        if (count == 0)
+            return true;
+    }
+}
+
+bool proto_unpack(const char *p, const size_t n, const uint32_t count, Buffer *raw) {
+
+    if (n < sizeof(uint32_t))
+        return false;
+
+    uint32_t len;
+    memcpy(&len, p, sizeof len);
+    len = be32toh(len);
+    if (len > FRAME_MAX_LEN || !buf_reserve(raw, len))
+        return false;
+
+    char   *start = raw->data + raw->end;
+    ssize_t got   = lz_decompress(p + sizeof len, n - sizeof len, start, len);
+    if (got != len)
+        return false;
+
+    // the messages have to fill the entries exactly
+    Reader r = {.p = start, .left = len};
+    for (uint32_t i = 0; i < count && !r.err; i++)
+        proto_getBytes(&r, proto_getU32(&r));
+    if (r.err || r.left > 0)
+        return false;
+
+    raw->end += len;
+
+    return true;
+}
+
+// writes the whole buffer into the up ring, ringing the broker if it sleeps on it
+static bool sendShm(const int fd, Shm *s, Buffer *b) {
+
+    while (buf_len(b) > 0) {
+        size_t n = shm_write(s->up, buf_peek(b), buf_len(b));
+        buf_consume(b, n);
+        if (n > 0 && shm_unpark(s->up) && !ring(fd))
+            return false;
+        if (n == 0 && !waitShm(fd, s->up, false))
+            return false;
+    }
+
+    return true;
+}
+
+// proto_recv() from the down ring, the room made there may be what the broker waits for
+static bool recvShm(const int fd, Shm *s, Buffer *b, Frame *f) {
+
+    int r;
+    while ((r = proto_parse(b, f)) == 0) {
+        if (!buf_reserve(b, BUF_START_SIZE))
+            return false;
+
+        size_t n = shm_read(s->down, b->data + b->end, b->cap - b->end);
+        if (n == 0) {
+            if (!waitShm(fd, s->down, true))
+                return false;
+            continue;
+        }
+        b->end += n;
+        if (shm_unpark(s->down) && !ring(fd))
+            return false;
+    }
+
+    return r == 1;
+}
+
+// sleeps until a ring is ready, giving up once the broker is gone or the socket timeout has passed (EAGAIN)
+static bool waitShm(const int fd, ShmRing *r, const bool reading) {
+
+    struct timeval tv  = {0};
+    socklen_t      len = sizeof tv;
+    getsockopt(fd, SOL_SOCKET, reading ? SO_RCVTIMEO : SO_SNDTIMEO, &tv, &len);
+    long limit = tv.tv_sec * 1000 + tv.tv_usec / 1000; // 0 for none
+
+    for (long waited = 0;;) {
+        int step = (limit > 0 && limit - waited < LINK_POLL_MS) ? limit - waited : LINK_POLL_MS;
+        if (shm_wait(r, reading, step))
+            return true;
+        waited += step;
+
+        // the broker never writes to the socket once on the channel, so anything there means it has closed
+        struct pollfd p = {.fd = fd, .events = POLLIN};
+        if (poll(&p, 1, 0) != 0) {
+            errno = ECONNRESET;
+            return false;
+        }
+        if (limit > 0 && waited >= limit) {
+            errno = EAGAIN;
+            return false;
+        }
+    }
+}
+
+// wakes the broker: any byte on the socket will do
+static bool ring(const int fd) {
+
+    for (;;) {
+        if (write(fd, "", 1) == 1)
+            return true;
+        if (errno != EINTR)
+            return false;
+    }
+}
@@ -0,0 +1,489 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+/**
+ * Wire protocol between clients and the broker.
+ *
+ * Every message is a frame: a fixed 8 byte header followed by
+ * a payload of variable length. All integers are big endian.
+ *
+ *   0       1       2               4                               8
+ *   +-------+-------+---------------+-------------------------------+
+ *   |version|opcode |     flags     |        payload length         |
+ *   +-------+-------+---------------+-------------------------------+
+ *
+ * Strings (topic names) are a u16 length followed by the bytes,
+ * without a terminating NUL. Topic names are hierarchical,
+ * with dots between the levels (see trie.h).
+ *
+ * Message ids are per-topic sequence numbers assigned by the
+ * broker, starting at 0 and increasing by one per message.
+ *
+ * Payloads:
+ *   OP_PUBLISH        topic, message bytes (rest of the frame)
+ *   OP_ACK            u64 id given to the published message
+ *   OP_FETCH          topic, u64 id of the first message wanted,
+ *                     optionally u64 offset into it (see FEAT_CHUNKS)
+ *   OP_MSG            u64 message id, message bytes (rest of the frame)
+ *   OP_NOMSG          (empty) no message at or after the id asked for
+ *   OP_ERROR          u16 error code, reason (rest of the frame)
+ *   OP_SUBSCRIBE      topic, u64 id of the first message wanted,
+ *                     optionally u32 bytes of credit
+ *   OP_PUSH           topic, u64 message id, message bytes (rest of the frame)
+ *   OP_FETCH_BATCH    topic, u64 id of the first message wanted,
+ *                     u32 max messages, u32 max bytes of entries
+ *   OP_BATCH          u64 id of the first message, u32 message count,
+ *                     then one entry per message (ids are consecutive)
+ *   OP_PUBLISH_BATCH  topic, u64 batch number, u32 message count,
+ *                     then per message a u32 length and the bytes
+ *   OP_BATCH_ACK      u64 batch number, u64 id of the first message,
+ *                     u32 message count
+ *   OP_JOIN           topic, group name, optionally u32 bytes of credit
+ *   OP_ASSIGN         topic, group name, u64 generation, u32 partitions
+ *                     of the topic, u32 count, then count u32 partitions
+ *   OP_COMMIT         topic, group name, u32 count, then count u64 ids
+ *   OP_LOCATE         topic
+ *   OP_OWNER          host, u16 publisher port, u16 subscriber port
+ *   OP_HELLO          u32 features (FEAT_*), then with FEAT_SHM (from
+ *                     the broker) the name of a shared-memory channel
+ *   OP_CREDIT         topic, u32 bytes of credit
+ *   OP_CREATE         topic
+ *   OP_LOOKUP         topic
+ *   OP_LIST           u32 id of the first topic wanted
+ *   OP_TOPICS         u32 count, then per topic its u32 id and name
+ *
+ * A batch entry is a 16 byte header followed by the message:
+ *
+ *   u32 message length, u32 reserved (0), i64 publish time
+ *
+ * OP_FETCH_BATCH is answered with a single OP_BATCH. It holds
+ * at least one message if there is any at or after the id, so
+ * a message larger than max bytes is still delivered; a count
+ * of 0 means there is nothing more to read. Asking for at most
+ * 0 messages is malformed.
+ *
+ * The messages of an OP_PUBLISH_BATCH get consecutive ids and
+ * are stored all together or not at all (OP_ERROR). Batch
+ * numbers are chosen by the client; as replies come back in
+ * request order, an ack for batch n also settles every batch
+ * sent before it, so a client may keep several in flight.
+ *
+ * A fetch for an id that has already expired returns the
+ * oldest message still stored.
+ *
+ * OP_SUBSCRIBE is answered with an OP_ACK holding the id the
+ * stream starts at. From then on the broker sends an OP_PUSH
+ * for every message of the topic, stored or newly published,
+ * until the connection is closed. Pushes are not replies and
+ * may arrive before the OP_ACK or between other replies.
+ *
+ * The topic of an OP_SUBSCRIBE may be a pattern instead. The
+ * connection is then pushed the messages published from then
+ * on to every topic of the broker that matches it, once per
+ * matching subscription. The id asked for is ignored and the
+ * OP_ACK holds 0. Credit is kept per matching topic, and an
+ * OP_CREDIT names the topic the pushes came from. OP_LOCATE
+ * answers a pattern with the broker asked; any other request
+ * for one fails with ERR_TOPIC. Each broker of a federation
+ * only matches patterns against its own topics.
+ *
+ * OP_JOIN makes the connection a member of a consumer group
+ * of the topic, created if needed (group names follow the
+ * rules of topic names). Message id i is in partition
+ * i % partitions, and every partition is owned by one member.
+ * The join is answered with an OP_ACK holding the generation
+ * of the group. Whenever the partitions are dealt again, each
+ * member is pushed an OP_ASSIGN with the ones it now owns,
+ * followed by OP_PUSH frames for the messages in them, from
+ * the offset last committed by the group. Members leave by
+ * closing the connection.
+ *
+ * Pushes are flow controlled if the OP_SUBSCRIBE or OP_JOIN
+ * carries credit: the broker only pushes while the stream has
+ * credit left, each push using up as many bytes as its
+ * message. The last push may overdraw it, so a message larger
+ * than the credit still gets through. OP_CREDIT adds to the
+ * credit of every stream the connection has on the topic. It
+ * is the one request that is never answered, not even with an
+ * OP_ERROR. Streams started without credit are not metered,
+ * but no stream is pushed much faster than its client reads:
+ * the broker keeps a window of bytes queued per connection.
+ * Brokers that take credit agree on FEAT_CREDIT.
+ *
+ * A broker may hold back the acks of publishes to a topic
+ * whose readers have fallen too far behind, until they catch
+ * up. The messages are stored all the same.
+ *
+ * OP_COMMIT records that the given messages, and the ones
+ * before them in the same partitions, have been processed.
+ * It is answered with an OP_ACK holding the number of
+ * partitions whose committed offset moved forward.
+ *
+ * Brokers may form a federation, where every topic is owned by
+ * one of them. OP_LOCATE is answered with the OP_OWNER of the
+ * topic, an empty host meaning the broker asked. Any other
+ * request for a topic owned elsewhere is answered with an
+ * OP_OWNER instead of being handled, and should be sent there.
+ * When a topic moves, its streaming subscribers and group
+ * members are pushed an OP_OWNER and dropped. Messages stay
+ * with the broker that stored them, so a moved topic starts
+ * again from the first id its new owner has. Brokers may
+ * briefly disagree on the owner, so a client should follow
+ * one OP_OWNER at a time and not one it is sent back with.
+ *
+ * The broker keeps a registry of its topics, which gives each
+ * one a u32 id (see registry.h). OP_CREATE registers a topic,
+ * creating it if needed, and OP_LOOKUP finds one already
+ * registered; both are answered with an OP_ACK holding its id,
+ * and a lookup of an unknown topic fails with ERR_TOPIC.
+ * OP_LIST is answered with an OP_TOPICS holding the topics
+ * from the id asked for on, in id order and as many as fit in
+ * one frame; a count of 0 means there are no more. Every
+ * broker of a federation gives out ids of its own.
+ *
+ * Optional features are agreed on per connection: the client
+ * sends an OP_HELLO with those it wants and the broker answers
+ * with an OP_HELLO holding the ones it will use. Brokers that
+ * predate this answer with an OP_ERROR instead.
+ *
+ * With FEAT_LZ, batches can travel compressed (see lz.h). An
+ * OP_PUBLISH_BATCH with FLAG_LZ set carries, after its count,
+ * a u32 length of the entries and then them as a single LZ
+ * block. The broker stores the block as it is, so at most
+ * LZ_BATCH_MAX messages can go in one. Setting FLAG_LZ on an
+ * OP_FETCH_BATCH allows the OP_BATCH (also flagged) to pass
+ * such blocks on: an entry whose reserved field is not 0 is a
+ * whole compressed batch, that many messages with consecutive
+ * ids, and its bytes are the u32 length of the entries and the
+ * LZ block. Other messages are sent as plain entries; pushes
+ * are never compressed.
+ *
+ * With FEAT_IDS, a request that starts with a topic may have
+ * FLAG_ID set and hold the u32 id of the topic there instead,
+ * so the broker finds it without looking up its name. An id
+ * that was never given out fails with ERR_TOPIC. Pushes and
+ * assignments still carry the name.
+ *
+ * With FEAT_CHUNKS, a message may be larger than MSG_MAXLEN,
+ * up to CHUNK_MAXLEN bytes, and then travels in pieces. It
+ * is published as OP_PUBLISH frames with FLAG_MORE set on all
+ * but the last one. Only the last piece is answered, with the
+ * OP_ACK of the whole message (or an OP_ERROR if any piece was
+ * refused), and the message goes to the topic it names. A
+ * connection publishes one such message at a time; other
+ * requests may come in between its pieces, though any
+ * OP_PUBLISH without the flag is its last piece. The broker
+ * gathers the pieces on disk, never the whole message in
+ * memory, so a piece of CHUNK_LEN bytes is plenty.
+ *
+ * Such a message is pushed as OP_PUSH frames of up to
+ * CHUNK_LEN bytes, each with the topic and id, and FLAG_MORE
+ * set on all but the last; pushes of other topics may come
+ * between them. An OP_FETCH of it is answered with an OP_MSG
+ * holding up to CHUNK_LEN bytes from the offset asked for,
+ * with FLAG_MORE set if more follow, so the client fetches
+ * the same id again at the offset past them. The offset is
+ * ignored for messages that fit in a frame. A batch stops
+ * before such a message, and an OP_FETCH_BATCH that would
+ * start with it is answered like an OP_FETCH of it instead.
+ * Only clients that agree on FEAT_CHUNKS should read topics
+ * that hold such messages.
+ *
+ * With FEAT_SHM, a client on the same host as the broker moves
+ * the connection onto a shared-memory channel (see shm.h),
+ * named in the OP_HELLO the broker answers with. It is only
+ * offered if that OP_HELLO is the first request, and the
+ * client sends nothing more until it has the answer. Once its
+ * first frame has gone through the channel, all frames do,
+ * both ways, and the socket only carries doorbells (single
+ * bytes, ignored) and the end of the connection. A client
+ * that cannot map the channel just stays on the socket.
+ */
+
+#include "buffer.h"
+#include "lz.h"
+#include "shm.h"
+#include "utils.h"
+#include "vector.h"
+
+#include <sys/un.h>
+
+#define BROKER_PUB_PORT 14342
+#define BROKER_SUB_PORT 11312
+#define UNIX_PREFIX     "unix:" // broker address that is a socket path
+#define UNIX_PUB_SUFFIX ".pub"  // added to the path for the publisher socket
+#define UNIX_SUB_SUFFIX ".sub"  // and for the subscriber socket
+
+#define PROTO_VERSION 1
+#define FRAME_HDR_LEN 8
+#define FRAME_MAX_LEN (16 << 20) // largest payload accepted
+#define TOPIC_MAXLEN  255
+#define HOST_MAXLEN   255
+#define MSG_MAXLEN    (FRAME_MAX_LEN - 1024) // largest message, leaves room for the fields around it
+#define ENTRY_HDR_LEN 16                     // header of a message in an OP_BATCH
+#define LZ_BATCH_MAX  UINT16_MAX             // messages in a compressed batch
+#define TOPIC_NOID    UINT32_MAX             // topic that has no id, it goes by name
+#define CHUNK_LEN     (1 << 20)              // bytes of a large message per piece
+#define CHUNK_MAXLEN  UINT32_MAX             // largest message sent in pieces
+
+enum opcode {
+    OP_PUBLISH       = 1,
+    OP_FETCH         = 2,
+    OP_MSG           = 3,
+    OP_NOMSG         = 4,
+    OP_ERROR         = 5,
+    OP_ACK           = 6,
+    OP_SUBSCRIBE     = 7,
+    OP_PUSH          = 8,
+    OP_FETCH_BATCH   = 9,
+    OP_BATCH         = 10,
+    OP_PUBLISH_BATCH = 11,
+    OP_BATCH_ACK     = 12,
+    OP_JOIN          = 13,
+    OP_ASSIGN        = 14,
+    OP_COMMIT        = 15,
+    OP_LOCATE        = 16,
+    OP_OWNER         = 17,
+    OP_HELLO         = 18,
+    OP_CREDIT        = 19,
+    OP_CREATE        = 20,
+    OP_LOOKUP        = 21,
+    OP_LIST          = 22,
+    OP_TOPICS        = 23,
+};
+
+enum flag {
+    FLAG_LZ   = 1 << 0, // batch may hold compressed entries
+    FLAG_ID   = 1 << 1, // the topic is given by its id
+    FLAG_MORE = 1 << 2, // a piece of a message, more of it follows
+};
+
+enum feature {
+    FEAT_LZ     = 1 << 0, // compressed batches
+    FEAT_CREDIT = 1 << 1, // flow controlled pushes
+    FEAT_IDS    = 1 << 2, // topics given by id
+    FEAT_CHUNKS = 1 << 3, // messages in pieces
+    FEAT_SHM    = 1 << 4, // frames through shared memory
+};
+
+enum errcode {
+    ERR_MALFORMED = 1, // frame could not be decoded
+    ERR_TOPIC     = 2, // invalid topic name
+    ERR_STORE     = 3, // broker could not store the message
+    ERR_GROUP     = 4, // no such consumer group
+};
+
+// a decoded frame header, the payload points into the receive buffer
+typedef struct Frame {
+    uint8_t     opcode;
+    uint16_t    flags;
+    uint32_t    len;  // payload length
+    const char *data; // payload
+    const char *raw;  // start of the header
+} Frame;
+
+// broker owning a topic, as sent in an OP_OWNER
+typedef struct Owner {
+    char     host[HOST_MAXLEN + 1]; // empty for the broker that answered
+    uint16_t pubport;
+    uint16_t subport;
+} Owner;
+
+// cursor for decoding a payload
+typedef struct Reader {
+    const char *p;    // next unread byte
+    size_t      left; // bytes left in the payload
+    bool        err;  // set once a read ran past the end
+} Reader;
+
+/**
+ * Decodes the frame at the start of n bytes of p.
+ *
+ * Returns 1 if a whole frame is there, 0 if more bytes are
+ * needed and -1 if the header is invalid.
+ */
+int proto_decode(const char *p, const size_t n, Frame *f);
+
+/**
+ * proto_decode() on the unread bytes of a buffer.
+ */
+int proto_parse(const Buffer *b, Frame *f);
+
+/**
+ * Removes a frame returned by proto_parse() from the buffer.
+ */
+void proto_consume(Buffer *b, const Frame *f);
+
+/**
+ * Appends a frame header and returns its position, the
+ * payload is appended after it with the proto_put functions.
+ */
+size_t proto_begin(Buffer *b, const uint8_t opcode, const uint16_t flags);
+
+/**
+ * Fills in the payload length of the frame started at pos.
+ */
+void proto_end(Buffer *b, const size_t pos);
+
+/**
+ * proto_end() for a frame whose last n payload bytes are sent
+ * separately, right after the buffer.
+ */
+void proto_endWith(Buffer *b, const size_t pos, const size_t n);
+
+/**
+ * Overwrites a u32 that was appended earlier at pos, for
+ * fields only known once the rest of the payload is built.
+ */
+void proto_setU32(Buffer *b, const size_t pos, const uint32_t v);
+
+void proto_putU8(Buffer *b, const uint8_t v);
+void proto_putU16(Buffer *b, const uint16_t v);
+void proto_putU32(Buffer *b, const uint32_t v);
+void proto_putU64(Buffer *b, const uint64_t v);
+void proto_putBytes(Buffer *b, const void *p, const size_t n);
+void proto_putStr(Buffer *b, const char *s);
+
+/**
+ * Appends the topic of a request: its id unless that is
+ * TOPIC_NOID, in which case the frame must not have FLAG_ID,
+ * or else its name.
+ */
+void proto_putTopic(Buffer *b, const char *topic, const uint32_t id);
+
+/**
+ * Appends a complete OP_ERROR frame.
+ */
+void proto_error(Buffer *b, const uint16_t code, const char *reason);
+
+/**
+ * Starts reading the payload of a frame.
+ */
+Reader proto_reader(const Frame *f);
+
+uint8_t     proto_getU8(Reader *r);
+uint16_t    proto_getU16(Reader *r);
+uint32_t    proto_getU32(Reader *r);
+uint64_t    proto_getU64(Reader *r);
+const char *proto_getBytes(Reader *r, const size_t n);
+
+/**
+ * Reads a string into buf (NUL terminated).
+ * Sets r->err if it does not fit in n bytes.
+ */
+char *proto_getStr(Reader *r, char *buf, const size_t n);
+
+/**
+ * Blocking helpers for the clients.
+ *
+ * proto_send() writes out (and empties) the whole buffer.
+ * proto_recv() reads from fd until a whole frame is in the
+ * buffer; consume it with proto_consume() when done. On a
+ * connection moved to shared memory by proto_hello(), both
+ * go through the channel instead, and keep to the timeouts
+ * set on the socket.
+ *
+ * Both return false on error or EOF.
+ */
+bool proto_send(const int fd, Buffer *b);
+bool proto_recv(const int fd, Buffer *b, Frame *f);
+
+/**
+ * Closes a connection to the broker, and its channel if any.
+ */
+void proto_close(const int fd);
+
+/**
+ * Parses a broker address, "<host>[:<publisher port>]". The
+ * subscriber port is shifted from its default by as much as
+ * the publisher port.
+ *
+ * A broker on this host may be given as "unix:<path>" instead
+ * (UNIX_PREFIX), for the unix sockets it listens on under
+ * path (see proto_unixAddr()). The whole spec is then kept as
+ * the host, and the ports are 0.
+ *
+ * Returns false if spec is malformed.
+ */
+bool proto_parseAddr(const char *spec, Owner *o);
+
+/**
+ * Whether an address parsed by proto_parseAddr() is a path.
+ */
+bool proto_isUnix(const Owner *o);
+
+/**
+ * Address of the publisher socket of a broker listening under
+ * path, or of its subscriber socket if sub is set: the path
+ * followed by UNIX_PUB_SUFFIX or UNIX_SUB_SUFFIX.
+ *
+ * Returns false if that is too long for a socket address.
+ */
+bool proto_unixAddr(const char *path, const bool sub, struct sockaddr_un *sa);
+
+/**
+ * Connects to the publisher port of a broker, or to its
+ * subscriber port if sub is set, over TCP or a unix socket.
+ *
+ * Returns the (blocking) fd, or -1 on error.
+ */
+int proto_connect(const Owner *o, const bool sub);
+
+/**
+ * Decodes the payload of an OP_OWNER.
+ * Returns false if it is malformed.
+ */
+bool proto_getOwner(Reader *r, Owner *o);
+
+/**
+ * Asks the broker on fd which broker owns a topic, with an
+ * OP_LOCATE. Uses the buffers like proto_send() and
+ * proto_recv().
+ *
+ * Returns false on error.
+ */
+bool proto_locate(const int fd, Buffer *out, Buffer *in, const char *topic, Owner *o);
+
+/**
+ * Agrees on features with the broker on fd, with an OP_HELLO.
+ * Uses the buffers like proto_send() and proto_recv().
+ *
+ * With FEAT_SHM agreed on, the connection moves to the channel
+ * offered; it must be the first request on fd, and fd must be
+ * closed with proto_close().
+ *
+ * Returns the features the broker will use, none if it does
+ * not know OP_HELLO, or -1 on error.
+ */
+int64_t proto_hello(const int fd, Buffer *out, Buffer *in, uint32_t want);
+
+/**
+ * Asks the broker on fd for the id of a topic, with an
+ * OP_LOOKUP, or with an OP_CREATE if create is set. Uses the
+ * buffers like proto_send() and proto_recv().
+ *
+ * Returns the id, TOPIC_NOID if the broker has no such topic
+ * or would not register it, or -1 on error.
+ */
+int64_t proto_topicId(const int fd, Buffer *out, Buffer *in, const char *topic, const bool create);
+
+/**
+ * Lists the topics registered with the broker on fd, with as
+ * many OP_LIST as it takes, appending copies of their names to
+ * topics (Vector<char *>) in id order. Uses the buffers like
+ * proto_send() and proto_recv().
+ *
+ * Returns false on error.
+ */
+bool proto_listTopics(const int fd, Buffer *out, Buffer *in, Vector *topics);
+
+/**
+ * Decompresses the n bytes of a compressed batch entry into
+ * raw, after anything already there. The result is count
+ * messages, each a u32 length and the bytes, as checked here.
+ *
+ * Returns false if the entry is malformed.
+ */
+bool proto_unpack(const char *p, const size_t n, const uint32_t count, Buffer *raw);
+
+#endif // PROTO_H
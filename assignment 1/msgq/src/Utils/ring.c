@@ -0,0 +1,50 @@
+#include "ring.h"
+
+Ring *ring_init(const size_t cap) {
+
+    size_t n = 1;
+    while (n < cap)
+        n *= 2;
+
+    // keep head and tail on their own cache lines
+    size_t size = (sizeof(Ring) + CACHELINE - 1) / CACHELINE * CACHELINE;
+    Ring  *r    = aligned_alloc(CACHELINE, size);
+    memset(r, 0, size);
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->mask  = n - 1;
+    r->slots = calloc(n, sizeof(void *));
+
+    return r;
+}
+
+bool ring_push(Ring *r, void *p) {
+
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (tail - head > r->mask)
+        return false; // full
+
+    r->slots[tail & r->mask] = p;
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+
+    return true;
+}
+
+void *ring_pop(Ring *r) {
+
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head == tail)
+        return NULL; // empty
+
+    void *p = r->slots[head & r->mask];
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+    return p;
+}
+
+void ring_free(Ring *r) {
+    free(r->slots);
+    free(r);
+}
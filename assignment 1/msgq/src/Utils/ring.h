@@ -0,0 +1,52 @@
+#ifndef RING_H
+#define RING_H
+
+/**
+ * Bounded lock-free ring of pointers.
+ *
+ * Single producer, single consumer: exactly one thread may
+ * push and exactly one (other) thread may pop.
+ */
+
+#include "utils.h"
+
+#include <stdatomic.h>
+
+#define CACHELINE 64
+
+typedef struct Ring {
+    _Atomic size_t head; // next slot to pop (written by the consumer)
+    char           pad1[CACHELINE - sizeof(size_t)];
+    _Atomic size_t tail; // next slot to push (written by the producer)
+    char           pad2[CACHELINE - sizeof(size_t)];
+    size_t         mask;  // capacity - 1
+    void         **slots; // capacity entries
+} Ring;
+
+/**
+ * Initialize a ring.
+ * Capacity is rounded up to a power of two.
+ */
+Ring *ring_init(const size_t cap);
+
+/**
+ * Adds p at the tail (producer side).
+ *
+ * Returns false if the ring is full.
+ */
+bool ring_push(Ring *r, void *p);
+
+/**
+ * Removes the element at the head (consumer side).
+ *
+ * Returns NULL if the ring is empty.
+ */
+void *ring_pop(Ring *r);
+
+/**
+ * Cleans up all allocations.
+ * Elements still in the ring are not freed.
+ */
+void ring_free(Ring *r);
+
+#endif // RING_H
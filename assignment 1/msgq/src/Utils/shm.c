@@ -0,0 +1,190 @@
+#include "shm.h"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define RING_LEN (sizeof(ShmRing) + SHM_RING_SIZE) // of each ring in the mapping
+
+static _Atomic uint nextid; // names channels apart within the process
+static int          spins;  // SHM_SPIN, none on a single core where it only keeps the other side waiting
+
+static Shm *mapChannel(const int fd, const char *name);
+static bool isReady(ShmRing *r, const bool reading);
+static void relax();
+
+Shm *shm_create() {
+
+    char name[SHM_NAMELEN];
+    snprintf(name, sizeof name, "/msgq-%d-%u", (int)getpid(), atomic_fetch_add(&nextid, 1));
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        return NULL;
+    if (ftruncate(fd, 2 * RING_LEN) == -1) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    // a fresh object is all zeroes, which is two empty rings
+    Shm *s = mapChannel(fd, name);
+    if (s == NULL) {
+        shm_unlink(name);
+        return NULL;
+    }
+    atomic_store(&s->up->parked, 1);
+
+    return s;
+}
+
+Shm *shm_attach(const char *name) {
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size != (off_t)(2 * RING_LEN)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return mapChannel(fd, name);
+}
+
+void shm_free(Shm *s) {
+    munmap(s->up, s->len);
+    free(s);
+}
+
+size_t shm_used(ShmRing *r) { return atomic_load(&r->head) - atomic_load(&r->tail); }
+
+size_t shm_room(ShmRing *r) { return SHM_RING_SIZE - shm_used(r); }
+
+size_t shm_write(ShmRing *r, const void *p, const size_t n) {
+
+    // at most two pieces, the second one after wrapping around
+    size_t done = 0, len;
+    char  *dst;
+    while (done < n && (dst = shm_space(r, &len)) != NULL && len > 0) {
+        if (len > n - done)
+            len = n - done;
+        memcpy(dst, (const char *)p + done, len);
+        shm_produce(r, len);
+        done += len;
+    }
+
+    return done;
+}
+
+char *shm_space(ShmRing *r, size_t *n) {
+
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t   at   = head & (SHM_RING_SIZE - 1);
+
+    *n = SHM_RING_SIZE - (head - tail);
+    if (*n > SHM_RING_SIZE - at)
+        *n = SHM_RING_SIZE - at;
+
+    return r->data + at;
+}
+
+// sequentially consistent, so the parked flag is read after it (see shm_unpark())
+void shm_produce(ShmRing *r, const size_t n) { atomic_fetch_add(&r->head, n); }
+
+size_t shm_read(ShmRing *r, void *p, const size_t n) {
+
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    size_t done = 0;
+    while (done < n && tail + done < head) {
+        size_t at  = (tail + done) & (SHM_RING_SIZE - 1);
+        size_t len = head - (tail + done);
+        if (len > SHM_RING_SIZE - at)
+            len = SHM_RING_SIZE - at;
+        if (len > n - done)
+            len = n - done;
+        memcpy((char *)p + done, r->data + at, len);
+        done += len;
+    }
+
+    if (done > 0)
+        atomic_fetch_add(&r->tail, done);
+
+    return done;
+}
+
+bool shm_park(ShmRing *r, const bool reading) {
+
+    atomic_store(&r->parked, 1);
+    if (!isReady(r, reading))
+        return true;
+
+    atomic_store(&r->parked, 0);
+    return false;
+}
+
+bool shm_unpark(ShmRing *r) { return atomic_load(&r->parked) && atomic_exchange(&r->parked, 0); }
+
+void shm_wake(ShmRing *r) {
+
+    if (atomic_load(&r->waiters) == 0)
+        return;
+
+    atomic_fetch_add(&r->seq, 1);
+    syscall(SYS_futex, &r->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+bool shm_wait(ShmRing *r, const bool reading, const int timeout) {
+
+    // the other side is often just about to answer
+    for (int i = 0; i < spins; i++) {
+        if (isReady(r, reading))
+            return true;
+        relax();
+    }
+
+    // counted in before checking again, so the broker either sees us or we see its bytes
+    atomic_fetch_add(&r->waiters, 1);
+    uint32_t seq   = atomic_load(&r->seq);
+    bool     ready = isReady(r, reading);
+    if (!ready) {
+        struct timespec ts = {.tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L};
+        syscall(SYS_futex, &r->seq, FUTEX_WAIT, seq, &ts, NULL, 0);
+        ready = isReady(r, reading);
+    }
+    atomic_fetch_sub(&r->waiters, 1);
+
+    return ready;
+}
+
+// the mapping holds up and then down, the fd is not needed once mapped
+static Shm *mapChannel(const int fd, const char *name) {
+
+    size_t len  = 2 * RING_LEN;
+    void  *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    spins = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SHM_SPIN : 0;
+
+    Shm *s  = malloc(sizeof *s);
+    s->up   = base;
+    s->down = (ShmRing *)((char *)base + RING_LEN);
+    s->len  = len;
+    snprintf(s->name, sizeof s->name, "%s", name);
+
+    return s;
+}
+
+static bool isReady(ShmRing *r, const bool reading) { return reading ? shm_used(r) > 0 : shm_room(r) > 0; }
+
+static void relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
@@ -0,0 +1,131 @@
+#ifndef SHM_H
+#define SHM_H
+
+/**
+ * Shared-memory channel between the broker and a client on
+ * the same host.
+ *
+ * A channel is a POSIX shared-memory object holding two byte
+ * rings: up, from the client to the broker, and down, back to
+ * it. Each ring has a single producer and a single consumer,
+ * which only ever advance their own counter, so frames go
+ * across with a copy in and a copy out and no system call.
+ *
+ * Sleeping is where the two sides differ. A client waits on a
+ * futex in the ring, which the broker wakes once it has
+ * written (or read) something. The broker waits on its event
+ * loop instead, so it parks a ring before going to sleep on it
+ * and the client, finding the ring parked, rings a doorbell:
+ * one byte on the socket the channel was set up over. The
+ * flags are set before the counters are checked again, on both
+ * sides, so no wakeup is ever lost.
+ */
+
+#include "utils.h"
+
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#define SHM_RING_SIZE (1 << 20) // bytes of data per ring, a power of two
+#define SHM_NAMELEN   64
+#define SHM_SPIN      2000 // times a client checks a ring before going to sleep on it
+
+typedef struct ShmRing {
+    _Atomic uint64_t head; // bytes ever written (by the producer)
+    char             pad1[64 - sizeof(uint64_t)];
+    _Atomic uint64_t tail; // bytes ever read (by the consumer)
+    char             pad2[64 - sizeof(uint64_t)];
+    _Atomic uint32_t seq;     // futex word, bumped by the broker to wake the client
+    _Atomic uint32_t waiters; // clients asleep on seq
+    _Atomic uint32_t parked;  // the broker sleeps until a doorbell
+    char             pad3[64 - 3 * sizeof(uint32_t)];
+    char             data[]; // SHM_RING_SIZE bytes, a size the client could change would not be trusted
+} ShmRing;
+
+typedef struct Shm {
+    ShmRing *up;   // client to broker
+    ShmRing *down; // broker to client
+    size_t   len;  // of the mapping
+    char     name[SHM_NAMELEN];
+} Shm;
+
+/**
+ * Creates a channel under a name of its own (broker side),
+ * with the up ring parked. The name stays until removed with
+ * shm_unlink().
+ *
+ * Returns NULL on error.
+ */
+Shm *shm_create();
+
+/**
+ * Maps the channel created under name (client side).
+ *
+ * Returns NULL on error, or if it is not a channel of the
+ * size built in.
+ */
+Shm *shm_attach(const char *name);
+
+/**
+ * Unmaps a channel.
+ */
+void shm_free(Shm *s);
+
+/**
+ * Bytes waiting in a ring, and room left in it.
+ */
+size_t shm_used(ShmRing *r);
+size_t shm_room(ShmRing *r);
+
+/**
+ * Copies up to n bytes into a ring, as many as fit.
+ * Returns the number copied.
+ */
+size_t shm_write(ShmRing *r, const void *p, const size_t n);
+
+/**
+ * shm_write() in two steps, for bytes that come from a file:
+ * shm_space() is where the next bytes go, up to n of them
+ * (0 if the ring is full), and shm_produce() hands over the
+ * first n written there.
+ */
+char *shm_space(ShmRing *r, size_t *n);
+void  shm_produce(ShmRing *r, const size_t n);
+
+/**
+ * Copies up to n bytes out of a ring.
+ * Returns the number copied, 0 if it is empty.
+ */
+size_t shm_read(ShmRing *r, void *p, const size_t n);
+
+/**
+ * Broker side: parks a ring before sleeping on it, reading
+ * (waiting for bytes) or writing (for room).
+ *
+ * Returns false, with the ring not parked, if what it waits
+ * for is already there.
+ */
+bool shm_park(ShmRing *r, const bool reading);
+
+/**
+ * Client side, after writing to or reading from a ring:
+ * whether the broker was parked on it and needs a doorbell.
+ */
+bool shm_unpark(ShmRing *r);
+
+/**
+ * Broker side, after writing to or reading from a ring:
+ * wakes the client if it sleeps on it.
+ */
+void shm_wake(ShmRing *r);
+
+/**
+ * Client side: spins for a while (unless there is a single
+ * core), then sleeps up to timeout ms until a ring has bytes
+ * (reading) or room (writing).
+ *
+ * Returns false if it is still not ready.
+ */
+bool shm_wait(ShmRing *r, const bool reading, const int timeout);
+
+#endif // SHM_H
@@ -0,0 +1,144 @@
+#include "trie.h"
+
+static const char seps[] = {TRIE_SEP, '\0'};
+
+static Trie *child(const Trie *t, const char *level);
+static uint  matchFrom(const Trie *t, const char *level, const char *end, const trie_visit visit, void *arg);
+static uint  visitVal(void *val, const trie_visit visit, void *arg);
+static bool  isLevel(const char *level, const size_t len, const char *wildcard);
+
+Trie *trie_init() { return calloc(1, sizeof(Trie)); }
+
+void **trie_slot(Trie *t, const char *pattern) {
+
+    // the levels are cut out of a copy, as the hashtable takes them NUL terminated
+    char *copy = strdup(pattern);
+    char *sep;
+    for (char *level = copy; level != NULL; level = (sep != NULL) ? sep + 1 : NULL) {
+        if ((sep = strchr(level, TRIE_SEP)) != NULL)
+            *sep = '\0';
+
+        Trie *next = child(t, level);
+        if (next == NULL) {
+            next            = trie_init();
+            const char *key = level;
+            if (t->children == NULL)
+                t->children = ht_init_str_void();
+            ht_insert(&t->children, &key, &next);
+        }
+        t = next;
+    }
+    free(copy);
+
+    return &t->val;
+}
+
+void *trie_find(const Trie *t, const char *pattern) {
+
+    char *copy = strdup(pattern);
+    char *sep;
+    for (char *level = copy; t != NULL && level != NULL; level = (sep != NULL) ? sep + 1 : NULL) {
+        if ((sep = strchr(level, TRIE_SEP)) != NULL)
+            *sep = '\0';
+        t = child(t, level);
+    }
+    free(copy);
+
+    return (t != NULL) ? t->val : NULL;
+}
+
+uint trie_match(const Trie *t, const char *name, const trie_visit visit, void *arg) {
+
+    // levels are separated by NULs in the copy, the last one ends just before end
+    size_t len  = strlen(name);
+    char  *copy = strdup(name);
+    for (char *p = copy; (p = strchr(p, TRIE_SEP)) != NULL; p++)
+        *p = '\0';
+
+    uint n = matchFrom(t, copy, copy + len + 1, visit, arg);
+    free(copy);
+
+    return n;
+}
+
+bool trie_matches(const char *pattern, const char *name) {
+
+    for (;;) {
+        size_t plen = strcspn(pattern, seps);
+        size_t nlen = strcspn(name, seps);
+        if (isLevel(pattern, plen, TRIE_ANY))
+            return true;
+        if (!isLevel(pattern, plen, TRIE_ONE) && (plen != nlen || strncmp(pattern, name, plen) != 0))
+            return false;
+
+        // a trailing TRIE_ANY also matches no more levels
+        bool pend = pattern[plen] == '\0';
+        if (name[nlen] == '\0')
+            return pend || strcmp(pattern + plen + 1, TRIE_ANY) == 0;
+        if (pend)
+            return false;
+
+        pattern += plen + 1;
+        name += nlen + 1;
+    }
+}
+
+bool trie_validName(const char *name, const bool pattern) {
+
+    for (const char *level = name;; level++) {
+        size_t len  = strcspn(level, seps);
+        bool   last = level[len] == '\0';
+        if (len == 0)
+            return false;
+
+        bool wild = memchr(level, TRIE_ONE[0], len) != NULL || memchr(level, TRIE_ANY[0], len) != NULL;
+        if (wild && !(pattern && (isLevel(level, len, TRIE_ONE) || (last && isLevel(level, len, TRIE_ANY)))))
+            return false;
+
+        if (last)
+            return true;
+        level += len;
+    }
+}
+
+bool trie_isPattern(const char *name) { return strpbrk(name, TRIE_ONE TRIE_ANY) != NULL; }
+
+static Trie *child(const Trie *t, const char *level) {
+    return (t->children == NULL) ? NULL : ht_lookupVal(t->children, &level);
+}
+
+static uint matchFrom(const Trie *t, const char *level, const char *end, const trie_visit visit, void *arg) {
+
+    // TRIE_ANY takes whatever levels are left, if any
+    uint  n   = 0;
+    Trie *any = child(t, TRIE_ANY);
+    if (any != NULL)
+        n += visitVal(any->val, visit, arg);
+
+    if (level >= end)
+        return n + visitVal(t->val, visit, arg);
+
+    const char *next = level + strlen(level) + 1;
+    Trie       *lit  = child(t, level);
+    Trie       *one  = child(t, TRIE_ONE);
+    if (lit != NULL)
+        n += matchFrom(lit, next, end, visit, arg);
+    if (one != NULL)
+        n += matchFrom(one, next, end, visit, arg);
+
+    return n;
+}
+
+static uint visitVal(void *val, const trie_visit visit, void *arg) {
+
+    if (val == NULL)
+        return 0;
+    if (visit != NULL)
+        visit(val, arg);
+
+    return 1;
+}
+
+static bool isLevel(const char *level, const size_t len, const char *wildcard) {
+    return len == 1 && level[0] == wildcard[0];
+}
@@ -0,0 +1,75 @@
+#ifndef TRIE_H
+#define TRIE_H
+
+/**
+ * Topic trie: maps topic patterns to values and finds the
+ * patterns a topic name matches.
+ *
+ * Topic names are hierarchical, their levels separated by
+ * TRIE_SEP ("sensors.kitchen.temp"). A level of a pattern may
+ * be TRIE_ONE, which matches any one level, and the last level
+ * may be TRIE_ANY, which matches any number of levels, none
+ * included ("sensors.#" matches "sensors" and all below it).
+ *
+ * Each node keeps its children in a hashtable keyed by level,
+ * so a name is matched with at most three lookups per level,
+ * however many patterns there are. Nodes are kept once added.
+ */
+
+#include "hashtable.h"
+#include "utils.h"
+
+#define TRIE_SEP '.'
+#define TRIE_ONE "*"
+#define TRIE_ANY "#"
+
+typedef struct Trie {
+    void      *val;      // value of the pattern ending here, NULL if none
+    Hashtable *children; // level -> Trie *, NULL until there is one
+} Trie;
+
+typedef void (*trie_visit)(void *val, void *arg);
+
+/**
+ * Creates an empty trie.
+ */
+Trie *trie_init();
+
+/**
+ * Slot holding the value of a pattern, added (as NULL) if it
+ * is not there yet.
+ */
+void **trie_slot(Trie *t, const char *pattern);
+
+/**
+ * Value of a pattern, NULL if it was never added.
+ */
+void *trie_find(const Trie *t, const char *pattern);
+
+/**
+ * Calls visit (unless NULL) with arg and the value of every
+ * pattern that matches a topic name. Patterns without a value
+ * are skipped.
+ *
+ * Returns the number of patterns matched.
+ */
+uint trie_match(const Trie *t, const char *name, const trie_visit visit, void *arg);
+
+/**
+ * Whether a single pattern matches a topic name.
+ */
+bool trie_matches(const char *pattern, const char *name);
+
+/**
+ * Checks that no level of a name is empty and that it has no
+ * wildcards, or, if pattern is set, only whole level ones in
+ * the places allowed.
+ */
+bool trie_validName(const char *name, const bool pattern);
+
+/**
+ * Whether a name has wildcards in it.
+ */
+bool trie_isPattern(const char *name);
+
+#endif // TRIE_H
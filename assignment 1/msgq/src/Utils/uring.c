@@ -0,0 +1,197 @@
+#include "uring.h"
+
+#ifdef NO_URING
+
+Uring *uring_init(const unsigned entries) {
+    errno = ENOSYS;
+    return NULL;
+}
+
+bool uring_recv(Uring *u, const int fd, void *buf, const size_t len, const uint64_t data) { return false; }
+bool uring_poll(Uring *u, const int fd, const short events, const uint64_t data) { return false; }
+bool uring_wait(Uring *u, const int timeout) { return false; }
+bool uring_reap(Uring *u, uint64_t *data, int *res) { return false; }
+void uring_free(Uring *u) {}
+
+#else
+
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+struct Uring {
+    int fd;
+
+    // submission ring, shared with the kernel
+    _Atomic unsigned    *sq_head;
+    _Atomic unsigned    *sq_tail;
+    unsigned             sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+
+    // completion ring, shared with the kernel
+    _Atomic unsigned    *cq_head;
+    _Atomic unsigned    *cq_tail;
+    unsigned             cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void  *sq_ring;
+    void  *cq_ring;
+    size_t sq_ring_sz;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+};
+
+static struct io_uring_sqe *getSqe(Uring *u);
+static int                  enter(Uring *u, const unsigned min_complete, const unsigned flags, void *arg, size_t argsz);
+
+Uring *uring_init(const unsigned entries) {
+
+    struct io_uring_params p = {0};
+    int                    fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd == -1)
+        return NULL;
+
+    // the wait timeout and no dropped completions are relied on
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+        close(fd);
+        errno = ENOSYS;
+        return NULL;
+    }
+
+    Uring *u = calloc(1, sizeof *u);
+    u->fd    = fd;
+
+    u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_sz    = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    u->sqes    = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        int err = errno;
+        uring_free(u);
+        errno = err;
+        return NULL;
+    }
+
+    char *sq    = u->sq_ring;
+    char *cq    = u->cq_ring;
+    u->sq_head  = (_Atomic unsigned *)(sq + p.sq_off.head);
+    u->sq_tail  = (_Atomic unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask  = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head  = (_Atomic unsigned *)(cq + p.cq_off.head);
+    u->cq_tail  = (_Atomic unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask  = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return u;
+}
+
+bool uring_recv(Uring *u, const int fd, void *buf, const size_t len, const uint64_t data) {
+
+    struct io_uring_sqe *sqe = getSqe(u);
+    if (sqe == NULL)
+        return false;
+
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = fd;
+    sqe->addr      = (uintptr_t)buf;
+    sqe->len       = len;
+    sqe->user_data = data;
+
+    return true;
+}
+
+bool uring_poll(Uring *u, const int fd, const short events, const uint64_t data) {
+
+    struct io_uring_sqe *sqe = getSqe(u);
+    if (sqe == NULL)
+        return false;
+
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = fd;
+    sqe->poll32_events = events;
+    sqe->user_data     = data;
+
+    return true;
+}
+
+bool uring_wait(Uring *u, const int timeout) {
+
+    struct __kernel_timespec      ts  = {.tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L};
+    struct io_uring_getevents_arg arg = {.ts = (uintptr_t)&ts};
+
+    // nothing to wait for if completions are already there
+    bool ready = atomic_load_explicit(u->cq_head, memory_order_relaxed) !=
+                 atomic_load_explicit(u->cq_tail, memory_order_acquire);
+    int n = (timeout == 0 || ready) ? enter(u, 0, 0, NULL, 0)
+                                    : enter(u, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+
+    // a timeout, a signal or a full completion ring just mean there is nothing more to do now
+    return n != -1 || errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY;
+}
+
+bool uring_reap(Uring *u, uint64_t *data, int *res) {
+
+    unsigned head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(u->cq_tail, memory_order_acquire))
+        return false;
+
+    struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+    *data                    = cqe->user_data;
+    *res                     = cqe->res;
+    atomic_store_explicit(u->cq_head, head + 1, memory_order_release);
+
+    return true;
+}
+
+void uring_free(Uring *u) {
+
+    if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_sz);
+    if (u->cq_ring != NULL && u->cq_ring != MAP_FAILED)
+        munmap(u->cq_ring, u->cq_ring_sz);
+    if (u->sqes != NULL && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_sz);
+    close(u->fd);
+    free(u);
+}
+
+// next free submission entry, cleared; hands the queue to the kernel first if it is full
+static struct io_uring_sqe *getSqe(Uring *u) {
+
+    unsigned tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(u->sq_head, memory_order_acquire) > u->sq_mask) {
+        if (enter(u, 0, 0, NULL, 0) == -1)
+            return NULL;
+        if (tail - atomic_load_explicit(u->sq_head, memory_order_acquire) > u->sq_mask)
+            return NULL;
+    }
+
+    unsigned             i   = tail & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[i];
+    memset(sqe, 0, sizeof *sqe);
+    u->sq_array[i] = i;
+
+    // only read by the kernel during the next enter(), from this thread
+    atomic_store_explicit(u->sq_tail, tail + 1, memory_order_release);
+
+    return sqe;
+}
+
+// submits everything queued, the kernel moves sq_head past what it has taken
+static int enter(Uring *u, const unsigned min_complete, const unsigned flags, void *arg, size_t argsz) {
+
+    unsigned queued = atomic_load_explicit(u->sq_tail, memory_order_relaxed) -
+                      atomic_load_explicit(u->sq_head, memory_order_acquire);
+    if (queued == 0 && !(flags & IORING_ENTER_GETEVENTS))
+        return 0;
+
+    return syscall(__NR_io_uring_enter, u->fd, queued, min_complete, flags, arg, argsz);
+}
+
+#endif // NO_URING
@@ -0,0 +1,60 @@
+#ifndef URING_H
+#define URING_H
+
+/**
+ * Minimal io_uring wrapper, straight on top of the system
+ * calls (no liburing).
+ *
+ * Requests are queued in the submission ring and only handed
+ * to the kernel by uring_wait(), so everything queued during
+ * one loop iteration costs a single system call, which also
+ * picks up the completions. Every request carries a user
+ * value that comes back with its completion.
+ *
+ * Built with NO_URING, uring_init() always fails and callers
+ * fall back to epoll.
+ */
+
+#include "utils.h"
+
+typedef struct Uring Uring;
+
+/**
+ * Sets up a ring with room for at least entries requests.
+ *
+ * Returns NULL (with errno set) if io_uring is not available,
+ * or lacks a feature used here.
+ */
+Uring *uring_init(const unsigned entries);
+
+/**
+ * Queues a recv() of up to len bytes into buf.
+ * Queues a one-shot poll for events (POLLIN, POLLOUT) on fd.
+ *
+ * Both return false if the request could not be queued.
+ */
+bool uring_recv(Uring *u, const int fd, void *buf, const size_t len, const uint64_t data);
+bool uring_poll(Uring *u, const int fd, const short events, const uint64_t data);
+
+/**
+ * Submits the queued requests and waits up to timeout ms for a
+ * completion (not at all if timeout is 0).
+ *
+ * Returns false on error.
+ */
+bool uring_wait(Uring *u, const int timeout);
+
+/**
+ * Takes the next completion: the user value of its request
+ * and the result (-errno on failure).
+ *
+ * Returns false if there is none.
+ */
+bool uring_reap(Uring *u, uint64_t *data, int *res);
+
+/**
+ * Cleans up the ring. Requests still in flight are cancelled.
+ */
+void uring_free(Uring *u);
+
+#endif // URING_H
@@ -1,5 +1,7 @@
 #include "utils.h"
 
+int log_level = LOG_INFO;
+
 void perror_and_exit(const char *msg) {
     perror(msg);
     exit(EXIT_FAILURE);
@@ -1,17 +1,22 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#define _GNU_SOURCE // for accept4
+
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -26,12 +31,20 @@
 
 #define NUM_ELEM(x) (sizeof(x) / sizeof((x)[0]))
 
-// for sending messages to/from the broker
-struct msg {
-    char topic[TMP_BUFLEN];
-    char msg[TMP_BUFLEN];
+enum log_level {
+    LOG_ERROR,
+    LOG_INFO,  // connections and other rare events (default)
+    LOG_DEBUG, // every message
 };
 
+extern int log_level; // messages above this level are not printed
+
+#define LOG(level, ...)                                                                                                \
+    do {                                                                                                               \
+        if ((level) <= log_level)                                                                                      \
+            printf(__VA_ARGS__);                                                                                       \
+    } while (0)
+
 void  perror_and_exit(const char *msg);
 char *readLine(FILE *fp, char *buf, const int n);
 void  flushstdin();
@@ -0,0 +1,141 @@
+"""
+Just enough of the msgq protocol (see src/Utils/proto.h) for
+the tests to talk to a broker. The broker is found on
+127.0.0.1 at MSGQ_PORT, its publisher port; the subscriber
+port moves along with it, as with broker -l.
+"""
+
+import os
+import select
+import socket
+import struct
+import time
+
+PUB_PORT = int(os.environ.get("MSGQ_PORT", "14342"))
+SUB_PORT = PUB_PORT - 14342 + 11312
+
+OP_PUBLISH, OP_FETCH, OP_MSG, OP_NOMSG, OP_ERROR, OP_ACK = 1, 2, 3, 4, 5, 6
+OP_SUBSCRIBE, OP_PUSH, OP_FETCH_BATCH, OP_BATCH = 7, 8, 9, 10
+OP_PUBLISH_BATCH, OP_BATCH_ACK, OP_JOIN, OP_ASSIGN, OP_COMMIT = 11, 12, 13, 14, 15
+OP_HELLO, OP_CREDIT = 18, 19
+
+FLAG_MORE = 1 << 2
+FEAT_CREDIT, FEAT_CHUNKS = 1 << 1, 1 << 3
+ERR_MALFORMED, ERR_STORE, ERR_GROUP = 1, 3, 4
+
+CHUNK_LEN = 1 << 20
+
+
+def topic(name):
+    """A topic of this run only, so tests can be run again against the same broker."""
+    return "%s.%d" % (name, os.getpid())
+
+
+def string(s):
+    s = s.encode()
+    return struct.pack(">H", len(s)) + s
+
+
+def u32(n):
+    return struct.pack(">I", n)
+
+
+def u64(n):
+    return struct.pack(">Q", n)
+
+
+class Conn:
+    def __init__(self, port):
+        # the broker may still be starting up
+        for _ in range(50):
+            try:
+                self.sock = socket.create_connection(("127.0.0.1", port))
+                return
+            except ConnectionRefusedError:
+                time.sleep(0.1)
+        raise ConnectionRefusedError("no broker on port %d" % port)
+
+    def send(self, op, payload, flags=0):
+        self.sock.sendall(struct.pack(">BBHI", 1, op, flags, len(payload)) + payload)
+
+    def _read(self, n):
+        data = bytearray()
+        while len(data) < n:
+            got = self.sock.recv(min(n - len(data), 1 << 20))
+            if not got:
+                raise EOFError("broker closed the connection")
+            data += got
+        return bytes(data)
+
+    def recv(self, timeout=5.0):
+        """The next frame as (op, flags, payload)."""
+        self.sock.settimeout(timeout)
+        try:
+            _, op, flags, n = struct.unpack(">BBHI", self._read(8))
+            return op, flags, self._read(n)
+        finally:
+            self.sock.settimeout(None)
+
+    def drain(self, timeout=0.5):
+        """Every frame that arrives until none has for timeout seconds."""
+        frames = []
+        while select.select([self.sock], [], [], timeout)[0]:
+            frames.append(self.recv())
+        return frames
+
+    def request(self, op, payload, flags=0):
+        self.send(op, payload, flags)
+        return self.recv()
+
+    def hello(self, features):
+        op, _, payload = self.request(OP_HELLO, u32(features))
+        assert op == OP_HELLO, op
+        return struct.unpack(">I", payload[:4])[0]
+
+    def publish(self, name, message):
+        op, _, payload = self.request(OP_PUBLISH, string(name) + message)
+        assert op == OP_ACK, (op, payload)
+        return struct.unpack(">Q", payload)[0]
+
+    def publish_batch(self, name, messages, batch=0):
+        body = b"".join(u32(len(m)) + m for m in messages)
+        op, _, payload = self.request(OP_PUBLISH_BATCH, string(name) + u64(batch) + u32(len(messages)) + body)
+        assert op == OP_BATCH_ACK, (op, payload)
+        return struct.unpack(">QQI", payload)
+
+    def close(self):
+        self.sock.close()
+
+
+def publisher():
+    return Conn(PUB_PORT)
+
+
+def subscriber():
+    return Conn(SUB_PORT)
+
+
+def error(frame):
+    """The code of an OP_ERROR frame."""
+    op, _, payload = frame
+    assert op == OP_ERROR, (op, payload)
+    return struct.unpack(">H", payload[:2])[0]
+
+
+def push(payload):
+    """The topic, id and message of an OP_PUSH."""
+    n = struct.unpack(">H", payload[:2])[0]
+    return payload[2 : 2 + n].decode(), struct.unpack(">Q", payload[2 + n : 10 + n])[0], payload[10 + n :]
+
+
+def batch(payload):
+    """The first id and messages of an OP_BATCH without compressed entries."""
+    first, count = struct.unpack(">QI", payload[:12])
+    messages, at = [], 12
+    for _ in range(count):
+        n, packed, _ = struct.unpack(">IIq", payload[at : at + 16])
+        assert packed == 0
+        messages.append(payload[at + 16 : at + 16 + n])
+        at += 16 + n
+    assert at == len(payload)
+    return first, messages
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Runs every tests/test_*.py against a broker of its own, started
+# from the build in the parent directory on MSGQ_PORT (default 24342)
+# so that it does not meet a broker already running on the usual ports.
+
+cd "$(dirname "$0")/.." || exit 1
+MSGQ_PORT=${MSGQ_PORT:-24342}
+export MSGQ_PORT
+
+./broker -q -t 2 -l "127.0.0.1:$MSGQ_PORT" &
+broker=$!
+trap 'kill $broker 2>/dev/null' EXIT
+
+failed=0
+for test in tests/test_*.py; do
+    if python3 "$test"; then
+        echo "ok      $test"
+    else
+        echo "FAILED  $test"
+        failed=1
+    fi
+done
+
+exit $failed
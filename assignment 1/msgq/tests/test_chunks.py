@@ -0,0 +1,58 @@
+"""Messages larger than a frame, published, fetched and pushed in pieces (FEAT_CHUNKS)."""
+
+import os
+
+from msgq import *
+
+name = topic("chunks")
+large = os.urandom(3 * CHUNK_LEN + 12345)
+
+
+def publish_pieces(conn, message):
+    for at in range(0, len(message), CHUNK_LEN):
+        more = at + CHUNK_LEN < len(message)
+        conn.send(OP_PUBLISH, string(name) + message[at : at + CHUNK_LEN], FLAG_MORE if more else 0)
+    return conn.recv()
+
+
+pub = publisher()
+assert pub.hello(FEAT_CHUNKS) & FEAT_CHUNKS
+assert pub.publish(name, b"small") == 0
+assert publish_pieces(pub, large) == (OP_ACK, 0, u64(1))
+
+# without the feature a message cannot be gathered
+plain = publisher()
+assert error(publish_pieces(plain, b"x" * (CHUNK_LEN + 1))) == ERR_STORE
+
+sub = subscriber()
+assert sub.hello(FEAT_CHUNKS) & FEAT_CHUNKS
+
+
+def fetch_all(id):
+    message = bytearray()
+    while True:
+        offset = u64(len(message)) if message else b""
+        op, flags, payload = sub.request(OP_FETCH, string(name) + u64(id) + offset)
+        assert op == OP_MSG and payload[:8] == u64(id), (op, payload[:16])
+        message += payload[8:]
+        if not flags & FLAG_MORE:
+            return bytes(message)
+
+
+assert fetch_all(0) == b"small"
+assert fetch_all(1) == large
+
+# a stream gets the large message in pieces too
+stream = subscriber()
+assert stream.hello(FEAT_CHUNKS) & FEAT_CHUNKS
+stream.send(OP_SUBSCRIBE, string(name) + u64(0))
+messages, done = {}, []
+while len(done) < 2:
+    op, flags, payload = stream.recv()
+    if op != OP_PUSH:
+        continue
+    _, id, piece = push(payload)
+    messages[id] = messages.get(id, b"") + piece
+    if not flags & FLAG_MORE:
+        done.append(id)
+assert done == [0, 1] and messages == {0: b"small", 1: large}
@@ -0,0 +1,40 @@
+"""OP_PUBLISH_BATCH and OP_FETCH_BATCH."""
+
+import struct
+
+from msgq import *
+
+name = topic("batch")
+pub = publisher()
+messages = [b"message %d" % i for i in range(50)]
+assert pub.publish_batch(name, messages[:20], batch=7) == (7, 0, 20)
+assert pub.publish_batch(name, messages[20:], batch=8) == (8, 20, 30)
+
+sub = subscriber()
+
+
+def fetch_batch(first, count, nbytes):
+    return sub.request(OP_FETCH_BATCH, string(name) + u64(first) + u32(count) + u32(nbytes))
+
+
+def fetched(first, count, nbytes=1 << 20):
+    op, _, payload = fetch_batch(first, count, nbytes)
+    assert op == OP_BATCH, (op, payload)
+    return batch(payload)
+
+
+assert fetched(0, 10) == (0, messages[:10])
+assert fetched(45, 100) == (45, messages[45:])
+
+# nothing more to read
+op, _, payload = fetch_batch(50, 10, 1 << 20)
+assert op == OP_BATCH and struct.unpack(">QI", payload) == (50, 0)
+
+# a message larger than the byte limit still comes, on its own
+assert fetched(3, 10, 1) == (3, messages[3:4])
+
+assert error(fetch_batch(0, 0, 1 << 20)) == ERR_MALFORMED
+
+# single fetches see the same messages
+op, _, payload = sub.request(OP_FETCH, string(name) + u64(42))
+assert op == OP_MSG and payload == u64(42) + messages[42]
@@ -0,0 +1,70 @@
+"""Consumer groups: partitions dealt between members, commits, and members leaving."""
+
+import struct
+
+from msgq import *
+
+PARTITIONS = 16  # the broker's default, without -p
+
+name = topic("group")
+group = "workers"
+
+
+def assignment(payload):
+    """The generation and partitions of an OP_ASSIGN."""
+    at = 0
+    for _ in range(2):
+        at += 2 + struct.unpack(">H", payload[at : at + 2])[0]
+    generation, partitions, count = struct.unpack(">QII", payload[at : at + 16])
+    assert partitions == PARTITIONS
+    return generation, [struct.unpack(">I", payload[at + 16 + 4 * i : at + 20 + 4 * i])[0] for i in range(count)]
+
+
+def received(member):
+    """The partitions last assigned to the member and the ids pushed to it."""
+    parts, ids = None, []
+    for op, _, payload in member.drain():
+        if op == OP_ASSIGN:
+            parts = assignment(payload)[1]
+        elif op == OP_PUSH:
+            ids.append(push(payload)[1])
+    return parts, ids
+
+
+pub = publisher()
+pub.publish_batch(name, [b"m%d" % i for i in range(32)])
+
+a = subscriber()
+a.send(OP_JOIN, string(name) + string(group))
+parts, ids = received(a)
+assert sorted(parts) == list(range(PARTITIONS))
+assert sorted(ids) == list(range(32))
+
+# a second member takes half of the partitions, and the messages in them
+b = subscriber()
+b.send(OP_JOIN, string(name) + string(group))
+b_parts, b_ids = received(b)
+a_parts, _ = received(a)
+assert sorted(a_parts + b_parts) == list(range(PARTITIONS))
+assert len(b_parts) == PARTITIONS // 2
+assert sorted(b_ids) == sorted(i for i in range(32) if i % PARTITIONS in b_parts)
+
+# new messages go to the member that owns their partition
+pub.publish_batch(name, [b"m%d" % i for i in range(32, 48)])
+_, a_ids = received(a)
+_, b_ids = received(b)
+assert sorted(a_ids) == [i for i in range(32, 48) if i % PARTITIONS in a_parts]
+assert sorted(b_ids) == [i for i in range(32, 48) if i % PARTITIONS in b_parts]
+
+# committing moves one partition forward per id
+committed = [i for i in range(32, 48) if i % PARTITIONS in a_parts][:3]
+op, _, payload = a.request(OP_COMMIT, string(name) + string(group) + u32(len(committed)) + b"".join(map(u64, committed)))
+assert op == OP_ACK and struct.unpack(">Q", payload)[0] == 3
+
+# once b leaves, a gets its partitions from where the group last committed, none of them yet
+b.close()
+parts, ids = received(a)
+assert sorted(parts) == list(range(PARTITIONS))
+assert sorted(ids) == [i for i in range(48) if i % PARTITIONS in b_parts]
+
+assert error(a.request(OP_COMMIT, string(name) + string("nobody") + u32(1) + u64(0))) == ERR_GROUP
@@ -0,0 +1,70 @@
+"""Subscriptions: stored and live pushes, credit, and readers that fall behind."""
+
+import struct
+
+from msgq import *
+
+
+def pushes(frames):
+    return [push(p) for op, _, p in frames if op == OP_PUSH]
+
+
+def stored_then_live():
+    name = topic("stream")
+    pub = publisher()
+    messages = [b"m%d" % i for i in range(100)]
+    pub.publish_batch(name, messages)
+
+    sub = subscriber()
+    sub.send(OP_SUBSCRIBE, string(name) + u64(0))
+    frames = sub.drain()
+    assert (OP_ACK, 0, u64(0)) in frames
+    assert pushes(frames) == [(name, i, m) for i, m in enumerate(messages)]
+
+    pub.publish(name, b"live")
+    assert pushes(sub.drain()) == [(name, 100, b"live")]
+
+
+def credit():
+    name = topic("credit")
+    pub = publisher()
+    pub.publish_batch(name, [b"x" * 100] * 50)
+
+    sub = subscriber()
+    assert sub.hello(FEAT_CREDIT) & FEAT_CREDIT
+    sub.send(OP_SUBSCRIBE, string(name) + u64(0) + u32(250))
+    # the last push may overdraw the credit
+    assert len(pushes(sub.drain())) == 3
+
+    sub.send(OP_CREDIT, string(name) + u32(1000))
+    assert [i for _, i, _ in pushes(sub.drain())] == list(range(3, 13))
+
+
+def reader_that_stops():
+    name = topic("window")
+    pub = publisher()
+    messages = [struct.pack(">I", i) * 250 for i in range(5000)]
+    for at in range(0, len(messages), 500):
+        pub.publish_batch(name, messages[at : at + 500])
+
+    # one subscriber never reads, which must not hold up another
+    idle = subscriber()
+    idle.send(OP_SUBSCRIBE, string(name) + u64(0))
+
+    sub = subscriber()
+    sub.send(OP_SUBSCRIBE, string(name) + u64(0))
+    next = 0
+    while next < len(messages):
+        op, _, payload = sub.recv()
+        if op == OP_ACK:
+            continue
+        assert op == OP_PUSH
+        assert push(payload) == (name, next, messages[next])
+        next += 1
+
+    idle.close()
+
+
+stored_then_live()
+credit()
+reader_that_stops()